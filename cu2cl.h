@@ -0,0 +1,96 @@
+/*
+* CU2CL - A prototype CUDA-to-OpenCL translator built on the Clang compiler infrastructure
+* Version 0.8.0b (beta)
+*
+* (C) 2010-2017 Virginia Polytechnic Institute & State University (also known as "Virginia Tech"). All Rights Reserved.
+* This software is provided as-is.  Neither the authors, Virginia Tech nor Virginia Tech Intellectual Properties, Inc. assert, warrant, or guarantee that the software is fit for any purpose whatsoever, nor do they collectively or individually accept any responsibility or liability for any action or activity that results from the use of this software.  The entire risk as to the quality and performance of the software rests with the user, and no remedies shall be provided by the authors, Virginia Tech or Virginia Tech Intellectual Properties, Inc.
+*
+*    This library is free software; you can redistribute it and/or modify it under the terms of the attached GNU Lesser General Public License v2.1 as published by the Free Software Foundation.
+*
+*    This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License along with this library; if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*
+* Authors: Paul Sathre, Gabriel Martinez
+*
+*/
+
+//The libcu2cl interface: translation as a library call, with sources and outputs held in memory
+//cu2cl-tool is a thin wrapper around it that reads its options from the command line and
+// writes the outputs to disk
+
+#ifndef CU2CL_H
+#define CU2CL_H
+
+#include "clang/Tooling/CompilationDatabase.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cu2cl {
+
+    //Everything that changes how a session translates, each one a cu2cl-tool option
+    struct TranslationOptions {
+	bool AddInlineComments; //defaults to ON, turn off with '--inline-comments=false' at the command line
+	//Extra Arguments to be appended to all generated clBuildProgram calls.
+	std::string ExtraBuildArgs; //defaults to "", add more with '--cl-build-args="<args>"'
+	bool FilterKernelName; //defaults to OFF, turn on with '--rename-kernel-files' or '--rename-kernel-files=true'
+	//Where the generated __cu2cl_Init keeps built OpenCL program binaries at runtime
+	std::string BinaryCacheDir; //defaults to "" (always build from source), set with '--cl-binary-cache=<dir>'
+	bool ConcurrentBuilds; //defaults to OFF, turn on with '--concurrent-builds' to build every program at once at runtime
+	bool LazyInit; //defaults to OFF, turn on with '--lazy-init' to build programs and create kernels on first launch instead
+	bool EmbedKernels; //defaults to OFF, turn on with '--embed-kernels' to build programs from cu2cl_kernels.c
+	bool PrecompileKernels; //defaults to OFF, turn on with '--precompile-kernels' to also write SPIR binaries
+	std::string PrecompileArgs; //defaults to "", extra Clang arguments set with '--precompile-kernels="<args>"'
+	//How many MiB of freed device buffers the generated cudaMalloc/cudaFree pool may keep for reuse
+	unsigned MemoryPoolMB; //defaults to 0 (no pool, cudaMalloc is clCreateBuffer), set with '--memory-pool=<MiB>'
+
+	bool UseGCCPaths; //defaults to OFF, turn on with '--import-gcc-paths'
+	unsigned NumJobs; //defaults to 1 (serial), set with '-j N', '-j 0' uses one job per hardware thread
+	std::string CacheDir; //defaults to "" (no caching), set with '--cache-dir=<dir>'
+	bool UsePreludePCH; //defaults to ON, turn off with '--pch-prelude=false'
+	std::string TimeReportFormat; //set with '--time-report' (text) or '--time-report=json'
+	bool ReportTimes; //whether '--time-report' was given at all
+	std::string SummaryFile; //defaults to "" (translate and write output), set with '--emit-summary=<file>'
+	bool MergeSummaries; //defaults to OFF, turn on with '--merge' to treat the inputs as summary files
+	bool UsePreScan; //defaults to ON, turn off with '--prescan=false' to parse every file
+	bool SkipHeaderBodies; //defaults to ON, turn off with '--skip-header-bodies=false'
+
+	TranslationOptions() : AddInlineComments(true), FilterKernelName(false), ConcurrentBuilds(false), LazyInit(false), EmbedKernels(false), PrecompileKernels(false), MemoryPoolMB(0), UseGCCPaths(false), NumJobs(1),
+	    UsePreludePCH(true), ReportTimes(false), MergeSummaries(false), UsePreScan(true), SkipHeaderBodies(true) { }
+    };
+
+    struct SessionState;
+
+    //One translation of a set of source files, with its own copy of everything the translator
+    // accumulates across files, so several sessions can coexist in one process
+    //Sessions on different threads may run at the same time, as long as their compile commands
+    // agree on a working directory, since ClangTool changes the process' directory to it
+    class TranslationSession {
+    public:
+	TranslationSession(const TranslationOptions &options = TranslationOptions());
+	~TranslationSession();
+
+	//Serve path (which should be absolute) from contents instead of the disk, to the parser
+	// and to the rewriter. Must be called before translate()
+	void addFile(const std::string &path, const std::string &contents);
+
+	//Translate sources (or, with MergeSummaries, merge them) as cu2cl-tool does, once per session
+	// Returns non-zero if any file failed to translate
+	int translate(const clang::tooling::CompilationDatabase &compilations, const std::vector<std::string> &sources);
+
+	//Every file translate() produced, by the name cu2cl-tool writes it to: the *-cl.cpp/*-cl.cl/*-cl.h
+	// outputs by absolute path, cu2cl_util.c/h/cl, cu2cl_globals.h and cu2cl_kernels.c by their bare names
+	const std::map<std::string, std::string> &getOutputs() const;
+
+    private:
+	TranslationSession(const TranslationSession &);
+	void operator=(const TranslationSession &);
+
+	SessionState *State;
+    };
+
+}
+
+#endif
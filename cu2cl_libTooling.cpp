@@ -15,6 +15,11 @@
 *
 */
 
+//Folded into translation cache keys, so entries written by another version are never reused
+#define CU2CL_VERSION "0.8.0b"
+//Bumped whenever what the translation cache and summaries record changes within a version
+#define CU2CL_CACHE_FORMAT "2"
+
 #define CU2CL_LICENSE \
 	"/* (C) 2010-2017 Virginia Polytechnic Institute & State University (also known as \"Virginia Tech\"). All Rights Reserved.\n" \
 	"/* This software is provided as-is.  Neither the authors, Virginia Tech nor Virginia Tech Intellectual Properties, Inc. assert, warrant, or guarantee that the software is fit for any purpose whatsoever, nor do they collectively or individually accept any responsibility or liability for any action or activity that results from the use of this software.  The entire risk as to the quality and performance of the software rests with the user, and no remedies shall be provided by the authors, Virginia Tech or Virginia Tech Intellectual Properties, Inc.\n" \
@@ -25,6 +30,8 @@
 	"*\n" \
 	"*   You should have received a copy of the GNU Lesser General Public License along with this library; if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA \n" \
 	"*/\n" 
+#include "cu2cl.h"
+
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/Decl.h"
@@ -34,6 +41,10 @@
 #include "clang/Basic/Diagnostic.h"
 #include "clang/Basic/FileManager.h"
 #include "clang/Basic/SourceManager.h"
+#include "clang/Basic/TargetOptions.h"
+
+//Needed for '--precompile-kernels'
+#include "clang/CodeGen/CodeGenAction.h"
 
 //Added during the libTooling conversion
 #include "clang/Driver/Options.h"
@@ -45,21 +56,36 @@
 
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Lex/PPCallbacks.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "clang/Lex/HeaderSearchOptions.h"
 
 #include "clang/Rewrite/Core/Rewriter.h"
 
 //Added during the libTooling conversion
-#include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 //Support the RefactoringTool class
 #include "clang/Tooling/Refactoring.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Support/Regex.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <list>
 #include <map>
 #include <set>
@@ -67,7 +93,13 @@
 #include <string>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <ctime>
+
+#include <sys/resource.h>
 
 //Injects a small amount of code to time the translation process
 #define CU2CL_ENABLE_TIMING
@@ -134,6 +166,269 @@
     "    return len;\n" \
     "}\n\n"
 
+//Builds a program from source through an on-disk cache of program binaries ('--cl-binary-cache')
+// Binaries are keyed by an FNV-1a hash of the source (and of every file it quote-#includes, found
+// through "-I ." like the build finds them), the build options, and the device's name and driver version, and kept in __cu2cl_BinaryCacheDir (#defined ahead of it) unless $CU2CL_BINARY_CACHE names another one
+//A binary that fails to load or build is rebuilt from source and replaced
+#define CL_BUILD_PROGRAM_CACHED_H \
+    "cl_program __cu2cl_BuildProgramCached(const char *progSrc, size_t progLen, const char *options);\n"
+
+#define CL_BUILD_PROGRAM_CACHED \
+    "#include <string.h>\n" \
+    "#ifdef _WIN32\n" \
+    "#include <direct.h>\n" \
+    "#include <process.h>\n" \
+    "#define __cu2cl_MakeDir(dir) _mkdir(dir)\n" \
+    "#define __cu2cl_GetPID() _getpid()\n" \
+    "#else\n" \
+    "#include <sys/stat.h>\n" \
+    "#include <unistd.h>\n" \
+    "#define __cu2cl_MakeDir(dir) mkdir(dir, 0777)\n" \
+    "#define __cu2cl_GetPID() getpid()\n" \
+    "#endif\n\n" \
+    "static unsigned long long __cu2cl_HashBytes(unsigned long long hash, const char *data, size_t len) {\n" \
+    "    size_t i;\n" \
+    "    for (i = 0; i < len; i++) {\n" \
+    "        hash ^= (unsigned char) data[i];\n" \
+    "        hash *= 1099511628211ULL;\n" \
+    "    }\n" \
+    "    return hash;\n" \
+    "}\n\n" \
+    "static char *__cu2cl_ReadCacheFile(const char *path, size_t *len) {\n" \
+    "    FILE *f = fopen(path, \"rb\");\n" \
+    "    char *data = NULL;\n" \
+    "    long size;\n" \
+    "    if (f == NULL) return NULL;\n" \
+    "    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0) {\n" \
+    "        rewind(f);\n" \
+    "        data = (char *) malloc((size_t) size);\n" \
+    "        if (data != NULL && fread(data, 1, (size_t) size, f) != (size_t) size) {\n" \
+    "            free(data);\n" \
+    "            data = NULL;\n" \
+    "        }\n" \
+    "        *len = (size_t) size;\n" \
+    "    }\n" \
+    "    fclose(f);\n" \
+    "    return data;\n" \
+    "}\n\n" \
+    "//Included kernel files can include each other, depth bounds the walk through a guarded cycle\n" \
+    "static unsigned long long __cu2cl_HashIncludes(unsigned long long hash, const char *src, size_t len, int depth) {\n" \
+    "    const char *p = src, *end = src + len, *eol, *close;\n" \
+    "    char name[4096], *inc;\n" \
+    "    size_t incLen = 0;\n" \
+    "    if (depth > 16) return hash;\n" \
+    "    for (; p < end; p = eol + 1) {\n" \
+    "        eol = (const char *) memchr(p, '\\n', end - p);\n" \
+    "        if (eol == NULL) eol = end;\n" \
+    "        while (p < eol && (*p == ' ' || *p == '\\t')) p++;\n" \
+    "        if (p == eol || *p++ != '#') continue;\n" \
+    "        while (p < eol && (*p == ' ' || *p == '\\t')) p++;\n" \
+    "        if (eol - p < 8 || strncmp(p, \"include\", 7) != 0) continue;\n" \
+    "        p += 7;\n" \
+    "        while (p < eol && (*p == ' ' || *p == '\\t')) p++;\n" \
+    "        if (p == eol || *p != '\"' || (close = (const char *) memchr(p + 1, '\"', eol - p - 1)) == NULL) continue;\n" \
+    "        if ((size_t) (close - p - 1) >= sizeof(name)) continue;\n" \
+    "        memcpy(name, p + 1, close - p - 1);\n" \
+    "        name[close - p - 1] = '\\0';\n" \
+    "        //A missing file is keyed by its name alone\n" \
+    "        hash = __cu2cl_HashBytes(hash, name, strlen(name) + 1);\n" \
+    "        if ((inc = __cu2cl_ReadCacheFile(name, &incLen)) != NULL) {\n" \
+    "            hash = __cu2cl_HashBytes(hash, inc, incLen);\n" \
+    "            hash = __cu2cl_HashBytes(hash, \"\", 1);\n" \
+    "            hash = __cu2cl_HashIncludes(hash, inc, incLen, depth + 1);\n" \
+    "            free(inc);\n" \
+    "        }\n" \
+    "    }\n" \
+    "    return hash;\n" \
+    "}\n\n" \
+    "cl_program __cu2cl_BuildProgramCached(const char *progSrc, size_t progLen, const char *options) {\n" \
+    "    char devName[256] = \"\", driverVersion[256] = \"\", path[4096], tempPath[4096];\n" \
+    "    unsigned long long hash = 14695981039346656037ULL;\n" \
+    "    const char *dir = getenv(\"CU2CL_BINARY_CACHE\");\n" \
+    "    unsigned char *bin = NULL;\n" \
+    "    size_t binLen = 0;\n" \
+    "    cl_program prog = NULL;\n" \
+    "    cl_int ret = CL_SUCCESS;\n" \
+    "    FILE *f;\n" \
+    "    int ok;\n" \
+    "    if (dir == NULL || dir[0] == '\\0') dir = __cu2cl_BinaryCacheDir;\n" \
+    "    clGetDeviceInfo(__cu2cl_Device, CL_DEVICE_NAME, sizeof(devName) - 1, devName, NULL);\n" \
+    "    clGetDeviceInfo(__cu2cl_Device, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, driverVersion, NULL);\n" \
+    "    //Each string is hashed with its terminator, so no two sets of fields run together\n" \
+    "    hash = __cu2cl_HashBytes(hash, progSrc, progLen);\n" \
+    "    hash = __cu2cl_HashBytes(hash, \"\", 1);\n" \
+    "    hash = __cu2cl_HashIncludes(hash, progSrc, progLen, 0);\n" \
+    "    hash = __cu2cl_HashBytes(hash, options, strlen(options) + 1);\n" \
+    "    hash = __cu2cl_HashBytes(hash, devName, strlen(devName) + 1);\n" \
+    "    hash = __cu2cl_HashBytes(hash, driverVersion, strlen(driverVersion) + 1);\n" \
+    "    snprintf(path, sizeof(path), \"%s/%016llx.bin\", dir, hash);\n" \
+    "\n" \
+    "    //Hit: load and build the binary\n" \
+    "    bin = (unsigned char *) __cu2cl_ReadCacheFile(path, &binLen);\n" \
+    "    if (bin != NULL) {\n" \
+    "        prog = clCreateProgramWithBinary(__cu2cl_Context, 1, &__cu2cl_Device, &binLen, (const unsigned char **) &bin, NULL, &ret);\n" \
+    "        if (ret == CL_SUCCESS) ret = clBuildProgram(prog, 1, &__cu2cl_Device, options, NULL, NULL);\n" \
+    "        if (ret != CL_SUCCESS && prog != NULL) clReleaseProgram(prog);\n" \
+    "        if (ret != CL_SUCCESS) prog = NULL;\n" \
+    "        free(bin);\n" \
+    "        if (prog != NULL) return prog;\n" \
+    "    }\n" \
+    "\n" \
+    "    //Miss: build from source, then save the binary under a temporary name and move it into place\n" \
+    "    prog = clCreateProgramWithSource(__cu2cl_Context, 1, &progSrc, &progLen, NULL);\n" \
+    "    if (clBuildProgram(prog, 1, &__cu2cl_Device, options, NULL, NULL) != CL_SUCCESS) return prog;\n" \
+    "    binLen = 0;\n" \
+    "    clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binLen, NULL);\n" \
+    "    if (binLen == 0) return prog;\n" \
+    "    bin = (unsigned char *) malloc(binLen);\n" \
+    "    if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &bin, NULL) == CL_SUCCESS) {\n" \
+    "        __cu2cl_MakeDir(dir);\n" \
+    "        //Unique to this process and program, since '--concurrent-builds' may save from several threads\n" \
+    "        snprintf(tempPath, sizeof(tempPath), \"%s.%d.%p.tmp\", path, (int) __cu2cl_GetPID(), (void *) prog);\n" \
+    "        f = fopen(tempPath, \"wb\");\n" \
+    "        if (f != NULL) {\n" \
+    "            ok = fwrite(bin, 1, binLen, f) == binLen;\n" \
+    "            if (fclose(f) != 0) ok = 0;\n" \
+    "            if (!ok || rename(tempPath, path) != 0) remove(tempPath);\n" \
+    "        }\n" \
+    "    }\n" \
+    "    free(bin);\n" \
+    "    return prog;\n" \
+    "}\n\n"
+
+//Builds a program from the SPIR binaries '--precompile-kernels' wrote, on devices with cl_khr_spir
+// Picks the spir or spir64 binary by the device's address width, and returns NULL (so the caller
+// builds from source instead) if the device takes neither, the binary is missing, or it fails to build
+#define CL_BUILD_PROGRAM_SPIR_H \
+    "cl_program __cu2cl_BuildProgramSPIR(const char *spir, size_t spirLen, const char *spir64, size_t spir64Len, const char *options);\n" \
+    "\ncl_program __cu2cl_BuildProgramSPIRFile(const char *spirFile, const char *spir64File, const char *options);\n"
+
+#define CL_BUILD_PROGRAM_SPIR \
+    "#include <string.h>\n\n" \
+    "static int __cu2cl_SPIRBits() {\n" \
+    "    size_t size = 0;\n" \
+    "    cl_uint bits = 0;\n" \
+    "    char *ext;\n" \
+    "    int ret;\n" \
+    "    clGetDeviceInfo(__cu2cl_Device, CL_DEVICE_EXTENSIONS, 0, NULL, &size);\n" \
+    "    ext = (char *) calloc(size + 1, 1);\n" \
+    "    clGetDeviceInfo(__cu2cl_Device, CL_DEVICE_EXTENSIONS, size, ext, NULL);\n" \
+    "    clGetDeviceInfo(__cu2cl_Device, CL_DEVICE_ADDRESS_BITS, sizeof(cl_uint), &bits, NULL);\n" \
+    "    ret = strstr(ext, \"cl_khr_spir\") != NULL ? (int) bits : 0;\n" \
+    "    free(ext);\n" \
+    "    return ret;\n" \
+    "}\n\n" \
+    "cl_program __cu2cl_BuildProgramSPIR(const char *spir, size_t spirLen, const char *spir64, size_t spir64Len, const char *options) {\n" \
+    "    int bits = __cu2cl_SPIRBits();\n" \
+    "    const char *bin = bits == 64 ? spir64 : spir;\n" \
+    "    size_t binLen = bits == 64 ? spir64Len : spirLen;\n" \
+    "    char *spirOptions;\n" \
+    "    cl_program prog;\n" \
+    "    cl_int ret = CL_SUCCESS;\n" \
+    "    if ((bits != 32 && bits != 64) || binLen == 0) return NULL;\n" \
+    "    prog = clCreateProgramWithBinary(__cu2cl_Context, 1, &__cu2cl_Device, &binLen, (const unsigned char **) &bin, NULL, &ret);\n" \
+    "    if (ret != CL_SUCCESS) return NULL;\n" \
+    "    spirOptions = (char *) malloc(strlen(options) + 32);\n" \
+    "    sprintf(spirOptions, \"%s -x spir -spir-std=1.2\", options);\n" \
+    "    ret = clBuildProgram(prog, 1, &__cu2cl_Device, spirOptions, NULL, NULL);\n" \
+    "    free(spirOptions);\n" \
+    "    if (ret != CL_SUCCESS) {\n" \
+    "        clReleaseProgram(prog);\n" \
+    "        return NULL;\n" \
+    "    }\n" \
+    "    return prog;\n" \
+    "}\n\n" \
+    "cl_program __cu2cl_BuildProgramSPIRFile(const char *spirFile, const char *spir64File, const char *options) {\n" \
+    "    int bits = __cu2cl_SPIRBits();\n" \
+    "    cl_program prog;\n" \
+    "    size_t binLen;\n" \
+    "    char *bin;\n" \
+    "    long size;\n" \
+    "    FILE *f;\n" \
+    "    if (bits != 32 && bits != 64) return NULL;\n" \
+    "    f = fopen(bits == 64 ? spir64File : spirFile, \"rb\");\n" \
+    "    if (f == NULL) return NULL;\n" \
+    "    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0 || (bin = (char *) malloc((size_t) size)) == NULL) {\n" \
+    "        fclose(f);\n" \
+    "        return NULL;\n" \
+    "    }\n" \
+    "    binLen = (size_t) size;\n" \
+    "    rewind(f);\n" \
+    "    if (fread(bin, 1, binLen, f) != binLen) binLen = 0;\n" \
+    "    fclose(f);\n" \
+    "    prog = __cu2cl_BuildProgramSPIR(bin, binLen, bin, binLen, options);\n" \
+    "    free(bin);\n" \
+    "    return prog;\n" \
+    "}\n\n"
+
+//Runs the per-file __cu2cl_Init_<file> functions on their own threads ('--concurrent-builds'), so every
+// program builds at once. Each one creates its kernels right after its own build, in its own thread,
+// and __cu2cl_JoinInits waits for all of them before __cu2cl_Init returns
+//If a thread can't be started, that init just runs on the calling thread
+#define CU2CL_CONCURRENT_INIT_H \
+    "void __cu2cl_StartInit(void (*init)());\n" \
+    "\nvoid __cu2cl_JoinInits();\n"
+
+#define CU2CL_CONCURRENT_INIT \
+    "#ifdef _WIN32\n" \
+    "#include <windows.h>\n" \
+    "typedef HANDLE __cu2cl_Thread;\n" \
+    "#else\n" \
+    "#include <pthread.h>\n" \
+    "typedef pthread_t __cu2cl_Thread;\n" \
+    "#endif\n\n" \
+    "struct __cu2cl_InitThread {\n" \
+    "    void (*init)();\n" \
+    "    __cu2cl_Thread thread;\n" \
+    "};\n\n" \
+    "static struct __cu2cl_InitThread **__cu2cl_InitThreads = NULL;\n" \
+    "static int __cu2cl_InitThreads_size = 0;\n\n" \
+    "#ifdef _WIN32\n" \
+    "static DWORD WINAPI __cu2cl_RunInit(LPVOID arg) {\n" \
+    "    ((struct __cu2cl_InitThread *) arg)->init();\n" \
+    "    return 0;\n" \
+    "}\n" \
+    "#else\n" \
+    "static void *__cu2cl_RunInit(void *arg) {\n" \
+    "    ((struct __cu2cl_InitThread *) arg)->init();\n" \
+    "    return NULL;\n" \
+    "}\n" \
+    "#endif\n\n" \
+    "void __cu2cl_StartInit(void (*init)()) {\n" \
+    "    struct __cu2cl_InitThread *t = (struct __cu2cl_InitThread *) malloc(sizeof(struct __cu2cl_InitThread));\n" \
+    "    int started;\n" \
+    "    t->init = init;\n" \
+    "#ifdef _WIN32\n" \
+    "    t->thread = CreateThread(NULL, 0, __cu2cl_RunInit, t, 0, NULL);\n" \
+    "    started = t->thread != NULL;\n" \
+    "#else\n" \
+    "    started = pthread_create(&t->thread, NULL, __cu2cl_RunInit, t) == 0;\n" \
+    "#endif\n" \
+    "    if (!started) {\n" \
+    "        free(t);\n" \
+    "        init();\n" \
+    "        return;\n" \
+    "    }\n" \
+    "    //Threads are only started from __cu2cl_Init, so the list needs no lock\n" \
+    "    __cu2cl_InitThreads = (struct __cu2cl_InitThread **) realloc(__cu2cl_InitThreads, sizeof(struct __cu2cl_InitThread *) * (__cu2cl_InitThreads_size + 1));\n" \
+    "    __cu2cl_InitThreads[__cu2cl_InitThreads_size++] = t;\n" \
+    "}\n\n" \
+    "void __cu2cl_JoinInits() {\n" \
+    "    int i;\n" \
+    "    for (i = 0; i < __cu2cl_InitThreads_size; i++) {\n" \
+    "#ifdef _WIN32\n" \
+    "        WaitForSingleObject(__cu2cl_InitThreads[i]->thread, INFINITE);\n" \
+    "        CloseHandle(__cu2cl_InitThreads[i]->thread);\n" \
+    "#else\n" \
+    "        pthread_join(__cu2cl_InitThreads[i]->thread, NULL);\n" \
+    "#endif\n" \
+    "        free(__cu2cl_InitThreads[i]);\n" \
+    "    }\n" \
+    "    free(__cu2cl_InitThreads);\n" \
+    "    __cu2cl_InitThreads = NULL;\n" \
+    "    __cu2cl_InitThreads_size = 0;\n" \
+    "}\n\n"
+
 //The host-side portion of a kernel to emulate the behavior of cudaMemset
 #define CL_MEMSET_H \
     "cl_int __cu2cl_Memset(cl_mem devPtr, int value, size_t count);\n"
@@ -252,6 +547,147 @@
     "    return ret;\n" \
     "}\n\n"
 
+//A caching allocator behind cudaMalloc/cudaFree, for '--memory-pool'
+// Freed buffers are kept in power-of-two size classes (from 256 bytes) and handed back out by later
+// allocations of the same class, up to __cu2cl_PoolLimit cached bytes; the rest are released
+//A buffer is only cached once the default queue and every stream's queue have finished, as cudaFree
+// synchronizes the device, so nothing still queued can see it handed out again
+// Stream queues are tracked by the translated cudaStreamCreate/cudaStreamDestroy for this
+#define CL_MEMORY_POOL_H \
+    "cl_int __cu2cl_Malloc(void *mem, size_t size);\n" \
+    "\ncl_int __cu2cl_Free(cl_mem mem);\n" \
+    "\nvoid __cu2cl_TrimPool();\n" \
+    "\ncl_command_queue __cu2cl_PoolTrackQueue(cl_command_queue queue);\n" \
+    "\ncl_int __cu2cl_PoolReleaseQueue(cl_command_queue queue);\n"
+
+#define CL_MEMORY_POOL \
+    "#ifdef _WIN32\n" \
+    "#include <windows.h>\n" \
+    "static SRWLOCK __cu2cl_PoolMutex = SRWLOCK_INIT;\n" \
+    "#define __cu2cl_PoolLock() AcquireSRWLockExclusive(&__cu2cl_PoolMutex)\n" \
+    "#define __cu2cl_PoolUnlock() ReleaseSRWLockExclusive(&__cu2cl_PoolMutex)\n" \
+    "#else\n" \
+    "#include <pthread.h>\n" \
+    "static pthread_mutex_t __cu2cl_PoolMutex = PTHREAD_MUTEX_INITIALIZER;\n" \
+    "#define __cu2cl_PoolLock() pthread_mutex_lock(&__cu2cl_PoolMutex)\n" \
+    "#define __cu2cl_PoolUnlock() pthread_mutex_unlock(&__cu2cl_PoolMutex)\n" \
+    "#endif\n\n" \
+    "struct __cu2cl_PoolEntry {\n" \
+    "    cl_mem mem;\n" \
+    "    struct __cu2cl_PoolEntry *next;\n" \
+    "};\n\n" \
+    "static struct __cu2cl_PoolEntry *__cu2cl_Pool[sizeof(size_t) * 8];\n" \
+    "static size_t __cu2cl_PoolCached = 0;\n" \
+    "static cl_command_queue *__cu2cl_PoolQueues = NULL;\n" \
+    "static int __cu2cl_PoolQueues_size = 0;\n\n" \
+    "cl_command_queue __cu2cl_PoolTrackQueue(cl_command_queue queue) {\n" \
+    "    cl_command_queue *queues;\n" \
+    "    if (queue == NULL) return queue;\n" \
+    "    __cu2cl_PoolLock();\n" \
+    "    queues = (cl_command_queue *) realloc(__cu2cl_PoolQueues, sizeof(cl_command_queue) * (__cu2cl_PoolQueues_size + 1));\n" \
+    "    if (queues != NULL) {\n" \
+    "        __cu2cl_PoolQueues = queues;\n" \
+    "        __cu2cl_PoolQueues[__cu2cl_PoolQueues_size++] = queue;\n" \
+    "    }\n" \
+    "    __cu2cl_PoolUnlock();\n" \
+    "    return queue;\n" \
+    "}\n\n" \
+    "cl_int __cu2cl_PoolReleaseQueue(cl_command_queue queue) {\n" \
+    "    int i;\n" \
+    "    __cu2cl_PoolLock();\n" \
+    "    for (i = 0; i < __cu2cl_PoolQueues_size; i++) {\n" \
+    "        if (__cu2cl_PoolQueues[i] == queue) {\n" \
+    "            __cu2cl_PoolQueues[i] = __cu2cl_PoolQueues[--__cu2cl_PoolQueues_size];\n" \
+    "            break;\n" \
+    "        }\n" \
+    "    }\n" \
+    "    __cu2cl_PoolUnlock();\n" \
+    "    return clReleaseCommandQueue(queue);\n" \
+    "}\n\n" \
+    "static void __cu2cl_PoolFinish() {\n" \
+    "    int i;\n" \
+    "    clFinish(__cu2cl_CommandQueue);\n" \
+    "    __cu2cl_PoolLock();\n" \
+    "    for (i = 0; i < __cu2cl_PoolQueues_size; i++) clFinish(__cu2cl_PoolQueues[i]);\n" \
+    "    __cu2cl_PoolUnlock();\n" \
+    "}\n\n" \
+    "static int __cu2cl_PoolClass(size_t size, size_t *classSize) {\n" \
+    "    int c = 8;\n" \
+    "    while (c < (int) sizeof(size_t) * 8 - 1 && ((size_t) 1 << c) < size) c++;\n" \
+    "    *classSize = (size_t) 1 << c;\n" \
+    "    return c;\n" \
+    "}\n\n" \
+    "cl_int __cu2cl_Malloc(void *mem, size_t size) {\n" \
+    "    size_t classSize;\n" \
+    "    int c = __cu2cl_PoolClass(size, &classSize);\n" \
+    "    struct __cu2cl_PoolEntry *e;\n" \
+    "    cl_int ret = CL_SUCCESS;\n" \
+    "    __cu2cl_PoolLock();\n" \
+    "    e = __cu2cl_Pool[c];\n" \
+    "    if (e != NULL) {\n" \
+    "        __cu2cl_Pool[c] = e->next;\n" \
+    "        __cu2cl_PoolCached -= classSize;\n" \
+    "    }\n" \
+    "    __cu2cl_PoolUnlock();\n" \
+    "    if (e != NULL) {\n" \
+    "        *(cl_mem *) mem = e->mem;\n" \
+    "        free(e);\n" \
+    "        return CL_SUCCESS;\n" \
+    "    }\n" \
+    "    *(cl_mem *) mem = clCreateBuffer(__cu2cl_Context, CL_MEM_READ_WRITE, classSize, NULL, &ret);\n" \
+    "    if (ret != CL_SUCCESS) {\n" \
+    "        //Give the cached buffers back to the driver, and don't round up this time\n" \
+    "        //Free releases a buffer that isn't exactly a class size rather than caching it\n" \
+    "        __cu2cl_TrimPool();\n" \
+    "        *(cl_mem *) mem = clCreateBuffer(__cu2cl_Context, CL_MEM_READ_WRITE, size, NULL, &ret);\n" \
+    "    }\n" \
+    "    return ret;\n" \
+    "}\n\n" \
+    "cl_int __cu2cl_Free(cl_mem mem) {\n" \
+    "    size_t size = 0, classSize;\n" \
+    "    int c, fits;\n" \
+    "    struct __cu2cl_PoolEntry *e;\n" \
+    "    if (mem == NULL) return CL_SUCCESS;\n" \
+    "    clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size_t), &size, NULL);\n" \
+    "    c = __cu2cl_PoolClass(size, &classSize);\n" \
+    "    if (classSize != size) return clReleaseMemObject(mem);\n" \
+    "    //Reserve the room first, so a full pool costs no wait and the wait holds no lock\n" \
+    "    __cu2cl_PoolLock();\n" \
+    "    fits = __cu2cl_PoolCached + classSize <= __cu2cl_PoolLimit;\n" \
+    "    if (fits) __cu2cl_PoolCached += classSize;\n" \
+    "    __cu2cl_PoolUnlock();\n" \
+    "    if (!fits) return clReleaseMemObject(mem);\n" \
+    "    e = (struct __cu2cl_PoolEntry *) malloc(sizeof(struct __cu2cl_PoolEntry));\n" \
+    "    if (e == NULL) {\n" \
+    "        __cu2cl_PoolLock();\n" \
+    "        __cu2cl_PoolCached -= classSize;\n" \
+    "        __cu2cl_PoolUnlock();\n" \
+    "        return clReleaseMemObject(mem);\n" \
+    "    }\n" \
+    "    //Released buffers wait for their commands by themselves, cached ones are reused right away\n" \
+    "    __cu2cl_PoolFinish();\n" \
+    "    e->mem = mem;\n" \
+    "    __cu2cl_PoolLock();\n" \
+    "    e->next = __cu2cl_Pool[c];\n" \
+    "    __cu2cl_Pool[c] = e;\n" \
+    "    __cu2cl_PoolUnlock();\n" \
+    "    return CL_SUCCESS;\n" \
+    "}\n\n" \
+    "void __cu2cl_TrimPool() {\n" \
+    "    struct __cu2cl_PoolEntry *e;\n" \
+    "    int c;\n" \
+    "    __cu2cl_PoolLock();\n" \
+    "    for (c = 0; c < (int) sizeof(size_t) * 8; c++) {\n" \
+    "        while ((e = __cu2cl_Pool[c]) != NULL) {\n" \
+    "            __cu2cl_Pool[c] = e->next;\n" \
+    "            __cu2cl_PoolCached -= (size_t) 1 << c;\n" \
+    "            clReleaseMemObject(e->mem);\n" \
+    "            free(e);\n" \
+    "        }\n" \
+    "    }\n" \
+    "    __cu2cl_PoolUnlock();\n" \
+    "}\n\n"
+
 //A helper function to scan all platforms for all devices and accumulate them into a single array
 // can be used independently of __cu2cl_setDevice, but not intended
 #define CU2CL_SCAN_DEVICES_H \
@@ -325,108 +761,1249 @@ using namespace clang::tooling;
 using namespace llvm::sys::path;
 
 namespace {
-    //Flags used to ensure certain pieces of boilerplate only get added once
-    // Hoisted to the Tool level so they can act over all files when generating cu2cl_util.c/h
-    bool UsesCUDADeviceProp = false;
-    bool UsesCUDAMemset = false;
-    bool UsesCUDAStreamQuery = false;
-    bool UsesCUDAEventElapsedTime = false;
-    bool UsesCUDAEventQuery = false;
-    bool UsesCUDAMallocHost = false;
-    bool UsesCUDAFreeHost = false;
-    bool UsesCUDASetDevice = false;
-    bool UsesCU2CLUtilCL = false;
-    bool UsesCU2CLLoadSrc = false;
-
-    //internal flags for command-line toggles
-    bool AddInlineComments = true; //defaults to ON, turn off with '--inline-comments=false' at the command line
-    //Extra Arguments to be appended to all generated clBuildProgram calls.
-    std::string ExtraBuildArgs; //defaults to "", add more with '--cl-build-args="<args>"'
-    bool FilterKernelName = false; //defaults to OFF, turn on with '--rename-kernel-files' or '--rename-kernel-files=true'
-
-    bool UseGCCPaths = false; //defaults to OFF, turn on with '--import-gcc-paths'
-    //We borrow the OutputFile data structure from Clang's CompilerInstance.h
-    // So that we can use it to store output streams and emulate their temp
-    // file usage at the tool level
+    //Output files are rendered into memory, and only handed over to the session's
+    // outputs once they're complete (the way a CompilerInstance moves its temporary
+    // files into place), so nothing is written to disk while translating
+    //Always allocated with new, since OS refers to Contents
     struct OutputFile {
 	std::string Filename;
-	std::string TempFilename;
+	std::string Contents;
 	raw_ostream *OS;
 
-	OutputFile(const std::string &filename, const std::string &tempFilename, raw_ostream *os) : Filename(filename), TempFilename(tempFilename), OS(os) { }
+	OutputFile(const std::string &filename) : Filename(filename), OS(new llvm::raw_string_ostream(Contents)) { }
+	~OutputFile() { delete OS; }
     };
 
     typedef std::map<std::string, std::vector<std::string> > FileStrCacheMap;
     typedef std::map<std::string, OutputFile *> IDOutFileMap;
 
     //Index structures for looking up all references to a given Decl
-    //typedef std::map<Decl *, std::vector<DeclRefExpr *> > DeclToRefMap;
-    typedef std::tuple<SourceManager *, Preprocessor *, LangOptions *, ASTContext *> SourceTuple;
-    typedef std::map<std::string, std::vector<DeclRefExpr *> > DeclToRefMap;
-    typedef std::map<std::string, std::vector<std::pair<FunctionDecl *, SourceTuple *> > > CanonicalFuncDeclMap;
-    typedef std::vector<std::pair<NamedDecl*, SourceTuple *> > FlaggedDeclVec;
-
-	bool hasFlaggedDecl(FlaggedDeclVec * vec, NamedDecl * decl) {
-		for (FlaggedDeclVec::iterator itr = vec->begin(); itr != vec->end(); itr++){
-			if (itr->first == decl) return true;
+    //A Decl is identified across ASTs by where it starts: a tool-wide file number and the
+    // offset into that file. The first half of the key is the expansion position, the second
+    // the spelling position, so Decls produced by one macro expansion still get distinct keys
+    typedef std::pair<uint64_t, uint64_t> DeclLocKey;
+
+    //Session-wide file numbers, interned by name so they agree between the separate
+    // FileManagers each -j worker uses
+    unsigned internFileName(StringRef name);
+
+    //Builds DeclLocKeys for one SourceManager, remembering the file number of each FileID
+    // so that only the first lookup in each file has to touch the intern table
+    class DeclKeyIndexer {
+    public:
+	DeclKeyIndexer(SourceManager *sm) : SM(sm) { }
+
+	DeclLocKey getKey(SourceLocation loc) {
+	    if (loc.isInvalid()) return DeclLocKey(0, 0);
+	    uint64_t exp = encode(SM->getExpansionLoc(loc));
+	    return DeclLocKey(exp, loc.isMacroID() ? encode(SM->getSpellingLoc(loc)) : exp);
+	}
+
+    private:
+	uint64_t encode(SourceLocation fileLoc) {
+	    std::pair<FileID, unsigned> decomp = SM->getDecomposedLoc(fileLoc);
+	    unsigned &num = FileNumbers[decomp.first];
+	    if (num == 0) {
+		const FileEntry *FE = SM->getFileEntryForID(decomp.first);
+		num = internFileName(FE ? StringRef(FE->getName()) : SM->getBufferName(fileLoc));
+	    }
+	    return ((uint64_t) num << 32) | decomp.second;
+	}
+
+	SourceManager *SM;
+	llvm::DenseMap<FileID, unsigned> FileNumbers;
+    };
+
+    typedef std::tuple<SourceManager *, Preprocessor *, LangOptions *, ASTContext *, DeclKeyIndexer *> SourceTuple;
+
+    //cl_mem propagation is solved over a graph of VarDecls, ParmVarDecls and FieldDecls, identified
+    // across ASTs by their DeclLocKey. Each TU records edges while it walks host code:
+    // - downward: a variable referenced inside argument N of a call -> parameter N of the callee
+    // - upward: parameter N of the callee -> a variable passed directly as argument N
+    // - horizontal: parameter N of each redeclaration <-> parameter N of the first declaration
+    //Every endpoint also records the cl_mem rewrite of its Decl, to be applied if the node gets flagged
+    // It's generated while the TU's AST is still around, so nothing here refers back into an AST
+    typedef std::pair<DeclLocKey, DeclLocKey> PropagationEdge;
+
+    //Nodes are keyed by the Decl's name, since every Decl in a group like "float *a, *b;" shares its start
+    // VecKey is that start, which is what a vector rewrite of the same declaration is keyed by
+    struct PropagationInstance {
+	DeclLocKey Key, VecKey;
+	std::vector<Replacement> Rewrite;
+
+	PropagationInstance(DeclLocKey key, DeclLocKey vecKey) : Key(key), VecKey(vecKey) { }
+    };
+
+    class PropagationGraph {
+    public:
+	void addEdge(const PropagationEdge &edge) {
+	    unsigned from = getNode(edge.first);
+	    Succs[from].push_back(getNode(edge.second));
+	}
+
+	void addInstance(const PropagationInstance &inst) {
+	    Instances[getNode(inst.Key)].push_back(inst);
+	}
+
+	//Mark a node as needing translation, queueing it for solve()
+	void flag(DeclLocKey key) {
+	    unsigned node = getNode(key);
+	    if (!Flagged[node]) {
+		Flagged[node] = true;
+		Worklist.push_back(node);
+	    }
+	}
+
+	//Flag everything reachable from the flagged nodes, linear in the current size of the graph
+	//Each call rescans every flagged node's edges from the start of the worklist, so that edges added
+	// since the last call from nodes it already flagged are followed too; a re-solve rescans everything
+	// Returns all flagged nodes, in the order they were reached
+	const std::vector<unsigned> &solve() {
+	    for (size_t i = 0; i < Worklist.size(); i++) {
+		std::vector<unsigned> &succs = Succs[Worklist[i]];
+		for (std::vector<unsigned>::iterator s = succs.begin(), e = succs.end(); s != e; s++) {
+		    if (!Flagged[*s]) {
+			Flagged[*s] = true;
+			Worklist.push_back(*s);
+		    }
 		}
+	    }
+	    return Worklist;
+	}
+
+	const std::vector<PropagationInstance> &getInstances(unsigned node) {
+	    return Instances[node];
+	}
+
+	//The tool-wide numbers of the files the nodes flagged so far are declared in
+	void getFlaggedFiles(std::set<unsigned> &files) {
+	    for (std::vector<unsigned>::iterator i = Worklist.begin(), e = Worklist.end(); i != e; i++) {
+		files.insert(Keys[*i].first >> 32);
+		files.insert(Keys[*i].second >> 32);
+	    }
+	}
+
+    private:
+	unsigned getNode(DeclLocKey key) {
+	    std::pair<llvm::DenseMap<DeclLocKey, unsigned>::iterator, bool> ins = NodeIDs.insert(std::make_pair(key, (unsigned) Succs.size()));
+	    if (ins.second) {
+		Keys.push_back(key);
+		Succs.push_back(std::vector<unsigned>());
+		Instances.push_back(std::vector<PropagationInstance>());
+		Flagged.push_back(false);
+	    }
+	    return ins.first->second;
+	}
+
+	llvm::DenseMap<DeclLocKey, unsigned> NodeIDs;
+	std::vector<DeclLocKey> Keys;
+	std::vector<std::vector<unsigned> > Succs;
+	std::vector<std::vector<PropagationInstance> > Instances;
+	std::vector<bool> Flagged;
+	std::vector<unsigned> Worklist;
+    };
+
+    //Phases broken out by '--time-report'. The first group is timed inside each TU (and
+    // summed over all of them), the second once at the tool level after every TU is done
+    enum TimePhase {
+	Phase_Prelude,
+	Phase_Parse,
+	Phase_HostRewrite,
+	Phase_KernelRewrite,
+	Phase_CommentFlush,
+	Phase_Dedup,
+	Phase_PreScan,
+	Phase_Propagation,
+	Phase_Apply,
+	Phase_FileFlush,
+	Phase_KernelPrecompile,
+	Phase_Count
+    };
+
+    const char *TimePhaseNames[Phase_Count] = {
+	"Prelude precompile", "Clang parse", "Host rewrite", "Kernel rewrite", "Comment flush",
+	"Dedup/coalesce", "Lexer pre-scan", "cl_mem propagation", "Apply replacements", "File flush",
+	"Kernel precompile"
+    };
+    const char *TimePhaseKeys[Phase_Count] = {
+	"prelude_pch", "parse", "host_rewrite", "kernel_rewrite", "comment_flush",
+	"dedup_coalesce", "prescan", "propagation", "apply_replacements", "file_flush",
+	"kernel_precompile"
+    };
+
+    //Microseconds spent in each phase
+    struct PhaseTimes {
+	uint64_t Wall[Phase_Count];
+	uint64_t CPU[Phase_Count];
+
+	PhaseTimes() {
+	    memset(Wall, 0, sizeof(Wall));
+	    memset(CPU, 0, sizeof(CPU));
+	}
+
+	void add(const PhaseTimes &other) {
+	    for (int i = 0; i < Phase_Count; i++) {
+		Wall[i] += other.Wall[i];
+		CPU[i] += other.CPU[i];
+	    }
+	}
+    };
+
+    uint64_t wallMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    //CPU time of the calling thread only, so '-j' workers don't see each other's time
+    uint64_t cpuMicros() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    //One line of the per-TU section of the report
+    struct TUTimeReport {
+	std::string MainFile;
+	bool FromCache, Copied;
+	PhaseTimes Times;
+	size_t HostReplacements, KernReplacements;
+    };
+}
+
+namespace cu2cl {
+    //Everything a TranslationSession accumulates over its translation units, plus its options
+    //It's reached through Session, which points at the session whichever thread is working for (see translate())
+    struct SessionState : TranslationOptions {
+	SessionState(const TranslationOptions &options) : TranslationOptions(options), UsesCUDADeviceProp(false), UsesCUDAMemset(false),
+	    UsesCUDAStreamQuery(false), UsesCUDAEventElapsedTime(false), UsesCUDAEventQuery(false), UsesCUDAMallocHost(false),
+	    UsesCUDAFreeHost(false), UsesCUDASetDevice(false), UsesCU2CLUtilCL(false), UsesCU2CLLoadSrc(false) { }
+
+	//Flags used to ensure certain pieces of boilerplate only get added once
+	// Hoisted to the Tool level so they can act over all files when generating cu2cl_util.c/h
+	bool UsesCUDADeviceProp;
+	bool UsesCUDAMemset;
+	bool UsesCUDAStreamQuery;
+	bool UsesCUDAEventElapsedTime;
+	bool UsesCUDAEventQuery;
+	bool UsesCUDAMallocHost;
+	bool UsesCUDAFreeHost;
+	bool UsesCUDASetDevice;
+	bool UsesCU2CLUtilCL;
+	bool UsesCU2CLLoadSrc;
+
+	//Sources served from memory (see TranslationSession::addFile), and the finished outputs
+	std::map<std::string, std::string> VirtualFiles;
+	std::map<std::string, std::string> Outputs;
+
+	//See internFileName
+	llvm::StringMap<unsigned> InternedFiles;
+	std::vector<std::string> InternedFileNames;
+	std::mutex InternedFilesMutex;
+
+	//Global Replacement structs, contributed to by each instance of the translator (one-per-main-source-file)
+	// only written to after local deduplication and coalescing
+	std::vector<Replacement> GlobalHostReplace;
+	std::vector<Replacement> GlobalKernReplace;
+
+	//Host vector type rewrites, keyed by the Decl they belong to so cl_mem rewrites can displace them
+	std::map<DeclLocKey, Replacement> GlobalHostVecVars;
+
+	//Declarations flagged for translation, and the graph their cl_mem rewrite propagates across (even across TU boundaries)
+	std::vector<DeclLocKey> DeclsToTranslate;
+	PropagationGraph PropGraph;
+
+	//Global outFiles maps, moved so that they can be shared and written to at the tool level
+	IDOutFileMap OutFiles;
+	IDOutFileMap KernelOutFiles;
+
+	//Global map of declaration statements to the files that own them (all others declare them "extern")
+	//Filenames are original (not *-cl.cl/cpp/h) except cu2cl_util.c/h/cl
+	FileStrCacheMap GlobalCDecls;
+	FileStrCacheMap LocalBoilDefs;
+
+	//Global boilerplate strings
+	std::string CU2CLInit;
+	std::string CU2CLClean;
+
+	std::vector<std::string> GlobalHDecls, GlobalCFuncs, GlobalCLFuncs, UtilKernels;
+
+	//Init/Cleanup calls that have already been merged, since several TUs may share a kernel header
+	std::set<std::string> MergedInitCalls, MergedCleanupCalls;
+
+	//Tool-level phases, plus the per-TU ones summed as TUs are merged
+	PhaseTimes ToolTimes;
+	std::vector<TUTimeReport> TUTimeReports;
+
+	//Output files for #included headers are claimed by the first TU to reach them, so that
+	// TUs running side by side don't each open (and then throw away) outputs for shared headers
+	std::set<std::string> ClaimedOutFiles;
+	std::mutex ClaimedOutFilesMutex;
+
+	//Headers a TU has already finished translating this run, keyed by absolute path, content hash, the
+	// command-line macros and the include context (what was preprocessed ahead of the #include, see
+	// GetIncludeContext) they were translated under. Later TUs that include the same header after the same
+	// context leave its declarations alone, since rewriting them again would only reproduce the same Replacements
+	std::set<std::string> TranslatedHeaders;
+	std::mutex TranslatedHeadersMutex;
+
+	//Where prelude PCHs are kept (see getPreludeHeader), and prelude key -> PCH,
+	// "" if it couldn't be built (those TUs just keep the -include)
+	std::string PreludeDir;
+	std::map<std::string, std::string> PreludePCHs;
+	std::mutex PreludeMutex;
+    };
+}
+
+namespace {
+    using cu2cl::SessionState;
+
+    //The session the current thread is translating for
+    thread_local SessionState *Session = NULL;
+
+    unsigned internFileName(StringRef name) {
+	std::lock_guard<std::mutex> lock(Session->InternedFilesMutex);
+	llvm::StringMap<unsigned>::iterator it = Session->InternedFiles.find(name);
+	if (it != Session->InternedFiles.end()) return it->second;
+	unsigned num = Session->InternedFiles.size() + 1;
+	Session->InternedFiles[name] = num;
+	Session->InternedFileNames.push_back(name);
+	return num;
+    }
+
+    //The reverse lookup, for writing keys out to the translation cache
+    std::string internedFileName(unsigned num) {
+	std::lock_guard<std::mutex> lock(Session->InternedFilesMutex);
+	return Session->InternedFileNames[num - 1];
+    }
+
+    class PhaseTimer;
+    thread_local PhaseTimer *CurrentPhaseTimer = NULL;
+
+    //Adds the time between construction and destruction to one phase, if '--time-report' is on
+    // Timers nest: time spent in an inner timer's phase isn't also charged to the outer one's
+    class PhaseTimer {
+    public:
+	PhaseTimer(PhaseTimes &times, TimePhase phase) : Times(times), Phase(phase), Parent(NULL), Stopped(false),
+	    StartWall(0), StartCPU(0), ChildWall(0), ChildCPU(0) {
+	    if (!Session->ReportTimes) return;
+	    Parent = CurrentPhaseTimer;
+	    CurrentPhaseTimer = this;
+	    StartWall = wallMicros();
+	    StartCPU = cpuMicros();
+	}
+
+	~PhaseTimer() {
+	    stop();
+	}
+
+	//End the timer early, for phases that don't line up with a scope
+	void stop() {
+	    if (!Session->ReportTimes || Stopped) return;
+	    Stopped = true;
+	    uint64_t wall = wallMicros() - StartWall;
+	    uint64_t cpu = cpuMicros() - StartCPU;
+	    Times.Wall[Phase] += wall - std::min(wall, ChildWall);
+	    Times.CPU[Phase] += cpu - std::min(cpu, ChildCPU);
+	    if (Parent) {
+		Parent->ChildWall += wall;
+		Parent->ChildCPU += cpu;
+	    }
+	    CurrentPhaseTimer = Parent;
+	}
+
+    private:
+	PhaseTimes &Times;
+	TimePhase Phase;
+	PhaseTimer *Parent;
+	bool Stopped;
+	uint64_t StartWall, StartCPU;
+	uint64_t ChildWall, ChildCPU;
+    };
+
+    //Everything a single translation unit contributes to the tool-level structures above
+    // Each RewriteCUDA instance fills its own copy rather than writing the globals directly,
+    // so that several TUs can be translated at once ('-j N'). When all TUs are finished the
+    // copies are merged into the globals in command-line order (see mergeTUContributions)
+    // so the output doesn't depend on which worker finished first
+    struct TUContributions {
+	std::vector<Replacement> GlobalHostReplace;
+	std::vector<Replacement> GlobalKernReplace;
+	std::map<DeclLocKey, Replacement> GlobalHostVecVars;
+	std::vector<DeclLocKey> DeclsToTranslate;
+	std::vector<PropagationEdge> PropagationEdges;
+	std::vector<PropagationInstance> PropagationInstances;
+	IDOutFileMap OutFiles;
+	IDOutFileMap KernelOutFiles;
+	FileStrCacheMap GlobalCDecls;
+	FileStrCacheMap LocalBoilDefs;
+	std::vector<std::string> GlobalHDecls, GlobalCFuncs, GlobalCLFuncs, UtilKernels;
+	//Calls this TU wants added to __cu2cl_Init/__cu2cl_Cleanup, in the order it generated them
+	std::vector<std::string> InitCalls, CleanupCalls;
+
+	bool UsesCUDADeviceProp;
+	bool UsesCUDAMemset;
+	bool UsesCUDAStreamQuery;
+	bool UsesCUDAEventElapsedTime;
+	bool UsesCUDAEventQuery;
+	bool UsesCUDAMallocHost;
+	bool UsesCUDAFreeHost;
+	bool UsesCUDASetDevice;
+	bool UsesCU2CLUtilCL;
+	bool UsesCU2CLLoadSrc;
+
+	//Only used by the translation cache: the quote-#included files this TU read (absolute path, content hash)
+	// and whether it finished without errors (TUs with errors are never cached)
+	std::vector<std::pair<std::string, std::string> > Dependencies;
+	bool Cacheable;
+
+	//Only used by '--time-report': where this TU's time went and how many Replacements it made
+	// (neither is written to the translation cache; replayed TUs just report FromCache,
+	// and files the pre-scan found no CUDA in report Copied)
+	std::string MainFile;
+	bool FromCache, Copied;
+	PhaseTimes Times;
+	size_t HostReplacements, KernReplacements;
+
+	TUContributions() : UsesCUDADeviceProp(false), UsesCUDAMemset(false), UsesCUDAStreamQuery(false),
+	    UsesCUDAEventElapsedTime(false), UsesCUDAEventQuery(false), UsesCUDAMallocHost(false),
+	    UsesCUDAFreeHost(false), UsesCUDASetDevice(false), UsesCU2CLUtilCL(false), UsesCU2CLLoadSrc(false),
+	    Cacheable(false), FromCache(false), Copied(false), HostReplacements(0), KernReplacements(0) { }
+    };
+
+    bool claimOutputFile(const std::string &filename) {
+	std::lock_guard<std::mutex> lock(Session->ClaimedOutFilesMutex);
+	return Session->ClaimedOutFiles.insert(filename).second;
+    }
+
+    bool isHeaderTranslated(const std::string &key) {
+	std::lock_guard<std::mutex> lock(Session->TranslatedHeadersMutex);
+	return Session->TranslatedHeaders.find(key) != Session->TranslatedHeaders.end();
+    }
+
+    void markHeaderTranslated(const std::string &key) {
+	std::lock_guard<std::mutex> lock(Session->TranslatedHeadersMutex);
+	Session->TranslatedHeaders.insert(key);
+    }
+
+    //Hand a finished output over to the session, which is where cu2cl-tool picks it up to write it out
+    void commitOutputFile(OutputFile *OF) {
+	OF->OS->flush();
+	Session->Outputs[OF->Filename].swap(OF->Contents);
+	delete OF;
+    }
+
+    //Throw away a duplicate output file without ever handing it over
+    void discardOutputFile(OutputFile *OF) {
+	delete OF;
+    }
+
+    //Outputs are named the way CompilerInstance::createOutputFile names them: base with its
+    // extension replaced, made absolute against the current directory
+    OutputFile *createOutputFileFor(StringRef base, StringRef ext) {
+	SmallString<128> path(base);
+	llvm::sys::path::replace_extension(path, ext);
+	llvm::sys::fs::make_absolute(path);
+	return new OutputFile(path.str());
+    }
+
+    //Append the strings of src missing from dst, keeping their order
+    //This search is linear w.r.t. the size of dst, just like the per-TU checks it replaces
+    // it's quick and dirty but has the nice property of not reordering the data structure
+    void appendUnique(std::vector<std::string> &dst, const std::vector<std::string> &src) {
+	for (std::vector<std::string>::const_iterator i = src.begin(), e = src.end(); i != e; i++) {
+	    std::vector<std::string>::iterator j = dst.begin(), f = dst.end();
+	    for (; j != f && (*j) != (*i); j++);
+	    if (j == f) dst.push_back(*i);
+	}
+    }
+
+    //Add one TU's phase times to the '--time-report' totals and keep its per-file line
+    void recordTUTimes(TUContributions *TUC) {
+	if (!Session->ReportTimes) return;
+	TUTimeReport report;
+	report.MainFile = TUC->MainFile;
+	report.FromCache = TUC->FromCache;
+	report.Copied = TUC->Copied;
+	report.Times = TUC->Times;
+	report.HostReplacements = TUC->HostReplacements;
+	report.KernReplacements = TUC->KernReplacements;
+	Session->TUTimeReports.push_back(report);
+	Session->ToolTimes.add(TUC->Times);
+    }
+
+    //Fold one TU's contributions into the global structures
+    //Called once per TU, in command-line order, after all translation has finished. Because every TU
+    // starts from empty local state, strings guarded by "only once" checks are deduplicated here instead,
+    // which reproduces exactly what the serial tool used to build
+    void mergeTUContributions(TUContributions *TUC) {
+	Session->GlobalHostReplace.insert(Session->GlobalHostReplace.end(), TUC->GlobalHostReplace.begin(), TUC->GlobalHostReplace.end());
+	Session->GlobalKernReplace.insert(Session->GlobalKernReplace.end(), TUC->GlobalKernReplace.begin(), TUC->GlobalKernReplace.end());
+	Session->GlobalHostVecVars.insert(TUC->GlobalHostVecVars.begin(), TUC->GlobalHostVecVars.end());
+	Session->DeclsToTranslate.insert(Session->DeclsToTranslate.end(), TUC->DeclsToTranslate.begin(), TUC->DeclsToTranslate.end());
+	for (std::vector<PropagationInstance>::iterator i = TUC->PropagationInstances.begin(), e = TUC->PropagationInstances.end(); i != e; i++) {
+	    Session->PropGraph.addInstance(*i);
+	}
+	for (std::vector<PropagationEdge>::iterator i = TUC->PropagationEdges.begin(), e = TUC->PropagationEdges.end(); i != e; i++) {
+	    Session->PropGraph.addEdge(*i);
+	}
+	//A main file may also have been #included by another TU, keep whichever stream was registered first
+	for (IDOutFileMap::iterator i = TUC->OutFiles.begin(), e = TUC->OutFiles.end(); i != e; i++) {
+	    if (Session->OutFiles.find((*i).first) == Session->OutFiles.end()) Session->OutFiles[(*i).first] = (*i).second;
+	    else discardOutputFile((*i).second);
+	}
+	for (IDOutFileMap::iterator i = TUC->KernelOutFiles.begin(), e = TUC->KernelOutFiles.end(); i != e; i++) {
+	    if (Session->KernelOutFiles.find((*i).first) == Session->KernelOutFiles.end()) Session->KernelOutFiles[(*i).first] = (*i).second;
+	    else discardOutputFile((*i).second);
+	}
+	for (FileStrCacheMap::iterator i = TUC->GlobalCDecls.begin(), e = TUC->GlobalCDecls.end(); i != e; i++) {
+	    appendUnique(Session->GlobalCDecls[(*i).first], (*i).second);
+	}
+	//Each TU generates its own init/cleanup bodies, duplicates are dropped with the other Replacements
+	for (FileStrCacheMap::iterator i = TUC->LocalBoilDefs.begin(), e = TUC->LocalBoilDefs.end(); i != e; i++) {
+	    std::vector<std::string> &defs = Session->LocalBoilDefs[(*i).first];
+	    defs.insert(defs.end(), (*i).second.begin(), (*i).second.end());
+	}
+	appendUnique(Session->GlobalHDecls, TUC->GlobalHDecls);
+	appendUnique(Session->GlobalCFuncs, TUC->GlobalCFuncs);
+	appendUnique(Session->GlobalCLFuncs, TUC->GlobalCLFuncs);
+	appendUnique(Session->UtilKernels, TUC->UtilKernels);
+	for (std::vector<std::string>::iterator i = TUC->InitCalls.begin(), e = TUC->InitCalls.end(); i != e; i++) {
+	    if (Session->MergedInitCalls.insert(*i).second) Session->CU2CLInit += (*i);
+	}
+	for (std::vector<std::string>::iterator i = TUC->CleanupCalls.begin(), e = TUC->CleanupCalls.end(); i != e; i++) {
+	    if (Session->MergedCleanupCalls.insert(*i).second) Session->CU2CLClean = (*i) + Session->CU2CLClean;
+	}
+
+	Session->UsesCUDADeviceProp |= TUC->UsesCUDADeviceProp;
+	Session->UsesCUDAMemset |= TUC->UsesCUDAMemset;
+	Session->UsesCUDAStreamQuery |= TUC->UsesCUDAStreamQuery;
+	Session->UsesCUDAEventElapsedTime |= TUC->UsesCUDAEventElapsedTime;
+	Session->UsesCUDAEventQuery |= TUC->UsesCUDAEventQuery;
+	Session->UsesCUDAMallocHost |= TUC->UsesCUDAMallocHost;
+	Session->UsesCUDAFreeHost |= TUC->UsesCUDAFreeHost;
+	Session->UsesCUDASetDevice |= TUC->UsesCUDASetDevice;
+	Session->UsesCU2CLUtilCL |= TUC->UsesCU2CLUtilCL;
+	Session->UsesCU2CLLoadSrc |= TUC->UsesCU2CLLoadSrc;
+
+	recordTUTimes(TUC);
+    }
+
+    //'--time-report' output
+    std::string formatSeconds(uint64_t micros) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.3f", micros / 1000000.0);
+	return buf;
+    }
+
+    std::string escapeJSON(StringRef str) {
+	std::string ret;
+	for (StringRef::iterator i = str.begin(), e = str.end(); i != e; i++) {
+	    if (*i == '"' || *i == '\\') ret += '\\';
+	    if ((unsigned char) *i < 0x20) {
+		char buf[8];
+		snprintf(buf, sizeof(buf), "\\u%04x", *i);
+		ret += buf;
+	    } else ret += *i;
+	}
+	return ret;
+    }
+
+    //Peak resident set size of the whole process, in kilobytes
+    long getPeakRSS() {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	//macOS reports ru_maxrss in bytes, Linux in kilobytes
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+    }
+
+    void printTextTimeReport(raw_ostream &OS, uint64_t totalWall, size_t hostReplacements, size_t kernReplacements) {
+	OS << "===-------------------------------------------------------------------------===\n";
+	OS << "                           CU2CL Time Report\n";
+	OS << "===-------------------------------------------------------------------------===\n";
+	OS << "  Per-TU phases are summed over all translation units, so with -j they can exceed the total\n\n";
+	OS.indent(2) << "Phase";
+	OS.indent(20) << "Wall (s)     CPU (s)\n";
+	for (int i = 0; i < Phase_Count; i++) {
+	    std::string wall = formatSeconds(Session->ToolTimes.Wall[i]), cpu = formatSeconds(Session->ToolTimes.CPU[i]);
+	    OS.indent(2) << TimePhaseNames[i];
+	    OS.indent(33 - strlen(TimePhaseNames[i]) - wall.size()) << wall;
+	    OS.indent(12 - cpu.size()) << cpu << "\n";
+	}
+	OS << "\n  Total wall time: " << formatSeconds(totalWall) << " s\n";
+	OS << "  Peak RSS: " << getPeakRSS() / 1024 << " MB\n";
+	OS << "  Replacements after merging: " << hostReplacements << " host, " << kernReplacements << " kernel\n\n";
+	OS << "  Per translation unit (wall s: parse, host, kernel; replacements: host, kernel)\n";
+	for (std::vector<TUTimeReport>::iterator i = Session->TUTimeReports.begin(), e = Session->TUTimeReports.end(); i != e; i++) {
+	    OS.indent(4) << (*i).MainFile << ": ";
+	    if ((*i).FromCache) OS << "cached";
+	    else if ((*i).Copied) OS << "copied, no CUDA";
+	    else OS << formatSeconds((*i).Times.Wall[Phase_Parse]) << ", " << formatSeconds((*i).Times.Wall[Phase_HostRewrite]) << ", " << formatSeconds((*i).Times.Wall[Phase_KernelRewrite]);
+	    OS << "; " << (*i).HostReplacements << ", " << (*i).KernReplacements << "\n";
+	}
+    }
+
+    void printJSONTimeReport(raw_ostream &OS, uint64_t totalWall, size_t hostReplacements, size_t kernReplacements) {
+	OS << "{\n  \"total_wall_us\": " << totalWall << ",\n";
+	OS << "  \"peak_rss_kb\": " << getPeakRSS() << ",\n";
+	OS << "  \"host_replacements\": " << hostReplacements << ",\n";
+	OS << "  \"kernel_replacements\": " << kernReplacements << ",\n";
+	OS << "  \"phases\": {";
+	for (int i = 0; i < Phase_Count; i++) {
+	    OS << (i ? "," : "") << "\n    \"" << TimePhaseKeys[i] << "\": {\"wall_us\": " << Session->ToolTimes.Wall[i] << ", \"cpu_us\": " << Session->ToolTimes.CPU[i] << "}";
+	}
+	OS << "\n  },\n  \"translation_units\": [";
+	for (std::vector<TUTimeReport>::iterator i = Session->TUTimeReports.begin(), e = Session->TUTimeReports.end(); i != e; i++) {
+	    OS << (i != Session->TUTimeReports.begin() ? "," : "") << "\n    {\"file\": \"" << escapeJSON((*i).MainFile) << "\", \"cached\": " << ((*i).FromCache ? "true" : "false") << ", \"copied\": " << ((*i).Copied ? "true" : "false");
+	    OS << ", \"host_replacements\": " << (*i).HostReplacements << ", \"kernel_replacements\": " << (*i).KernReplacements << ", \"phases\": {";
+	    for (int p = 0; p < Phase_Count; p++) {
+		OS << (p ? ", " : "") << "\"" << TimePhaseKeys[p] << "\": {\"wall_us\": " << (*i).Times.Wall[p] << ", \"cpu_us\": " << (*i).Times.CPU[p] << "}";
+	    }
+	    OS << "}}";
+	}
+	OS << "\n  ]\n}\n";
+    }
+
+    void printTimeReport(uint64_t totalWall) {
+	if (Session->TimeReportFormat == "json") printJSONTimeReport(llvm::outs(), totalWall, Session->GlobalHostReplace.size(), Session->GlobalKernReplace.size());
+	else printTextTimeReport(llvm::errs(), totalWall, Session->GlobalHostReplace.size(), Session->GlobalKernReplace.size());
+    }
+
+    //Translation cache ('--cache-dir')
+    //Each source file's contributions are written to <cache dir>/<key>.tu once it's translated, where
+    // the key hashes the tool version, the options that change its output, the compile commands and the
+    // file's contents. Entries also list the quote-#included files the source read along with their
+    // hashes, and are only reused while all of those still match, so a re-run only re-parses sources
+    // that (or whose headers) changed. Everything stored is AST-free: Replacements, DeclLocKeys written
+    // as file name plus offset, and the strings/flags headed for the global tables
+    std::string hashContents(StringRef data) {
+	llvm::MD5 hash;
+	hash.update(data);
+	llvm::MD5::MD5Result result;
+	hash.final(result);
+	SmallString<32> hex;
+	llvm::MD5::stringifyResult(result, hex);
+	return hex.str().str();
+    }
+
+    std::string hashFile(const std::string &path) {
+	OwningPtr<llvm::MemoryBuffer> buf;
+	if (llvm::MemoryBuffer::getFile(path, buf)) return "";
+	return hashContents(buf->getBuffer());
+    }
+
+    std::string getCacheEntryPath(const std::string &key) {
+	SmallString<128> path(Session->CacheDir);
+	llvm::sys::path::append(path, key + ".tu");
+	return path.str().str();
+    }
+
+    //Entries are a flat run of fields: numbers in decimal ended by a newline, strings as
+    // their length (as a number) followed by their bytes
+    class CacheWriter {
+    public:
+	CacheWriter(raw_ostream &os) : OS(os) { }
+
+	void writeNum(uint64_t n) { OS << n << "\n"; }
+
+	void writeStr(StringRef str) {
+	    writeNum(str.size());
+	    OS << str;
+	}
+
+	void writeKey(DeclLocKey key) {
+	    writeLoc(key.first);
+	    writeLoc(key.second);
+	}
+
+	void writeReplacements(const std::vector<Replacement> &reps) {
+	    writeNum(reps.size());
+	    for (std::vector<Replacement>::const_iterator i = reps.begin(), e = reps.end(); i != e; i++) writeReplacement(*i);
+	}
+
+	void writeStrs(const std::vector<std::string> &strs) {
+	    writeNum(strs.size());
+	    for (std::vector<std::string>::const_iterator i = strs.begin(), e = strs.end(); i != e; i++) writeStr(*i);
+	}
+
+	void writeStrMap(const FileStrCacheMap &map) {
+	    writeNum(map.size());
+	    for (FileStrCacheMap::const_iterator i = map.begin(), e = map.end(); i != e; i++) {
+		writeStr((*i).first);
+		writeStrs((*i).second);
+	    }
+	}
+
+	void writeContributions(const TUContributions &TUC) {
+	    writeReplacements(TUC.GlobalHostReplace);
+	    writeReplacements(TUC.GlobalKernReplace);
+	    writeNum(TUC.GlobalHostVecVars.size());
+	    for (std::map<DeclLocKey, Replacement>::const_iterator i = TUC.GlobalHostVecVars.begin(), e = TUC.GlobalHostVecVars.end(); i != e; i++) {
+		writeKey(i->first);
+		writeReplacement(i->second);
+	    }
+	    writeNum(TUC.DeclsToTranslate.size());
+	    for (std::vector<DeclLocKey>::const_iterator i = TUC.DeclsToTranslate.begin(), e = TUC.DeclsToTranslate.end(); i != e; i++) writeKey(*i);
+	    writeNum(TUC.PropagationEdges.size());
+	    for (std::vector<PropagationEdge>::const_iterator i = TUC.PropagationEdges.begin(), e = TUC.PropagationEdges.end(); i != e; i++) {
+		writeKey(i->first);
+		writeKey(i->second);
+	    }
+	    writeNum(TUC.PropagationInstances.size());
+	    for (std::vector<PropagationInstance>::const_iterator i = TUC.PropagationInstances.begin(), e = TUC.PropagationInstances.end(); i != e; i++) {
+		writeKey(i->Key);
+		writeKey(i->VecKey);
+		writeReplacements(i->Rewrite);
+	    }
+	    //Output files are recorded by name only, they're reopened when the entry is replayed
+	    // Host and kernel outputs are always registered together, under the same input file
+	    writeNum(TUC.OutFiles.size());
+	    for (IDOutFileMap::const_iterator i = TUC.OutFiles.begin(), e = TUC.OutFiles.end(); i != e; i++) {
+		IDOutFileMap::const_iterator kern = TUC.KernelOutFiles.find((*i).first);
+		writeStr((*i).first);
+		writeStr((*i).second->Filename);
+		writeStr(kern == TUC.KernelOutFiles.end() ? "" : kern->second->Filename);
+	    }
+	    writeStrMap(TUC.GlobalCDecls);
+	    writeStrMap(TUC.LocalBoilDefs);
+	    writeStrs(TUC.GlobalHDecls);
+	    writeStrs(TUC.GlobalCFuncs);
+	    writeStrs(TUC.GlobalCLFuncs);
+	    writeStrs(TUC.UtilKernels);
+	    writeStrs(TUC.InitCalls);
+	    writeStrs(TUC.CleanupCalls);
+	    writeNum(TUC.UsesCUDADeviceProp);
+	    writeNum(TUC.UsesCUDAMemset);
+	    writeNum(TUC.UsesCUDAStreamQuery);
+	    writeNum(TUC.UsesCUDAEventElapsedTime);
+	    writeNum(TUC.UsesCUDAEventQuery);
+	    writeNum(TUC.UsesCUDAMallocHost);
+	    writeNum(TUC.UsesCUDAFreeHost);
+	    writeNum(TUC.UsesCUDASetDevice);
+	    writeNum(TUC.UsesCU2CLUtilCL);
+	    writeNum(TUC.UsesCU2CLLoadSrc);
+	}
+
+    private:
+	//Key halves pack a tool-wide file number, which means nothing to another run, so write the name instead
+	void writeLoc(uint64_t loc) {
+	    unsigned num = loc >> 32;
+	    writeStr(num == 0 ? "" : internedFileName(num));
+	    writeNum(loc & 0xFFFFFFFF);
+	}
+
+	void writeReplacement(const Replacement &R) {
+	    writeStr(R.getFilePath());
+	    writeNum(R.getOffset());
+	    writeNum(R.getLength());
+	    writeStr(R.getReplacementText());
+	}
+
+	raw_ostream &OS;
+    };
+
+    //Reads back what CacheWriter wrote; any malformed field fails the whole entry, which is then just a miss
+    class CacheReader {
+    public:
+	CacheReader(StringRef buf) : Buf(buf), Failed(false) { }
+
+	bool failed() { return Failed; }
+
+	uint64_t readNum() {
+	    size_t end = Buf.find('\n');
+	    uint64_t n = 0;
+	    if (Failed || end == StringRef::npos || Buf.substr(0, end).getAsInteger(10, n)) return fail();
+	    Buf = Buf.substr(end + 1);
+	    return n;
+	}
+
+	StringRef readStr() {
+	    uint64_t len = readNum();
+	    if (Failed || len > Buf.size()) {
+		fail();
+		return StringRef();
+	    }
+	    StringRef str = Buf.substr(0, len);
+	    Buf = Buf.substr(len);
+	    return str;
+	}
+
+	DeclLocKey readKey() {
+	    uint64_t exp = readLoc();
+	    uint64_t spell = readLoc();
+	    return DeclLocKey(exp, spell);
+	}
+
+	void readReplacements(std::vector<Replacement> &reps) {
+	    for (uint64_t n = readNum(); n > 0 && !Failed; n--) reps.push_back(readReplacement());
+	}
+
+	void readStrs(std::vector<std::string> &strs) {
+	    for (uint64_t n = readNum(); n > 0 && !Failed; n--) strs.push_back(readStr());
+	}
+
+	void readStrMap(FileStrCacheMap &map) {
+	    for (uint64_t n = readNum(); n > 0 && !Failed; n--) {
+		std::string file = readStr();
+		readStrs(map[file]);
+	    }
+	}
+
+	//Fills TUC, except for its output files, which are only opened by openOutputFiles
+	void readContributions(TUContributions &TUC) {
+	    readReplacements(TUC.GlobalHostReplace);
+	    readReplacements(TUC.GlobalKernReplace);
+	    for (uint64_t n = readNum(); n > 0 && !Failed; n--) {
+		DeclLocKey key = readKey();
+		TUC.GlobalHostVecVars.insert(std::make_pair(key, readReplacement()));
+	    }
+	    for (uint64_t n = readNum(); n > 0 && !Failed; n--) TUC.DeclsToTranslate.push_back(readKey());
+	    for (uint64_t n = readNum(); n > 0 && !Failed; n--) {
+		DeclLocKey from = readKey();
+		TUC.PropagationEdges.push_back(PropagationEdge(from, readKey()));
+	    }
+	    for (uint64_t n = readNum(); n > 0 && !Failed; n--) {
+		DeclLocKey key = readKey();
+		TUC.PropagationInstances.push_back(PropagationInstance(key, readKey()));
+		readReplacements(TUC.PropagationInstances.back().Rewrite);
+	    }
+	    for (uint64_t n = readNum(); n > 0 && !Failed; n--) {
+		ReplayedOutput out;
+		out.TUC = &TUC;
+		out.Orig = readStr();
+		out.Host = readStr();
+		out.Kern = readStr();
+		Outputs.push_back(out);
+	    }
+	    readStrMap(TUC.GlobalCDecls);
+	    readStrMap(TUC.LocalBoilDefs);
+	    readStrs(TUC.GlobalHDecls);
+	    readStrs(TUC.GlobalCFuncs);
+	    readStrs(TUC.GlobalCLFuncs);
+	    readStrs(TUC.UtilKernels);
+	    readStrs(TUC.InitCalls);
+	    readStrs(TUC.CleanupCalls);
+	    TUC.UsesCUDADeviceProp = readNum();
+	    TUC.UsesCUDAMemset = readNum();
+	    TUC.UsesCUDAStreamQuery = readNum();
+	    TUC.UsesCUDAEventElapsedTime = readNum();
+	    TUC.UsesCUDAEventQuery = readNum();
+	    TUC.UsesCUDAMallocHost = readNum();
+	    TUC.UsesCUDAFreeHost = readNum();
+	    TUC.UsesCUDASetDevice = readNum();
+	    TUC.UsesCU2CLUtilCL = readNum();
+	    TUC.UsesCU2CLLoadSrc = readNum();
+	}
+
+	//Once the whole entry has been read, claim its output files and open fresh streams for them
+	// like the TUs that wrote it did, skipping any another TU already claimed
+	void openOutputFiles() {
+	    for (std::vector<ReplayedOutput>::iterator i = Outputs.begin(), e = Outputs.end(); i != e; i++) {
+		if (!claimOutputFile(i->Orig)) continue;
+		i->TUC->OutFiles[i->Orig] = new OutputFile(i->Host);
+		if (!i->Kern.empty()) i->TUC->KernelOutFiles[i->Orig] = new OutputFile(i->Kern);
+	    }
+	}
+
+    private:
+	struct ReplayedOutput {
+	    TUContributions *TUC;
+	    std::string Orig, Host, Kern;
+	};
+
+	uint64_t fail() {
+	    Failed = true;
+	    Buf = StringRef();
+	    return 0;
+	}
+
+	uint64_t readLoc() {
+	    StringRef file = readStr();
+	    uint64_t offset = readNum();
+	    if (Failed || file.empty()) return 0;
+	    return ((uint64_t) internFileName(file) << 32) | offset;
+	}
+
+	Replacement readReplacement() {
+	    std::string path = readStr();
+	    unsigned offset = readNum();
+	    unsigned length = readNum();
+	    StringRef text = readStr();
+	    return Replacement(path, offset, length, text);
+	}
+
+	StringRef Buf;
+	bool Failed;
+	std::vector<ReplayedOutput> Outputs;
+    };
+
+    //Header written at the start of every entry, entries with any other header are ignored
+    const char *CacheEntryHeader = "CU2CL translation cache " CU2CL_VERSION " format " CU2CL_CACHE_FORMAT "\n";
+
+    //Write all the TUs a source file produced to its cache entry
+    //The entry is assembled in a temporary file and renamed into place, so a concurrent run
+    // never sees half of one
+    void storeCacheEntry(const std::string &key, const std::vector<TUContributions *> &contribs) {
+	if (contribs.empty()) return;
+	for (std::vector<TUContributions *>::const_iterator i = contribs.begin(), e = contribs.end(); i != e; i++) {
+	    if (!(*i)->Cacheable) return;
+	}
+	std::string entryPath = getCacheEntryPath(key);
+	int fd;
+	SmallString<128> tempPath;
+	if (llvm::sys::fs::createUniqueFile(entryPath + "-%%%%%%%%", fd, tempPath)) {
+	    llvm::errs() << "Unable to write translation cache entry [" << entryPath << "]\n";
+	    return;
+	}
+	{
+	    llvm::raw_fd_ostream OS(fd, true);
+	    CacheWriter writer(OS);
+	    OS << CacheEntryHeader;
+	    std::vector<std::pair<std::string, std::string> > deps;
+	    for (std::vector<TUContributions *>::const_iterator i = contribs.begin(), e = contribs.end(); i != e; i++) {
+		deps.insert(deps.end(), (*i)->Dependencies.begin(), (*i)->Dependencies.end());
+	    }
+	    writer.writeNum(deps.size());
+	    for (std::vector<std::pair<std::string, std::string> >::iterator i = deps.begin(), e = deps.end(); i != e; i++) {
+		writer.writeStr(i->first);
+		writer.writeStr(i->second);
+	    }
+	    writer.writeNum(contribs.size());
+	    for (std::vector<TUContributions *>::const_iterator i = contribs.begin(), e = contribs.end(); i != e; i++) {
+		writer.writeContributions(**i);
+	    }
+	}
+	if (llvm::sys::fs::rename(tempPath.str(), entryPath)) llvm::sys::fs::remove(tempPath.str());
+    }
+
+    //Replay a source file's cache entry into contribs, if there is one and all of its
+    // dependencies are unchanged. Returns whether it was used
+    bool loadCacheEntry(const std::string &key, std::vector<TUContributions *> &contribs) {
+	OwningPtr<llvm::MemoryBuffer> buf;
+	if (llvm::MemoryBuffer::getFile(getCacheEntryPath(key), buf)) return false;
+	StringRef data = buf->getBuffer();
+	if (!data.startswith(CacheEntryHeader)) return false;
+	CacheReader reader(data.substr(strlen(CacheEntryHeader)));
+	for (uint64_t n = reader.readNum(); n > 0 && !reader.failed(); n--) {
+	    std::string dep = reader.readStr();
+	    if (hashFile(dep) != reader.readStr()) return false;
+	}
+	uint64_t count = reader.readNum();
+	if (reader.failed() || count == 0) return false;
+	std::vector<TUContributions *> loaded;
+	for (; count > 0 && !reader.failed(); count--) {
+	    loaded.push_back(new TUContributions());
+	    reader.readContributions(*loaded.back());
+	}
+	if (reader.failed()) {
+	    for (std::vector<TUContributions *>::iterator i = loaded.begin(), e = loaded.end(); i != e; i++) delete (*i);
+	    return false;
+	}
+	reader.openOutputFiles();
+	contribs.insert(contribs.end(), loaded.begin(), loaded.end());
+	return true;
+    }
+
+    //Shard summaries ('--emit-summary=<file>' and '--merge')
+    //A summary holds every TU contribution of one run, laid out like a cache entry, so that a
+    // project can be split across several processes (or machines sharing a filesystem) and
+    // a final '--merge' run does the cross-TU work without parsing anything: cl_mem propagation,
+    // extern generation, cu2cl_util.c/h/cl and applying all Replacements to the output files
+    //The options that change the tool-level output are recorded too, the merge adopts them
+    const char *SummaryHeader = "CU2CL translation summary " CU2CL_VERSION " format " CU2CL_CACHE_FORMAT "\n";
+
+    //Write the contributions of every slot to path, in slot (command-line) order
+    bool writeSummary(const std::string &path, const std::vector<std::vector<TUContributions *> > &slots) {
+	int fd;
+	SmallString<128> tempPath;
+	if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%%%", fd, tempPath)) return false;
+	{
+	    llvm::raw_fd_ostream OS(fd, true);
+	    CacheWriter writer(OS);
+	    OS << SummaryHeader;
+	    writer.writeNum(Session->AddInlineComments);
+	    writer.writeStr(Session->ExtraBuildArgs);
+	    writer.writeNum(Session->FilterKernelName);
+	    writer.writeStr(Session->BinaryCacheDir);
+	    writer.writeNum(Session->ConcurrentBuilds);
+	    writer.writeNum(Session->LazyInit);
+	    writer.writeNum(Session->EmbedKernels);
+	    writer.writeNum(Session->PrecompileKernels);
+	    writer.writeStr(Session->PrecompileArgs);
+	    writer.writeNum(Session->MemoryPoolMB);
+	    size_t count = 0;
+	    for (std::vector<std::vector<TUContributions *> >::const_iterator i = slots.begin(), e = slots.end(); i != e; i++) count += i->size();
+	    writer.writeNum(count);
+	    for (std::vector<std::vector<TUContributions *> >::const_iterator i = slots.begin(), e = slots.end(); i != e; i++) {
+		for (std::vector<TUContributions *>::const_iterator j = i->begin(), f = i->end(); j != f; j++) writer.writeContributions(**j);
+	    }
+	    if (OS.has_error()) {
+		OS.clear_error();
+		llvm::sys::fs::remove(tempPath.str());
 		return false;
+	    }
+	}
+	if (llvm::sys::fs::rename(tempPath.str(), path)) {
+	    llvm::sys::fs::remove(tempPath.str());
+	    return false;
 	}
+	return true;
+    }
 
-    //Simple Vector to hold retained SourceManagers to use at the tool layer
-    typedef std::vector<SourceManager *> SMVec;
-    //A simple structure to retain ASTContexts so they can be later used at the tool layer (and appropriately released)
-    typedef std::vector<ASTContext *> ASTContVec;
-    //Global Replacement structs, contributed to by each instance of the translator (one-per-main-source-file)
-    // only written to after local deduplication and coalescing
-    std::vector<Replacement> GlobalHostReplace;
-    std::vector<Replacement> GlobalKernReplace;
-
-    std::map<SourceLocation, Replacement> GlobalHostVecVars;
-    //All ASTContexts get pushed here as their translation units get processed
-    // so that their member elements can be referred to after TU processing
-    ASTContVec AllASTs;
-    SMVec AllSMs;
-
-    //All Declarations and references to them are recorded to propagate cl_mem and other critical rewrites across TU boundaries
-    FlaggedDeclVec DeclsToTranslate;
-    DeclToRefMap AllDeclRefsByDecl;
-    CanonicalFuncDeclMap AllFuncsByCanon;   
- 
-    //Global outFiles maps, moved so that they can be shared and written to at the tool level
-    IDOutFileMap OutFiles;
-    IDOutFileMap KernelOutFiles;
-
-    //Global map of declaration statements to the files that own them (all others declare them "extern")
-    //Filenames are original (not *-cl.cl/cpp/h) except cu2cl_util.c/h/cl
-    FileStrCacheMap GlobalCDecls;
-    FileStrCacheMap LocalBoilDefs;
-
-    //Global boilerplate strings
-    std::string CU2CLInit;
-    std::string CU2CLClean;
-    
-    std::vector<std::string> GlobalHDecls, GlobalCFuncs, GlobalCLFuncs, UtilKernels;
-    //We also borrow the loose method of dealing with temporary output files from
-    // CompilerInstance::clearOutputFiles
-    void clearOutputFile(OutputFile *OF, FileManager *FM) {
-	if(!OF->TempFilename.empty()) {
-	    SmallString<128> NewOutFile(OF->Filename);
-	    FM->FixupRelativePath(NewOutFile);
-	    if (llvm::error_code ec = llvm::sys::fs::rename(OF->TempFilename, NewOutFile.str()))
-		llvm::errs() << "Unable to move CU2CL temporary output [" << OF->TempFilename << "] to [" << OF->Filename << "]!\n\t Diag Msg: " << ec.message() << "\n";
-	    llvm::sys::fs::remove(OF->TempFilename);
-	} else {
-	    llvm::sys::fs::remove(OF->Filename);
+    //Replay a summary file into contribs. The first summary read sets the output options,
+    // any later one that was written with different options is rejected
+    bool readSummary(const std::string &path, std::vector<TUContributions *> &contribs, bool first) {
+	OwningPtr<llvm::MemoryBuffer> buf;
+	if (llvm::MemoryBuffer::getFile(path, buf)) {
+	    llvm::errs() << "Unable to read summary [" << path << "]\n";
+	    return false;
+	}
+	StringRef data = buf->getBuffer();
+	if (!data.startswith(SummaryHeader)) {
+	    llvm::errs() << "[" << path << "] is not a summary written by this version of CU2CL\n";
+	    return false;
+	}
+	CacheReader reader(data.substr(strlen(SummaryHeader)));
+	bool comments = reader.readNum();
+	std::string buildArgs = reader.readStr();
+	bool filterNames = reader.readNum();
+	std::string binaryCache = reader.readStr();
+	bool concurrentBuilds = reader.readNum();
+	bool lazyInit = reader.readNum();
+	bool embedKernels = reader.readNum();
+	bool precompileKernels = reader.readNum();
+	std::string precompileArgs = reader.readStr();
+	unsigned memoryPoolMB = reader.readNum();
+	if (first) {
+	    Session->AddInlineComments = comments;
+	    Session->ExtraBuildArgs = buildArgs;
+	    Session->FilterKernelName = filterNames;
+	    Session->BinaryCacheDir = binaryCache;
+	    Session->ConcurrentBuilds = concurrentBuilds;
+	    Session->LazyInit = lazyInit;
+	    Session->EmbedKernels = embedKernels;
+	    Session->PrecompileKernels = precompileKernels;
+	    Session->PrecompileArgs = precompileArgs;
+	    Session->MemoryPoolMB = memoryPoolMB;
+	} else if (comments != Session->AddInlineComments || buildArgs != Session->ExtraBuildArgs || filterNames != Session->FilterKernelName
+	    || binaryCache != Session->BinaryCacheDir || concurrentBuilds != Session->ConcurrentBuilds
+	    || lazyInit != Session->LazyInit || embedKernels != Session->EmbedKernels
+	    || precompileKernels != Session->PrecompileKernels || precompileArgs != Session->PrecompileArgs
+	    || memoryPoolMB != Session->MemoryPoolMB) {
+	    llvm::errs() << "Summary [" << path << "] was written with different CU2CL options than the ones before it\n";
+	    return false;
+	}
+	std::vector<TUContributions *> loaded;
+	for (uint64_t count = reader.readNum(); count > 0 && !reader.failed(); count--) {
+	    loaded.push_back(new TUContributions());
+	    loaded.back()->MainFile = path;
+	    loaded.back()->FromCache = true;
+	    reader.readContributions(*loaded.back());
+	}
+	if (reader.failed()) {
+	    llvm::errs() << "Summary [" << path << "] is malformed\n";
+	    for (std::vector<TUContributions *>::iterator i = loaded.begin(), e = loaded.end(); i != e; i++) delete (*i);
+	    return false;
+	}
+	reader.openOutputFiles();
+	contribs.insert(contribs.end(), loaded.begin(), loaded.end());
+	return true;
+    }
+
+    //Drop contributions without merging them, removing the temporaries of their output files
+    void discardContributions(std::vector<std::vector<TUContributions *> > &slots) {
+	for (std::vector<std::vector<TUContributions *> >::iterator i = slots.begin(), e = slots.end(); i != e; i++) {
+	    for (std::vector<TUContributions *>::iterator j = i->begin(), f = i->end(); j != f; j++) {
+		recordTUTimes(*j);
+		for (IDOutFileMap::iterator o = (*j)->OutFiles.begin(), oe = (*j)->OutFiles.end(); o != oe; o++) discardOutputFile(o->second);
+		for (IDOutFileMap::iterator o = (*j)->KernelOutFiles.begin(), oe = (*j)->KernelOutFiles.end(); o != oe; o++) discardOutputFile(o->second);
+		delete (*j);
+	    }
+	    i->clear();
+	}
+    }
+
+    //Precompiled prelude ('--pch-prelude')
+    //Every TU is handed '-include cuda_runtime.h' (see main), so each one used to lex and parse the
+    // whole CUDA runtime header tree before reaching its own code. Instead that prelude is precompiled
+    // once per distinct set of options it depends on, and the PCH is swapped in for the -include
+    //PCHs are kept in the translation cache directory if there is one, and reused by later runs while
+    // the headers they were built from are unchanged. Otherwise they go in a temporary directory that
+    // is removed when the session finishes
+
+    //The (empty) file each PCH is built from, the prelude itself comes in through the -include
+    // It's only written once, Clang rejects a PCH whose input files have been touched since
+    std::string getPreludeHeader() {
+	if (Session->PreludeDir.empty()) {
+	    SmallString<128> dir;
+	    if (!Session->CacheDir.empty()) dir = Session->CacheDir;
+	    else if (llvm::sys::fs::createUniqueDirectory("cu2cl-prelude", dir)) return "";
+	    Session->PreludeDir = dir.str();
+	}
+	SmallString<128> header(Session->PreludeDir);
+	llvm::sys::path::append(header, "cu2cl_prelude.h");
+	if (!llvm::sys::fs::exists(header.str())) {
+	    std::string error;
+	    llvm::raw_fd_ostream OS(header.c_str(), error);
+	    OS << "/* Precompiled by CU2CL as the prelude of every translation unit */\n";
+	}
+	return header.str().str();
+    }
+
+    //Everything in a TU's invocation that a PCH gets validated against (and then some)
+    std::string getPreludeKey(CompilerInvocation &Inv) {
+	std::string fields;
+	llvm::raw_string_ostream OS(fields);
+	CacheWriter writer(OS);
+	writer.writeStr(CU2CL_VERSION);
+	writer.writeNum(Inv.getFrontendOpts().Inputs[0].getKind());
+	const LangOptions &LOpts = *Inv.getLangOpts();
+#define LANGOPT(Name, Bits, Default, Description) writer.writeNum(LOpts.Name);
+#define ENUM_LANGOPT(Name, Type, Bits, Default, Description) writer.writeNum(LOpts.get##Name());
+#include "clang/Basic/LangOptions.def"
+	const TargetOptions &TOpts = Inv.getTargetOpts();
+	writer.writeStr(TOpts.Triple);
+	writer.writeStr(TOpts.CPU);
+	writer.writeStr(TOpts.ABI);
+	writer.writeStrs(TOpts.FeaturesAsWritten);
+	const PreprocessorOptions &PPOpts = Inv.getPreprocessorOpts();
+	writer.writeNum(PPOpts.Macros.size());
+	for (std::vector<std::pair<std::string, bool> >::const_iterator i = PPOpts.Macros.begin(), e = PPOpts.Macros.end(); i != e; i++) {
+	    writer.writeStr(i->first);
+	    writer.writeNum(i->second);
+	}
+	writer.writeStrs(PPOpts.Includes);
+	writer.writeStrs(PPOpts.MacroIncludes);
+	writer.writeNum(PPOpts.UsePredefines);
+	const HeaderSearchOptions &HSOpts = Inv.getHeaderSearchOpts();
+	writer.writeStr(HSOpts.Sysroot);
+	writer.writeStr(HSOpts.ResourceDir);
+	writer.writeNum(HSOpts.UserEntries.size());
+	for (std::vector<HeaderSearchOptions::Entry>::const_iterator i = HSOpts.UserEntries.begin(), e = HSOpts.UserEntries.end(); i != e; i++) {
+	    writer.writeStr(i->Path);
+	    writer.writeNum(i->Group);
+	    writer.writeNum(i->IsFramework);
+	    writer.writeNum(i->IgnoreSysRoot);
+	}
+	writer.writeNum(HSOpts.UseBuiltinIncludes);
+	writer.writeNum(HSOpts.UseStandardSystemIncludes);
+	writer.writeNum(HSOpts.UseStandardCXXIncludes);
+	writer.writeNum(HSOpts.UseLibcxx);
+	//Relative include paths depend on where the tool is when the PCH gets built
+	SmallString<128> cwd;
+	llvm::sys::fs::current_path(cwd);
+	writer.writeStr(cwd);
+	return hashContents(OS.str());
+    }
+
+    //A PCH left in the cache directory by an earlier run is current if every file it was built from
+    // still has the size and modification time recorded next to it (in <pch>.deps), which is what
+    // Clang checks them against when it loads the PCH
+    bool isPreludePCHCurrent(const std::string &pch) {
+	OwningPtr<llvm::MemoryBuffer> buf;
+	if (!llvm::sys::fs::exists(pch) || llvm::MemoryBuffer::getFile(pch + ".deps", buf)) return false;
+	CacheReader reader(buf->getBuffer());
+	for (uint64_t n = reader.readNum(); n > 0 && !reader.failed(); n--) {
+	    std::string file = reader.readStr();
+	    uint64_t size = reader.readNum();
+	    uint64_t mtime = reader.readNum();
+	    llvm::sys::fs::file_status status;
+	    if (reader.failed() || llvm::sys::fs::status(file, status)) return false;
+	    if (status.getSize() != size || (uint64_t) status.getLastModificationTime().toEpochTime() != mtime) return false;
+	}
+	return !reader.failed();
+    }
+
+    void writePreludeDeps(const std::string &pch, SourceManager &SM) {
+	std::string error;
+	llvm::raw_fd_ostream OS((pch + ".deps").c_str(), error);
+	CacheWriter writer(OS);
+	std::vector<const FileEntry *> files;
+	for (SourceManager::fileinfo_iterator i = SM.fileinfo_begin(), e = SM.fileinfo_end(); i != e; i++) files.push_back(i->first);
+	writer.writeNum(files.size());
+	for (std::vector<const FileEntry *>::iterator i = files.begin(), e = files.end(); i != e; i++) {
+	    SmallString<128> path((*i)->getName());
+	    llvm::sys::fs::make_absolute(path);
+	    writer.writeStr(path);
+	    writer.writeNum((*i)->getSize());
+	    writer.writeNum((*i)->getModificationTime());
+	}
+    }
+
+    //Precompile the prelude with a copy of CI's invocation, swapping its input for the prelude header
+    bool buildPreludePCH(CompilerInstance &CI, const std::string &header, const std::string &pch) {
+	IntrusiveRefCntPtr<CompilerInvocation> Inv(new CompilerInvocation(CI.getInvocation()));
+	FrontendOptions &FOpts = Inv->getFrontendOpts();
+	InputKind kind = FOpts.Inputs[0].getKind();
+	FOpts.Inputs.clear();
+	FOpts.Inputs.push_back(FrontendInputFile(header, kind));
+	FOpts.OutputFile = pch;
+	FOpts.ProgramAction = frontend::GeneratePCH;
+	//The builder is thrown away right after, so it should clean up after itself
+	FOpts.DisableFree = false;
+	CompilerInstance Builder;
+	Builder.setInvocation(Inv.getPtr());
+	Builder.createDiagnostics();
+	GeneratePCHAction action;
+	if (!Builder.ExecuteAction(action) || Builder.getDiagnostics().hasErrorOccurred()) return false;
+	if (!Session->CacheDir.empty()) writePreludeDeps(pch, Builder.getSourceManager());
+	return true;
+    }
+
+    //Called before each TU starts, swaps its -include'd prelude for a PCH of it, building that first if needed
+    // TUs that use a PCH of their own are left alone
+    void usePreludePCH(CompilerInstance &CI) {
+	PreprocessorOptions &PPOpts = CI.getPreprocessorOpts();
+	if (CI.getFrontendOpts().Inputs.empty()) return;
+	std::vector<std::string>::iterator prelude = std::find(PPOpts.Includes.begin(), PPOpts.Includes.end(), "cuda_runtime.h");
+	if (prelude == PPOpts.Includes.end() || !PPOpts.ImplicitPCHInclude.empty() || !PPOpts.ImplicitPTHInclude.empty()) return;
+	std::string key = getPreludeKey(CI.getInvocation());
+	std::string pch;
+	{
+	    std::lock_guard<std::mutex> lock(Session->PreludeMutex);
+	    std::map<std::string, std::string>::iterator known = Session->PreludePCHs.find(key);
+	    if (known != Session->PreludePCHs.end()) pch = known->second;
+	    else {
+		std::string header = getPreludeHeader();
+		if (!header.empty()) {
+		    SmallString<128> path(Session->PreludeDir);
+		    llvm::sys::path::append(path, "prelude-" + key + ".pch");
+		    pch = path.str();
+		    if (Session->CacheDir.empty() || !isPreludePCHCurrent(pch)) {
+			llvm::errs() << "Precompiling the CUDA runtime prelude\n";
+			if (!buildPreludePCH(CI, header, pch)) {
+			    llvm::errs() << "Unable to precompile the CUDA runtime prelude, it will be parsed with each file\n";
+			    pch = "";
+			}
+		    }
+		}
+		Session->PreludePCHs[key] = pch;
+	    }
+	}
+	if (pch.empty()) return;
+	PPOpts.Includes.erase(prelude);
+	PPOpts.ImplicitPCHInclude = pch;
+    }
+
+    //Throw away this run's PCHs, unless they were kept in the translation cache
+    void removePreludeDir() {
+	if (Session->PreludeDir.empty() || !Session->CacheDir.empty()) return;
+	for (std::map<std::string, std::string>::iterator i = Session->PreludePCHs.begin(), e = Session->PreludePCHs.end(); i != e; i++) {
+	    if (!i->second.empty()) llvm::sys::fs::remove(i->second);
 	}
-	delete OF->OS;
+	SmallString<128> header(Session->PreludeDir);
+	llvm::sys::path::append(header, "cu2cl_prelude.h");
+	llvm::sys::fs::remove(header.str());
+	llvm::sys::fs::remove(Session->PreludeDir);
     }
 
     //Replace all instances of the phrase "kernel" with "knl"
     // Used to rename files as per Altera's kernel filename requirement
     std::string kernelNameFilter(std::string str) {
 	std::string newStr = str;
-	if (!FilterKernelName) return newStr;
+	if (!Session->FilterKernelName) return newStr;
 	size_t pos = newStr.rfind("/"); //Only rewrite the file, not the path
 	if (pos == std::string::npos) pos = 0;
 	for (; ; pos += 3) {
@@ -435,29 +2012,213 @@ namespace {
 	    newStr.erase(pos, 6);
 	    newStr.insert(pos, "knl");
 	}
-	return newStr;
+	return newStr;
+    }
+
+    //Quote str as a C string literal
+    std::string quoteCString(const std::string &str) {
+	std::string ret = "\"";
+	for (std::string::const_iterator i = str.begin(), e = str.end(); i != e; i++) {
+	    if (*i == '"' || *i == '\\') ret += '\\';
+	    ret += *i;
+	}
+	return ret + "\"";
+    }
+
+    //The statements that create and build program in __cu2cl_Init_<file> (and for cu2cl_util.cl):
+    // from the Altera binary aocxFile with WITH_ALTERA, otherwise from the source clFile, or from its
+    // copy __cu2cl_Source_<id> in cu2cl_kernels.c with '--embed-kernels'
+    //With '--precompile-kernels' the SPIR binaries next to clFile (or embedded) are tried first
+    std::string generateProgramBuild(const std::string &program, const std::string &aocxFile, const std::string &clFile, const std::string &id) {
+	std::string buildArgs = "\"-I . " + Session->ExtraBuildArgs + "\"";
+	std::string ret;
+	ret += "    #ifdef WITH_ALTERA\n";
+	ret += "    progLen = __cu2cl_LoadProgramSource(\"" + aocxFile + "\", &progSrc);\n";
+	ret += "    " + program + " = clCreateProgramWithBinary(__cu2cl_Context, 1, &__cu2cl_Device, &progLen, (const unsigned char **)&progSrc, NULL, NULL);\n";
+	if (Session->BinaryCacheDir.empty() && !Session->EmbedKernels && !Session->PrecompileKernels) {
+	    ret += "    #else\n";
+	    ret += "    progLen = __cu2cl_LoadProgramSource(\"" + clFile + "\", &progSrc);\n";
+	    ret += "    " + program + " = clCreateProgramWithSource(__cu2cl_Context, 1, &progSrc, &progLen, NULL);\n";
+	    ret += "    #endif\n";
+	    ret += "    free((void *) progSrc);\n";
+	    ret += "    clBuildProgram(" + program + ", 1, &__cu2cl_Device, " + buildArgs + ", NULL, NULL);\n";
+	    return ret;
+	}
+	//Otherwise the source branch loads and builds differently, so each branch finishes on its own
+	ret += "    free((void *) progSrc);\n";
+	ret += "    clBuildProgram(" + program + ", 1, &__cu2cl_Device, " + buildArgs + ", NULL, NULL);\n";
+	ret += "    #else\n";
+	std::string indent = "    ";
+	if (Session->PrecompileKernels) {
+	    if (Session->EmbedKernels) {
+		std::string spir = "__cu2cl_Source_" + id + "_spir", spir64 = "__cu2cl_Source_" + id + "_spir64";
+		ret += "    " + program + " = __cu2cl_BuildProgramSPIR(" + spir + ", " + spir + "_len, " + spir64 + ", " + spir64 + "_len, " + buildArgs + ");\n";
+	    } else {
+		std::string base = clFile.substr(0, clFile.rfind('.'));
+		ret += "    " + program + " = __cu2cl_BuildProgramSPIRFile(\"" + base + ".spir\", \"" + base + ".spir64\", " + buildArgs + ");\n";
+	    }
+	    //The source build below becomes the fallback
+	    ret += "    if (" + program + " == NULL) {\n";
+	    indent += "    ";
+	}
+	if (Session->EmbedKernels) {
+	    ret += indent + "progSrc = __cu2cl_Source_" + id + ";\n";
+	    ret += indent + "progLen = __cu2cl_Source_" + id + "_len;\n";
+	} else {
+	    ret += indent + "progLen = __cu2cl_LoadProgramSource(\"" + clFile + "\", &progSrc);\n";
+	}
+	if (!Session->BinaryCacheDir.empty()) {
+	    ret += indent + program + " = __cu2cl_BuildProgramCached(progSrc, progLen, " + buildArgs + ");\n";
+	} else {
+	    ret += indent + program + " = clCreateProgramWithSource(__cu2cl_Context, 1, &progSrc, &progLen, NULL);\n";
+	    ret += indent + "clBuildProgram(" + program + ", 1, &__cu2cl_Device, " + buildArgs + ", NULL, NULL);\n";
+	}
+	if (!Session->EmbedKernels) ret += indent + "free((void *) progSrc);\n";
+	if (Session->PrecompileKernels) ret += "    }\n";
+	ret += "    #endif\n";
+	return ret;
+    }
+
+    //The declarations of an embedded kernel source, for cu2cl_util.h
+    std::string embeddedSourceDecl(const std::string &id) {
+	return "extern const char __cu2cl_Source_" + id + "[];\nextern const size_t __cu2cl_Source_" + id + "_len;\n";
+    }
+
+    //Append the C definition of an embedded kernel source to OS: the bytes of text (plus a terminator,
+    // which isn't counted in its length) as an array, since string literals have length limits
+    void writeEmbeddedSource(raw_ostream &OS, const std::string &id, StringRef text) {
+	OS << "const char __cu2cl_Source_" << id << "[] = {";
+	for (size_t i = 0; i <= text.size(); i++) {
+	    if (i % 12 == 0) OS << "\n   ";
+	    OS << " 0x";
+	    OS.write_hex(i < text.size() ? (unsigned char) text[i] : 0);
+	    OS << ",";
+	}
+	OS << "\n};\n";
+	OS << "const size_t __cu2cl_Source_" << id << "_len = " << text.size() << ";\n\n";
+    }
+
+    //The text of the kernel output path, with each quote-#include of another kernel output replaced
+    // by that file's (likewise inlined) text, so building it needs no files from "-I ."
+    //active holds the files being inlined, an #include cycle back into one of them is dropped
+    std::string inlineKernelIncludes(const std::string &path, std::set<std::string> &active) {
+	std::map<std::string, std::string>::iterator file = Session->Outputs.find(path);
+	if (file == Session->Outputs.end() || !active.insert(path).second) return "";
+	std::string ret;
+	StringRef rest = file->second;
+	while (!rest.empty()) {
+	    std::pair<StringRef, StringRef> line = rest.split('\n');
+	    bool newline = line.first.size() < rest.size();
+	    rest = line.second;
+	    //Only the #include "<file>" lines RewriteInclude leaves behind are recognized
+	    std::string included;
+	    StringRef directive = line.first.ltrim();
+	    if (directive.startswith("#")) {
+		directive = directive.drop_front().ltrim();
+		if (directive.startswith("include")) {
+		    directive = directive.drop_front(strlen("include")).ltrim();
+		    size_t close = directive.find('"', 1);
+		    if (directive.startswith("\"") && close != StringRef::npos) {
+			SmallString<256> name(parent_path(path));
+			append(name, directive.slice(1, close));
+			if (Session->Outputs.find(name.str()) != Session->Outputs.end()) included = name.str();
+		    }
+		}
+	    }
+	    if (included.empty()) {
+		ret += line.first;
+		if (newline) ret += "\n";
+	    } else {
+		ret += inlineKernelIncludes(included, active);
+	    }
+	}
+	active.erase(path);
+	return ret;
+    }
+
+    //Whether args (split on whitespace) force-include a header, as '--precompile-kernels' needs for the builtins
+    bool hasIncludeArg(const std::string &args) {
+	std::stringstream ss(args);
+	std::string item;
+	while (ss >> item) {
+	    if (StringRef(item).startswith("-include")) return true;
+	}
+	return false;
+    }
+
+    //Compile the final text of the kernel output path to LLVM bitcode for triple (spir-unknown-unknown
+    // or spir64-unknown-unknown) with Clang's OpenCL frontend, for '--precompile-kernels'
+    //Every kernel output is served from memory, so #includes of other *-cl.cl files resolve
+    // Returns false, with Clang's diagnostics on stderr, if it doesn't compile
+    bool compileKernelToSPIR(const std::string &path, const std::string &triple, std::string &bitcode) {
+	std::vector<std::string> args;
+	args.push_back("-triple");
+	args.push_back(triple);
+	args.push_back("-emit-llvm-bc");
+	args.push_back("-x");
+	args.push_back("cl");
+	//SPIR 1.2 requires the kernel argument metadata
+	args.push_back("-cl-kernel-arg-info");
+	//A built-in the builtins header doesn't declare would otherwise be emitted as an unmangled int function
+	args.push_back("-Werror=implicit-function-declaration");
+	//Stands in for the "-I ." clBuildProgram gets, relative to where the kernel files are written
+	args.push_back("-I");
+	args.push_back(parent_path(path).empty() ? "." : parent_path(path).str());
+	std::string extra = Session->ExtraBuildArgs + " " + Session->PrecompileArgs;
+	std::stringstream ss(extra);
+	std::string item;
+	while (ss >> item) args.push_back(item);
+	args.push_back(path);
+	std::vector<const char *> argv;
+	for (std::vector<std::string>::iterator i = args.begin(), e = args.end(); i != e; i++) argv.push_back(i->c_str());
+
+	CompilerInstance Compiler;
+	Compiler.createDiagnostics();
+	if (!CompilerInvocation::CreateFromArgs(Compiler.getInvocation(), argv.data(), argv.data() + argv.size(), Compiler.getDiagnostics())) return false;
+	Compiler.getFrontendOpts().DisableFree = false;
+	for (std::map<std::string, std::string>::iterator i = Session->Outputs.begin(), e = Session->Outputs.end(); i != e; i++) {
+	    if (extension(i->first) == ".cl") Compiler.getPreprocessorOpts().addRemappedFile(i->first, llvm::MemoryBuffer::getMemBufferCopy(i->second, i->first));
+	}
+	llvm::LLVMContext Context;
+	EmitLLVMOnlyAction action(&Context);
+	if (!Compiler.ExecuteAction(action) || Compiler.getDiagnostics().hasErrorOccurred()) return false;
+	OwningPtr<llvm::Module> module(action.takeModule());
+	if (!module) return false;
+	llvm::raw_string_ostream OS(bitcode);
+	llvm::WriteBitcodeToFile(module.get(), OS);
+	OS.flush();
+	return true;
     }
 
 
-bool isInBannedInclude(SourceLocation loc, SourceManager * SM, LangOptions * LO) {
+//Decides whether loc's own file is off-limits to translation: CUDA/cutil headers, system headers, and
+// files #included with angle brackets are. When its file is quote-#included none of that settles it,
+// so the verdict is the includer's, and parentLoc is set to the #include to ask about instead
+enum IncludeVerdict {
+	Include_Allowed,
+	Include_Banned,
+	Include_AskParent
+};
+
+IncludeVerdict classifyInclude(SourceLocation loc, SourceManager * SM, LangOptions * LO, SourceLocation &parentLoc) {
 	SourceLocation sloc = SM->getSpellingLoc(loc);
 	//if (loc.isMacroID()) sloc = SM->getSpellingLoc(loc);
         std::string FileName = SM->getPresumedLoc(loc).getFilename();
 	//llvm::errs() << "CU2CL DEBUG: " << FileName;
 
             llvm::StringRef fileExt = extension(FileName);
-            if (fileExt.equals(".cu") || fileExt.equals(".cuh")) return false;
+            if (fileExt.equals(".cu") || fileExt.equals(".cuh")) return Include_Allowed;
 	//TODO check if the file was included by any file matching the below criteria	
 	if (filename(FileName).equals("cuda.h") || filename(FileName).equals("cuda_runtime.h") || filename(FileName).equals("cuda_runtime_api.h") || filename(FileName).equals("cuda_gl_interop.h") || filename(FileName).equals("cutil.h") || filename(FileName).equals("cutil_inline.h") || filename(FileName).equals("cutil_gl_inline.h") || filename(FileName).equals("vector_types.h") || SM->isInSystemHeader(loc) || SM->isInExternCSystemHeader(loc) || SM->isInSystemMacro(loc) || SM->isInSystemHeader(sloc) || SM->isInExternCSystemHeader(sloc) || SM->isInSystemMacro(sloc)) {
 		//it's a forbidden file, just skip the file
-		return true;
+		return Include_Banned;
 	}
-	SourceLocation parentLoc = SM->getIncludeLoc(SM->getFileID(loc));
+	parentLoc = SM->getIncludeLoc(SM->getFileID(loc));
 	//If the parent of the regular location isn't valid, try the spelling location
 	if (!parentLoc.isValid() && loc.isMacroID()) parentLoc = SM->getIncludeLoc(SM->getFileID(sloc));
 	if (!parentLoc.isValid()) {
 		if (!SM->isInMainFile(loc)) llvm::errs() << "CU2CL DEBUG: " << loc.printToString(*SM) << "\nInvalid parent IncludeLoc\n";
-		return false;
+		return Include_Allowed;
 	}
 	//If the include location is
 	//llvm::errs() << "CU2CL DEBUG: Checking parent include from [" << parentLoc.printToString(*SM) << "]\n";
@@ -469,18 +2230,31 @@ bool isInBannedInclude(SourceLocation loc, SourceManager * SM, LangOptions * LO)
 		//llvm::errs() << fileTok.getName() << " :Parent is a quote #include!\n";
 	
 		//As a fallback, try banning based on the parent
-		return isInBannedInclude(parentLoc, SM, LO);
+		return Include_AskParent;
 	} else {
 		//llvm::errs() << "Parent is an angle #include!\n";
-		return true;
+		return Include_Banned;
 	}
 	
 }
 
+bool isInBannedInclude(SourceLocation loc, SourceManager * SM, LangOptions * LO) {
+	SourceLocation parentLoc;
+	switch (classifyInclude(loc, SM, LO, parentLoc)) {
+	case Include_Banned:
+		return true;
+	case Include_AskParent:
+		return isInBannedInclude(parentLoc, SM, LO);
+	default:
+		return false;
+	}
+}
+
 //Simple timer calls that get injected if enabled
 #ifdef CU2CL_ENABLE_TIMING
-	uint64_t TransTime;    
-struct timeval startTime, endTime;
+//Per-thread, since each '-j' worker times its own translation units
+thread_local uint64_t TransTime;
+thread_local struct timeval startTime, endTime;
 
 void init_time() {
     gettimeofday(&startTime, NULL);
@@ -515,6 +2289,62 @@ static int getRangeSize(SourceManager &Sources, const CharSourceRange &Range) {
   return End.second - Start.second;
 }
 
+//Edits to the text of one expression, collected while it is walked and rendered once at the end
+//Expression rewriters used to give every subexpression a Rewriter of its own, render it, and splice
+// the result into the parent's Rewriter, copying the same text again at each level of nesting. Now
+// they all add to the outermost call's ExprEdits, so an expression is rewritten in time linear in its size
+//Like a Rewriter, only file (not macro) locations can be edited. Edits aren't expected to overlap,
+// where they do the one that starts first (or was added first) wins
+class ExprEdits {
+public:
+    ExprEdits(SourceManager &sm, const LangOptions &lo) : SM(sm), LO(lo) { }
+
+    void replace(SourceLocation loc, int len, StringRef text) {
+	if (loc.isInvalid() || !loc.isFileID() || len < 0) return;
+	std::pair<FileID, unsigned> decomp = SM.getDecomposedLoc(loc);
+	Edit edit = { decomp.first, decomp.second, (unsigned) len, text.str() };
+	Edits.push_back(edit);
+    }
+
+    //The text of a token range with the edits inside it applied, or "" if it can't be rendered
+    std::string render(SourceRange range) {
+	if (range.isInvalid() || !range.getBegin().isFileID() || !range.getEnd().isFileID()) return "";
+	std::pair<FileID, unsigned> begin = SM.getDecomposedLoc(range.getBegin());
+	std::pair<FileID, unsigned> end = SM.getDecomposedLoc(range.getEnd());
+	if (begin.first != end.first || end.second < begin.second) return "";
+	unsigned endOffset = end.second + Lexer::MeasureTokenLength(range.getEnd(), SM, LO);
+	bool invalid = false;
+	StringRef buf = SM.getBufferData(begin.first, &invalid);
+	if (invalid || endOffset > buf.size()) return "";
+	std::stable_sort(Edits.begin(), Edits.end(), compareEdits);
+	std::string text;
+	unsigned pos = begin.second;
+	for (std::vector<Edit>::iterator i = Edits.begin(), e = Edits.end(); i != e; i++) {
+	    if (i->File != begin.first || i->Offset < pos || i->Offset + i->Length > endOffset) continue;
+	    text.append(buf.data() + pos, i->Offset - pos);
+	    text += i->Text;
+	    pos = i->Offset + i->Length;
+	}
+	text.append(buf.data() + pos, endOffset - pos);
+	return text;
+    }
+
+private:
+    struct Edit {
+	FileID File;
+	unsigned Offset, Length;
+	std::string Text;
+    };
+
+    static bool compareEdits(const Edit &a, const Edit &b) {
+	return a.Offset < b.Offset;
+    }
+
+    SourceManager &SM;
+    const LangOptions &LO;
+    std::vector<Edit> Edits;
+};
+
 //This method is designed to walk a vector of Replacements that has already
 // been deduplicated, and fuse Replacments that are enqueued on the same
 // start SourceLocation
@@ -559,32 +2389,49 @@ void coalesceReplacements(std::vector<Replacement> &replace) {
 
     }
     //Comments to be injected into source code are buffered until after translation
-    // this struct implements a simple list for storing them, but is not meamnt for
-    // use outside the bufferComment and writeComments functions
-    // l is the SourceLoc pointer
-    // s is the string itself
-    // w declares whether it's a host (true) or device (false) comment
-    //WARNING: Not threadsafe at all!
-    struct commentBufferNode;
-    struct commentBufferNode {
-	void * l;
-	char * s;
-	std::vector<Replacement> * r;
-	struct commentBufferNode * n;
-	};
-    struct commentBufferNode * tail, * head;
+    // so they don't interfere with other rewrites. Each one records its position as a
+    // FileID and offset, the Replacement list it's headed for, and its text, which is
+    // copied into the buffer's arena: buffering is amortized O(1), and everything is
+    // released at once when the buffer is cleared or destroyed
+    //Not meant for use outside the bufferComment and writeComments functions
+    struct BufferedComment {
+	FileID File;
+	unsigned Offset;
+	StringRef Text;
+	std::vector<Replacement> *Replacements;
+    };
 
-    //Buffer a new comment destined to be added to output OpenCL source files
-    //WARNING: Not threadsafe at all!
-    void bufferComment(SourceLocation loc, std::string str, std::vector<Replacement> *replacements) {
-	struct commentBufferNode * n = (struct commentBufferNode *)malloc(sizeof(commentBufferNode));
-	n->s = (char *)malloc(sizeof(char)*(str.length()+1));
-	str.copy(n->s, str.length());
-	n->s[str.length()] = '\0';
-	n->l = loc.getPtrEncoding(); n->r = replacements; n->n = NULL;
+    class CommentBuffer {
+    public:
+	void add(SourceManager *SM, SourceLocation loc, StringRef text, std::vector<Replacement> *replacements) {
+	    std::pair<FileID, unsigned> decomp = SM->getDecomposedLoc(loc);
+	    char *copy = Arena.Allocate<char>(text.size());
+	    memcpy(copy, text.data(), text.size());
+	    BufferedComment comment = { decomp.first, decomp.second, StringRef(copy, text.size()), replacements };
+	    Comments.push_back(comment);
+	}
+
+	void clear() {
+	    Comments.clear();
+	    Arena.Reset();
+	}
+
+	std::vector<BufferedComment> Comments;
+
+    private:
+	llvm::BumpPtrAllocator Arena;
+    };
 
-	tail->n = n;
-	tail = n;
+    //The buffer comments currently go to: each TU's consumer owns one, and so does main for
+    // the tool-level rewrite. Per-thread, since a '-j' worker only ever has one TU in flight
+    thread_local CommentBuffer *PendingComments = NULL;
+
+    //Serializes diagnostics written to stderr by concurrent TUs
+    std::mutex DiagMutex;
+
+    //Buffer a new comment destined to be added to output OpenCL source files
+    void bufferComment(SourceManager *SM, SourceLocation loc, StringRef str, std::vector<Replacement> *replacements) {
+	if (PendingComments) PendingComments->add(SM, loc, str, replacements);
     }
 
 
@@ -625,11 +2472,12 @@ void coalesceReplacements(std::vector<Replacement> &replace) {
 			//Buffer the comment for outputing after translation is finished.
 			//Disable this section to turn off error emission, by default if an
 			// inline error string is empty, it will turn off comment insertion for that error
-			if (!inline_note.empty() && AddInlineComments) {
-				bufferComment(writeLoc, inlineStr.str(), replacements);
+			if (!inline_note.empty() && Session->AddInlineComments) {
+				bufferComment(SM, writeLoc, inlineStr.str(), replacements);
 			}
         }
         //Send the stderr string to stderr
+        std::lock_guard<std::mutex> lock(DiagMutex);
         llvm::errs() << errStr.str();
     }
     
@@ -659,22 +2507,364 @@ void coalesceReplacements(std::vector<Replacement> &replace) {
     }
     //Method to output comments destined for addition to output OpenCL source
     // which have been buffered to avoid sideeffects with other rewrites
-    //WARNING: Not threadsafe at all!
     void writeComments(SourceManager * SM) {
-	struct commentBufferNode * curr = head->n;
-	while (curr != NULL) { // as long as we have more comment nodes..
-	    // inject the comment to the host output stream if true
-		generateReplacement(*(curr->r), SM, SourceLocation::getFromPtrEncoding(curr->l), 0, llvm::StringRef(curr->s));
-	    //move ahead, then destroy the current node
-	    curr = curr->n;
-	    free(head->n->s);
-	    free(head->n);
-	    head->n = curr;
+	if (!PendingComments) return;
+	std::vector<BufferedComment> &comments = PendingComments->Comments;
+	//Indexed, since a rejected Replacement buffers a diagnostic comment of its own
+	for (size_t i = 0; i < comments.size(); i++) {
+	    BufferedComment comment = comments[i];
+	    generateReplacement(*comment.Replacements, SM, SM->getLocForStartOfFile(comment.File).getLocWithOffset(comment.Offset), 0, comment.Text);
 	}
+	PendingComments->clear();
+    }
+
+//Kernel built-ins and their OpenCL equivalents
+//An entry with a Rename only swaps the callee's name, leaving its (translated) arguments in place
+// otherwise the call is replaced by Template, where %0..%2 stand for the translated arguments
+struct KernelCallTranslation {
+    const char *Name;
+    const char *Rename;
+    const char *Template;
+};
+
+static const KernelCallTranslation KernelCallTranslations[] = {
+    { "__syncthreads", NULL, "barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE)" },
+    //begin single precision math API
+    { "acosf", "acos", NULL },
+    { "acoshf", "acosh", NULL },
+    { "asinf", "asin", NULL },
+    { "asinhf", "asinh", NULL },
+    { "atan2f", "atan2", NULL },
+    { "atanf", "atan", NULL },
+    { "atanhf", "atanh", NULL },
+    { "cbrtf", "cbrt", NULL },
+    { "ceilf", "ceil", NULL },
+    { "copysign", "copysign", NULL },
+    { "cosf", "cos", NULL },
+    { "coshf", "cosh", NULL },
+    { "cospif", "cospi", NULL },
+    { "erfcf", "erfc", NULL },
+    //TODO: support erfcinvf, erfcxf
+    { "erff", "erf", NULL },
+    //TODO: support erfinvf
+    { "exp10f", "exp10", NULL },
+    { "exp2f", "exp2", NULL },
+    { "expf", "exp", NULL },
+    { "expm1f", "expm1", NULL },
+    { "fabsf", "fabs", NULL },
+    { "fdimf", "fdim", NULL },
+    { "fdividef", NULL, "(%0/%1)" },
+    { "floorf", "floor", NULL },
+    { "fmaf", "fma", NULL },
+    { "fmaxf", "fmax", NULL },
+    { "fminf", "fmin", NULL },
+    { "fmodf", "fmod", NULL },
+    { "frexpf", "frexp", NULL },
+    { "hypotf", "hypot", NULL },
+    { "ilogbf", "ilogb", NULL },
+    { "isfinite", "isfinite", NULL },
+    { "isinf", "isinf", NULL },
+    { "isnan", "isnan", NULL },
+    //TODO: Support j0f, j1f, jnf - Bessel function of first kind order 0, 1, and n
+    { "ldexpf", "ldexp", NULL },
+    { "lgammaf", "lgamma", NULL },
+    //TODO: suppot llrintf, llroundf - rounding with long long return type
+    { "log10f", "log10", NULL },
+    { "log1pf", "log1p", NULL },
+    { "log2f", "log2", NULL },
+    { "logbf", "logb", NULL },
+    { "logf", "log", NULL },
+    //TODO: support lrintf, lroundf - rounding with long return type
+    { "modff", "modf", NULL },
+    { "nanf", "nan", NULL },
+    //TODO: Support nearbyintf
+    { "nextafterf", "nextafter", NULL },
+    { "powf", "pow", NULL },
+    { "rcbrtf", NULL, "(1/cbrt(%0))" },
+    { "remainderf", "remainder", NULL },
+    { "remquof", "remquo", NULL },
+    { "rintf", "rint", NULL },
+    { "roundf", "round", NULL },
+    { "rsqrtf", "rsqrt", NULL },
+    //WARNING: Both scalbnf and scalblnf are not guaranteed to use the efficient "native" method of exponent manipulation, but are mathematically correct
+    { "scalbnf", "ldexp", NULL },
+    { "scalblnf", "ldexp", NULL },
+    { "signbit", "signbit", NULL },
+    { "sincosf", NULL, "(*%1 = sincos(%0, %2))" },
+    { "sinf", "sin", NULL },
+    { "sinhf", "sinh", NULL },
+    { "sinpif", "sinpi", NULL },
+    { "sqrtf", "sqrt", NULL },
+    { "tanf", "tan", NULL },
+    { "tanhf", "tanh", NULL },
+    { "tgammaf", "tgamma", NULL },
+    { "truncf", "trunc", NULL },
+    //TODO: Support y0f, y1f, ynf - Bessel function of first kind order 0, 1, and n
+    //Begin double precision
+    //These are only "translated" to ensure nested expressions get translated
+    { "acos", "acos", NULL },
+    { "acosh", "acosh", NULL },
+    { "asin", "asin", NULL },
+    { "asinh", "asinh", NULL },
+    { "atan", "atan", NULL },
+    { "atan2", "atan2", NULL },
+    { "atanh", "atanh", NULL },
+    { "cbrt", "cbrt", NULL },
+    { "ceil", "ceil", NULL },
+    //NOTE: Copysign is already handled in floating point section
+    { "cos", "cos", NULL },
+    { "cosh", "cosh", NULL },
+    { "cospi", "cospi", NULL },
+    { "erf", "erf", NULL },
+    { "erfc", "erfc", NULL },
+    //TODO: support erfinv, erfcinv, erfcx
+    { "exp", "exp", NULL },
+    { "exp10", "exp10", NULL },
+    { "exp2", "exp2", NULL },
+    { "expm1", "expm1", NULL },
+    { "fabs", "fabs", NULL },
+    { "fdim", "fdim", NULL },
+    { "floor", "floor", NULL },
+    { "fma", "fma", NULL },
+    { "fmax", "fmax", NULL },
+    { "fmin", "fmin", NULL },
+    { "fmod", "fmod", NULL },
+    { "frexp", "frexp", NULL },
+    { "hypot", "hypot", NULL },
+    { "ilogb", "ilogb", NULL },
+    //NOTE: isfinite, isinf, and isnan are all handled in floating point section
+    //TODO: support j0, j1, jn - Bessel functions of the first kind of order 0, 1, and n
+    { "ldexp", "ldexp", NULL },
+    { "lgamma", "lgamma", NULL },
+    //TODO: support llrint, llround
+    { "log", "log", NULL },
+    { "log10", "log10", NULL },
+    { "log1p", "log1p", NULL },
+    { "log2", "log2", NULL },
+    { "logb", "logb", NULL },
+    //TODO: support lrint, lround
+    { "modf", "modf", NULL },
+    //NOTE: nan is handled in floating point section
+    //TODO: Support nearbyint
+    { "nextafter", "nextafter", NULL },
+    { "pow", "pow", NULL },
+    { "rcbrt", NULL, "(1/cbrt(%0))" },
+    { "remainder", "remainder", NULL },
+    { "remquo", "remquo", NULL },
+    { "rint", "rint", NULL },
+    { "round", "round", NULL },
+    { "rsqrt", "rsqrt", NULL },
+    //WARNING: Both scalbnf and scalblnf are not guaranteed to use the efficient "native" method of exponent manipulation, but are mathematically correct
+    { "scalbn", "ldexp", NULL },
+    { "scalbln", "ldexp", NULL },
+    //NOTE: signbit is already handled in the float section
+    { "sin", "sin", NULL },
+    { "sincos", NULL, "(*%1 = sincos(%0, %2))" },
+    { "sinh", "sinh", NULL },
+    { "sinpi", "sinpi", NULL },
+    { "sqrt", "sqrt", NULL },
+    { "tan", "tan", NULL },
+    { "tanh", "tanh", NULL },
+    { "tgamma", "tgamma", NULL },
+    { "trunc", "trunc", NULL },
+    //TODO: support y0, y1, yn
+    //Begin native floats
+    { "__cosf", "native_cos", NULL },
+    { "__exp10f", "native_exp10", NULL },
+    { "__expf", "native_exp", NULL },
+    //TODO: support fadd and fdiv with rounding modes
+    { "__fdividef", "native_divide", NULL },
+    //TODO: support fmaf, fmul, frcp, and fsqrt with rounding modes
+    { "__log10f", "native_log10", NULL },
+    { "__log2f", "native_log2", NULL },
+    { "__logf", "native_log", NULL },
+    { "__powf", "native_powr", NULL },
+    //NOTE: does not use intrinsics, but returns an equivalent value
+    { "__saturatef", NULL, "clamp(%0, 0.0f, 1.0f)" },
+    { "__sinf", "native_sin", NULL },
+    //NOTE: does not use intrinsics, but returns an equivalent value
+    { "__sincosf", NULL, "(*%1 = sincos(%0, %2))" },
+    { "__tanf", "native_tan", NULL },
+    //Begin double intrinsics
+    //TODO: support double intrinsics
+    //Begin integer intrinsics
+    //TODO: support integer intrinsics
+    //Begin type casting intrinsics
+    { "__double2float_rd", "convert_float_rtn", NULL },
+    { "__double2float_rn", "convert_float_rte", NULL },
+    { "__double2float_ru", "convert_float_rtp", NULL },
+    { "__double2float_rz", "convert_float_rtz", NULL },
+    //TODO: support __double2hiint
+    { "__double2int_rd", "convert_int_rtn", NULL },
+    { "__double2int_rn", "convert_int_rte", NULL },
+    { "__double2int_ru", "convert_int_rtp", NULL },
+    { "__double2int_rz", "convert_int_rtz", NULL },
+};
+
+//TODO: Add an option for OpenCL >= 1.1 to keep 3-member vectors
+//Returns the OpenCL spelling of a CUDA vector type (with the host-side cl_ prefix if addCL),
+// or an empty StringRef if type isn't one
+static llvm::StringRef RewriteVectorType(llvm::StringRef type, bool addCL) {
+    //Built once, on first use; each entry holds the kernel and host spellings
+    static const llvm::StringMap<std::pair<std::string, std::string> > VectorTypes = []() {
+        llvm::StringMap<std::pair<std::string, std::string> > types;
+        const char *elems[] = { "char", "short", "int", "long", "float" };
+        for (unsigned e = 0; e < sizeof(elems) / sizeof(elems[0]); e++) {
+            for (char size = '1'; size <= '4'; size++) {
+                std::string append;
+                if (size == '3') //Only necessary when supporting OpenCL 1.0, otherwise 3 member vectors are supported
+                    append = '4';
+                else if (size != '1')
+                    append = size;
+                std::string name = std::string(elems[e]) + size, newName = std::string(elems[e]) + append;
+                types[name] = std::make_pair(newName, "cl_" + newName);
+                types["u" + name] = std::make_pair("u" + newName, "cl_u" + newName);
+            }
+        }
+        return types;
+    }();
+
+    llvm::StringMap<std::pair<std::string, std::string> >::const_iterator vec = VectorTypes.find(type);
+    if (vec == VectorTypes.end())
+        return llvm::StringRef();
+    return (addCL ? vec->getValue().second : vec->getValue().first);
+}
+
+//The CUDA types that get translated to something else
+enum CUDATypeKind {
+    CUDAType_None,
+    CUDAType_Dim3,
+    CUDAType_Uint3,
+    CUDAType_Stream,
+    CUDAType_Event,
+    CUDAType_DeviceProp,
+    CUDAType_Vector
+};
+
+//Classifies types by their canonical Type, so typedefs and spelling don't matter
+// The CUDA record names are looked up in the identifier table once, and
+// each canonical type is resolved only the first time it is seen
+class CUDATypeClassifier {
+public:
+    CUDATypeClassifier(IdentifierTable &Idents) : Dim3(&Idents.get("dim3")), Uint3(&Idents.get("uint3")),
+        StreamRecord(&Idents.get("CUstream_st")), EventRecord(&Idents.get("CUevent_st")),
+        DeviceProp(&Idents.get("cudaDeviceProp")) { }
+
+    CUDATypeKind classify(QualType qt) {
+        if (qt.isNull()) return CUDAType_None;
+        const Type *canon = qt.getCanonicalType().getTypePtr();
+        llvm::DenseMap<const Type *, CUDATypeKind>::iterator cached = Kinds.find(canon);
+        if (cached != Kinds.end()) return cached->second;
+        CUDATypeKind kind = resolve(canon);
+        Kinds[canon] = kind;
+        return kind;
+    }
+
+    //The OpenCL spelling of a CUDA vector type, or an empty StringRef for any other type
+    //uint3 declarations are vectors too, it's only classified apart for the threadIdx/blockIdx members
+    llvm::StringRef getVectorType(QualType qt, bool addCL) {
+        CUDATypeKind kind = classify(qt);
+        if (kind != CUDAType_Vector && kind != CUDAType_Uint3) return llvm::StringRef();
+        return RewriteVectorType(qt->getAs<RecordType>()->getDecl()->getName(), addCL);
+    }
 
-	tail = head;
+private:
+    CUDATypeKind resolve(const Type *t) {
+        //cudaStream_t and cudaEvent_t are pointers to opaque driver structs
+        if (const PointerType *pt = dyn_cast<PointerType>(t)) {
+            if (const RecordType *pointee = pt->getPointeeType()->getAs<RecordType>()) {
+                IdentifierInfo *name = pointee->getDecl()->getIdentifier();
+                if (name == StreamRecord) return CUDAType_Stream;
+                if (name == EventRecord) return CUDAType_Event;
+            }
+            return CUDAType_None;
+        }
+        if (const RecordType *rt = dyn_cast<RecordType>(t)) {
+            IdentifierInfo *name = rt->getDecl()->getIdentifier();
+            if (name == NULL) return CUDAType_None;
+            if (name == Dim3) return CUDAType_Dim3;
+            if (name == Uint3) return CUDAType_Uint3;
+            if (name == DeviceProp) return CUDAType_DeviceProp;
+            if (!RewriteVectorType(name->getName(), false).empty()) return CUDAType_Vector;
+        }
+        return CUDAType_None;
     }
 
+    IdentifierInfo *Dim3, *Uint3, *StreamRecord, *EventRecord, *DeviceProp;
+    llvm::DenseMap<const Type *, CUDATypeKind> Kinds;
+};
+
+//Generate the Replacements that turn decl into a cl_mem, appending them to replacements
+void replaceVarDecl(DeclaratorDecl *decl, SourceTuple * ST, std::vector<Replacement> &replacements) {
+	//IIRC If the dyn_cast of the VarDecl doesn't work it'll show up as NULL
+	//llvm::errs() << "CU2CL DEBUG: Replacing var decl " << (void*)decl << "\n";
+	SourceManager * SM = std::get<0>(*ST);
+	Preprocessor * PP = std::get<1>(*ST);
+	LangOptions * LO = std::get<2>(*ST);
+	if (decl == NULL) return;
+	std::string replace = "";
+        SourceLocation start, end, tempLoc;
+		start = decl->getLocStart();
+        	if ((decl->getAttr<CUDAConstantAttr>()) || (decl->getAttr<CUDADeviceAttr>() )) {
+			start = decl->getTypeSpecStartLoc();
+		}
+		end = decl->getLocEnd();
+			//Make sure we have the correct amount of "pointer to" on the output type
+			std::string pointers = " ";
+			for (Type * type = (Type *)decl->getType().getTypePtrOrNull(); type != NULL && type->isPointerType(); ) {
+				Type * interior =  (Type *) type->getPointeeType().getTypePtrOrNull();
+				if (interior->isPointerType()) {
+					pointers = pointers + "*";
+				}
+				type = interior;
+			}
+			if (pointers == " ") pointers = "";
+			
+                    replace += "cl_mem" + pointers + " " + decl->getNameAsString();
+			if (VarDecl *var = dyn_cast<VarDecl>(decl)) {
+		    if (var->getType()->isArrayType()) {
+			//make sure to grab the array [...] Expr too
+            ArrayTypeLoc arrTL = var->getTypeSourceInfo()->getTypeLoc().getAs<ArrayTypeLoc>();
+		while (!arrTL.isNull()) {
+			replace += "[";
+			if (arrTL.getSizeExpr() != NULL) replace += getStmtText(LO, SM, arrTL.getSizeExpr());
+			arrTL = arrTL.getElementLoc().getAs<ArrayTypeLoc>();
+			replace += "]";
+		}
+		    }
+			//If it's a parameter, we want to keep the comma, not replace it with a semiclon
+			if (dyn_cast<ParmVarDecl>(decl) == NULL) replace += ";";
+	    		if ((tempLoc = Lexer::findLocationAfterToken(end, tok::semi, *SM, *LO, false)).isValid()) {
+				//found a semicolon, replace the endLoc with the semicolon's loc
+			end = tempLoc;
+	    		} else {
+				//we only want to insert a newline for DeclGroups, which will necessarily not have a semicolon on any but the last member
+				if (dyn_cast<ParmVarDecl>(decl) == NULL) replace += "\n";
+			}
+			
+	        	generateReplacement(replacements, SM, start, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(SM->getExpansionLoc(start), SM->getExpansionLoc(end)))), replace);
+			} else if (FieldDecl * fdecl = dyn_cast<FieldDecl>(decl)) {
+		    if (fdecl->getType()->isArrayType()) {
+			//make sure to grab the array [...] Expr too
+            ArrayTypeLoc arrTL = fdecl->getTypeSourceInfo()->getTypeLoc().getAs<ArrayTypeLoc>();
+		while (!arrTL.isNull()) {
+			replace += "[";
+			if (arrTL.getSizeExpr() != NULL) replace += getStmtText(LO, SM, arrTL.getSizeExpr());
+			arrTL = arrTL.getElementLoc().getAs<ArrayTypeLoc>();
+			replace += "]";
+		}
+		    }
+	        		generateReplacement(replacements, SM, start, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(SM->getExpansionLoc(start), SM->getExpansionLoc(end)))), replace);
+				
+
+			} else {
+				TypeLoc tl = decl->getTypeSourceInfo()->getTypeLoc();
+				SourceRange realRange(tl.getBeginLoc(), Lexer::getLocForEndOfToken(tl.getBeginLoc(), 0, *SM, *LO));
+	        		generateReplacement(replacements, SM, tl.getBeginLoc(), getRangeSize(*SM, CharSourceRange::getTokenRange(tl.getLocalSourceRange())), "cl_mem");
+    			}
+
+}
+
 class RewriteCUDA;
 
 //The class prototype necessary to trigger rewriting #included files
@@ -691,6 +2881,9 @@ public:
                                     StringRef, StringRef,
 				    const Module *);
 
+    virtual void FileChanged(SourceLocation, FileChangeReason,
+                             SrcMgr::CharacteristicKind, FileID);
+
 };
 
 
@@ -711,6 +2904,22 @@ private:
     LangOptions *LO;
     Preprocessor *PP;
     SourceTuple *ST;
+    DeclKeyIndexer *DeclKeys;
+    //Decls this TU has already registered with the propagation graph
+    llvm::DenseSet<DeclaratorDecl *> PropagationDecls;
+
+    CUDATypeClassifier *TypeKinds;
+
+    //Inline comments buffered by this TU, flushed at the end of HandleTranslationUnit
+    CommentBuffer TUComments;
+
+    //Memoized isInBannedInclude verdicts, see IsInBannedFile
+    llvm::DenseMap<FileID, bool> BannedFiles;
+
+    //Host API handlers and kernel built-in translations, keyed by this TU's identifiers
+    typedef bool (RewriteCUDA::*CUDACallRewriter)(CallExpr *, std::string &);
+    llvm::DenseMap<IdentifierInfo *, CUDACallRewriter> CUDACallRewriters;
+    llvm::DenseMap<IdentifierInfo *, const KernelCallTranslation *> KernelCallTranslators;
 
     Rewriter HostRewrite;
     Rewriter KernelRewrite;
@@ -729,6 +2938,9 @@ private:
 
     StringRefListMap Kernels;
 
+    //This TU's share of the tool-level structures, merged once every TU is done
+    TUContributions *Contrib;
+
     std::set<DeclGroupRef, cmpDG> GlobalVarDeclGroups;
     std::set<DeclGroupRef, cmpDG> CurVarDeclGroups;
     std::set<DeclGroupRef, cmpDG> DeviceMemDGs;
@@ -740,6 +2952,22 @@ private:
 
     std::map<SourceLocation, Replacement> HostVecVars;
 
+    //Quote-#included files, recorded as translation cache dependencies
+    std::set<const FileEntry *> LocalIncludes;
+
+    //Whether this TU rewrites each header's declarations or leaves them to the TU that already did (see TranslatedHeaders)
+    llvm::DenseMap<FileID, bool> SkipHeaderDecls;
+    //Headers this TU rewrote, and those of them whose rewriting also changed this TU's own preamble,
+    // which other TUs would miss out on if they skipped them
+    std::set<FileID> RewrittenHeaders;
+    std::set<FileID> UnshareableHeaders;
+    //Hash of this TU's command-line macros, headers are only shared between TUs that agree on them
+    std::string MacroContext;
+    //Every file this TU entered other than the main file (path, size and modification time), in order,
+    // and how many had been entered before each FileID, for GetIncludeContext
+    std::vector<std::string> EnteredFiles;
+    llvm::DenseMap<FileID, unsigned> EntryHistory;
+
     TypeLoc LastLoc;
 
     std::string MainFuncName;
@@ -801,11 +3029,16 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
     //Simple function to strip attributes from host functions that may be declared as 
     // both __host__ and __device__, then passes off to the host-side statement rewriter
     void RewriteHostFunction(FunctionDecl *hostFunc) {
-	//Register it on the RedeclMap
+	//Link its parameters to the first declaration's, so a cl_mem on any redeclaration reaches them all
 	//TODO: We may want to check if this FunctionDecl (by text location) has already been added by another AST
 	//TODO:  but for now we are assuming we will generate the same replacements that just get deduped
-	    AllFuncsByCanon[hostFunc->getFirstDecl()->getLocStart().printToString(*SM)].push_back(std::pair<FunctionDecl *, SourceTuple *>(hostFunc, ST));
-	
+	FunctionDecl *firstDecl = hostFunc->getFirstDecl();
+	if (firstDecl != hostFunc && firstDecl->getNumParams() == hostFunc->getNumParams()) {
+	    for (unsigned i = 0; i < hostFunc->getNumParams(); i++) {
+		AddPropagationEdge(hostFunc->getParamDecl(i), firstDecl->getParamDecl(i));
+		AddPropagationEdge(firstDecl->getParamDecl(i), hostFunc->getParamDecl(i));
+	    }
+	}
 
         //Remove any CUDA function attributes
         if (CUDAHostAttr *attr = hostFunc->getAttr<CUDAHostAttr>()) {
@@ -818,10 +3051,65 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
         //Rewrite the body
         if (Stmt *body = hostFunc->getBody()) {
             RewriteHostStmt(body);
+            RecordPropagationEdges(body, NULL);
         }
         CurVarDeclGroups.clear();
     }
 
+    //Record a propagation edge between two Decls, registering each endpoint's Decl the first time it's seen
+    void AddPropagationEdge(DeclaratorDecl *from, DeclaratorDecl *to) {
+        Contrib->PropagationEdges.push_back(PropagationEdge(RecordPropagationDecl(from), RecordPropagationDecl(to)));
+    }
+
+    //Its cl_mem rewrite is generated now, while the AST is around, and only applied if the Decl ends up flagged
+    DeclLocKey RecordPropagationDecl(DeclaratorDecl *decl) {
+        DeclLocKey key = DeclKeys->getKey(decl->getLocation());
+        if (PropagationDecls.insert(decl).second) {
+            Contrib->PropagationInstances.push_back(PropagationInstance(key, DeclKeys->getKey(decl->getLocStart())));
+            if (decl->getLocStart().isValid()) replaceVarDecl(decl, ST, Contrib->PropagationInstances.back().Rewrite);
+        }
+        return key;
+    }
+
+    //Walk host code recording cl_mem propagation edges for every call made in it
+    //target is the parameter that the argument s is (part of) flows into, if any. Only the
+    // innermost call counts, and nothing propagates past a statement boundary
+    void RecordPropagationEdges(Stmt *s, ParmVarDecl *target) {
+        if (!isa<Expr>(s)) target = NULL;
+
+        if (DeclRefExpr *dre = dyn_cast<DeclRefExpr>(s)) {
+            VarDecl *var = dyn_cast<VarDecl>(dre->getDecl());
+            if (var && target) AddPropagationEdge(var, target);
+            return;
+        }
+        if (CallExpr *call = dyn_cast<CallExpr>(s)) {
+            FunctionDecl *callee = call->getDirectCallee();
+            //Kernel launches and CUDA API calls are translated in place, their parameters never become cl_mems
+            IdentifierInfo *calleeName = (callee ? callee->getIdentifier() : NULL);
+            bool propagates = callee && !isa<CUDAKernelCallExpr>(call) && !(calleeName && calleeName->getName().startswith("cu"));
+            //Overloaded member operators take their object as the first argument, but not as a parameter
+            unsigned parmOffset = (isa<CXXOperatorCallExpr>(call) && callee && isa<CXXMethodDecl>(callee)) ? 1 : 0;
+            for (unsigned i = 0; i < call->getNumArgs(); i++) {
+                ParmVarDecl *parm = NULL;
+                if (propagates && i >= parmOffset && i - parmOffset < callee->getNumParams())
+                    parm = callee->getParamDecl(i - parmOffset);
+                if (parm) {
+                    //A variable passed as-is receives the parameter's cl_mem as well
+                    if (DeclRefExpr *argRef = dyn_cast<DeclRefExpr>(call->getArg(i)->IgnoreImplicit()))
+                        if (VarDecl *argVar = dyn_cast<VarDecl>(argRef->getDecl()))
+                            AddPropagationEdge(parm, argVar);
+                }
+                RecordPropagationEdges(call->getArg(i), parm);
+            }
+            //The callee itself isn't an argument to anything
+            RecordPropagationEdges(call->getCallee(), NULL);
+            return;
+        }
+        for (Stmt::child_iterator CI = s->child_begin(), CE = s->child_end(); CI != CE; ++CI)
+            if (*CI)
+                RecordPropagationEdges(*CI, target);
+    }
+
     //Forks host-side statement processing between expressions, declarations, and other statements
     void RewriteHostStmt(Stmt *s) {
         //Visit this node
@@ -860,22 +3148,22 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
     //Expressions, along with declarations, are the main meat of what needs to be rewritten
     //Host-side we primarily need to deal with CUDA C kernel launches and API call expressions
     bool RewriteHostExpr(Expr *e, std::string &newExpr) {
+        ExprEdits edits(*SM, *LO);
+        return RewriteHostExpr(e, newExpr, edits, true);
+    }
+
+    //Rewrites e by adding to edits: translations that rebuild all of e set newExpr and record it as one
+    // edit, the rest just record edits to e's types and subexpressions (which recurse into the same edits)
+    //Only the outermost call renders, setting newExpr to e's text with the edits applied
+    bool RewriteHostExpr(Expr *e, std::string &newExpr, ExprEdits &edits, bool render) {
         //Return value specifies whether or not a rewrite occurred
         if (e->getSourceRange().isInvalid())
             return false;
 
-        //Rewriter used for rewriting subexpressions
-        Rewriter exprRewriter(*SM, *LO);
         //Instantiation locations are used to capture macros
         SourceRange realRange(SM->getExpansionLoc(e->getLocStart()),
                               SM->getExpansionLoc(e->getLocEnd()));
 
-	//If DRE, register for potential late translation
-        if (DeclRefExpr *dre = dyn_cast<DeclRefExpr>(e)) {
-
-	    AllDeclRefsByDecl[dre->getDecl()->getLocStart().printToString(*SM)].push_back(dre);
-	}
-
 	//Detect CUDA C style kernel launches ie. fooKern<<<Grid, Block, shared, stream>>>(args..);
 	// the Runtime and Driver API's launch mechanisms would be handled with the rest of the API calls
         if (CUDAKernelCallExpr *kce = dyn_cast<CUDAKernelCallExpr>(e)) {
@@ -891,6 +3179,7 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
             }
 	    //If it's not a templated or pointer launch, proceed with translation
             newExpr = RewriteCUDAKernelCall(kce);
+            ReplaceStmtWithText(e, newExpr, edits);
             return true;
         }
         else if (CallExpr *ce = dyn_cast<CallExpr>(e)) {
@@ -907,16 +3196,19 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
 	    // and all Driver API calls that are prefixed with just "cu"
 	    //Also catches cutil, cuFFT, cuBLAS, and other library calls incidentally, which may or may not be wanted
 	    //TODO: Perhaps a second tier of filtering is needed
-	    else if (ce->getDirectCallee()->getNameAsString().find("cu") == 0)
-                return RewriteCUDACall(ce, newExpr);
+	    else if (ce->getDirectCallee()->getIdentifier() && ce->getDirectCallee()->getIdentifier()->getName().startswith("cu")) {
+                if (!RewriteCUDACall(ce, newExpr)) return false;
+                ReplaceStmtWithText(e, newExpr, edits);
+                return true;
+            }
         }
 	//Catches expressions which refer to the member of a struct or class
 	// in the CUDA case these are primarily just dim3s and cudaDeviceProp
         else if (MemberExpr *me = dyn_cast<MemberExpr>(e)) {
             //Check base Expr, if DeclRefExpr and a dim3, then rewrite
             if (DeclRefExpr *dre = dyn_cast<DeclRefExpr>(me->getBase())) {
-                std::string type = dre->getDecl()->getType().getAsString();
-                if (type == "dim3") {
+                CUDATypeKind kind = TypeKinds->classify(dre->getDecl()->getType());
+                if (kind == CUDAType_Dim3) {
                     std::string name = me->getMemberDecl()->getNameAsString();
                     if (name == "x") {
                         name = "[0]";
@@ -928,9 +3220,10 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
                         name = "[2]";
                     }
                     newExpr = getStmtText(LO, SM, dre) + name; //PrintStmtToString(dre) + name;
+                    ReplaceStmtWithText(e, newExpr, edits);
                     return true;
                 }
-                else if (type == "cudaDeviceProp") {
+                else if (kind == CUDAType_DeviceProp) {
                     //TODO check what the reference is
                     //TODO if unsupported, print a warning
 
@@ -948,23 +3241,22 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
             while (!tl.getNextTypeLoc().isNull()) {
                 tl = tl.getNextTypeLoc();
             }
-            QualType qt = tl.getType();
-            std::string type = qt.getAsString();
+            CUDATypeKind kind = TypeKinds->classify(tl.getType());
 
-            if (type == "dim3") {
+            if (kind == CUDAType_Dim3) {
                 if (origTL.getTypePtr()->isPointerType())
-                    RewriteType(tl, "size_t *", exprRewriter);
+                    RewriteType(tl, "size_t *", edits);
                 else
-                    RewriteType(tl, "size_t[3]", exprRewriter);
+                    RewriteType(tl, "size_t[3]", edits);
             }
-            else if (type == "struct cudaDeviceProp") {
-                RewriteType(tl, "struct __cu2cl_DeviceProp", exprRewriter);
+            else if (kind == CUDAType_DeviceProp) {
+                RewriteType(tl, "struct __cu2cl_DeviceProp", edits);
             }
-            else if (type == "cudaStream_t") {
-                RewriteType(tl, "cl_command_queue", exprRewriter);
+            else if (kind == CUDAType_Stream) {
+                RewriteType(tl, "cl_command_queue", edits);
             }
-            else if (type == "cudaEvent_t") {
-                RewriteType(tl, "cl_event", exprRewriter);
+            else if (kind == CUDAType_Event) {
+                RewriteType(tl, "cl_event", edits);
             }
             else {
                 ret = false;
@@ -972,11 +3264,9 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
 
             //Rewrite subexpression
             std::string s;
-            if (RewriteHostExpr(ece->getSubExpr(), s)) {
-                ReplaceStmtWithText(ece->getSubExpr(), s, exprRewriter);
+            if (RewriteHostExpr(ece->getSubExpr(), s, edits, false))
                 ret = true;
-            }
-            newExpr = exprRewriter.getRewrittenText(realRange);
+            if (render) newExpr = edits.render(realRange);
             return ret;
         }
 	//Rewrite unary expressions or type trait expressions (things like sizeof)
@@ -987,27 +3277,24 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
                 while (!tl.getNextTypeLoc().isNull()) {
                     tl = tl.getNextTypeLoc();
                 }
-                QualType qt = tl.getType();
-                std::string type = qt.getAsString();
+                CUDATypeKind kind = TypeKinds->classify(tl.getType());
 
-                if (type == "dim3") {
-                    RewriteType(tl, "size_t[3]", exprRewriter);
+                if (kind == CUDAType_Dim3) {
+                    RewriteType(tl, "size_t[3]", edits);
                 }
-                else if (type == "struct cudaDeviceProp") {
-                    RewriteType(tl, "struct __cu2cl_DeviceProp", exprRewriter);
+                else if (kind == CUDAType_DeviceProp) {
+                    RewriteType(tl, "struct __cu2cl_DeviceProp", edits);
                 }
-                else if (type == "cudaStream_t") {
-                    RewriteType(tl, "cl_command_queue", exprRewriter);
+                else if (kind == CUDAType_Stream) {
+                    RewriteType(tl, "cl_command_queue", edits);
                 }
-                else if (type == "cudaEvent_t") {
-                    RewriteType(tl, "cl_event", exprRewriter);
+                else if (kind == CUDAType_Event) {
+                    RewriteType(tl, "cl_event", edits);
                 }
                 else {
                     ret = false;
                 }
-                    SourceRange newrealRange(SM->getExpansionLoc(e->getLocStart()),
-                              SM->getExpansionLoc(e->getLocEnd()));
-                newExpr = exprRewriter.getRewrittenText(newrealRange);
+                if (render) newExpr = edits.render(realRange);
                 return ret;
             }
         }
@@ -1018,11 +3305,7 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
             //constructor, then need to assign each separately
             CXXConstructorDecl *ccd = cte->getConstructor();
             CXXRecordDecl *crd = ccd->getParent();
-            const Type *t = crd->getTypeForDecl();
-            QualType qt = t->getCanonicalTypeInternal();
-            std::string type = qt.getAsString();
-
-            if (type == "struct dim3") {
+            if (TypeKinds->classify(QualType(crd->getTypeForDecl(), 0)) == CUDAType_Dim3) {
                 std::string args = "{";
                 for (CXXConstructExpr::arg_iterator i = cte->arg_begin(),
                      e = cte->arg_end(); i != e; ++i) {
@@ -1040,6 +3323,7 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
                 }
                 args += "}";
                 newExpr = args;
+                ReplaceStmtWithText(e, newExpr, edits);
                 return true;
             }
         }
@@ -1047,22 +3331,14 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
         else if (CXXConstructExpr *cce = dyn_cast<CXXConstructExpr>(e)) {
             CXXConstructorDecl *ccd = cce->getConstructor();
             CXXRecordDecl *crd = ccd->getParent();
-            const Type *t = crd->getTypeForDecl();
-            QualType qt = t->getCanonicalTypeInternal();
-            std::string type = qt.getAsString();
-
-            if (type == "struct dim3") {
+            if (TypeKinds->classify(QualType(crd->getTypeForDecl(), 0)) == CUDAType_Dim3) {
                 if (cce->getNumArgs() == 1) {
                     //Rewrite subexpression
                     bool ret = false;
                     std::string s;
-                    if (RewriteHostExpr(cce->getArg(0), s)) {
-                        ReplaceStmtWithText(cce->getArg(0), s, exprRewriter);
+                    if (RewriteHostExpr(cce->getArg(0), s, edits, false))
                         ret = true;
-                    }
-                    SourceRange newrealRange(SM->getExpansionLoc(e->getLocStart()),
-                              SM->getExpansionLoc(e->getLocEnd()));
-                    newExpr = exprRewriter.getRewrittenText(newrealRange);
+                    if (render) newExpr = edits.render(realRange);
                     return ret;
                 }
                 else {
@@ -1083,488 +3359,566 @@ void TraverseStmt(Stmt *e, unsigned int indent) {
                     }
                     args += "}";
                     newExpr = args;
+                    ReplaceStmtWithText(e, newExpr, edits);
                 }
                 return true;
             }
         }
 
         bool ret = false;
-        //Do a DFS, recursing into children, then rewriting this expression
-        //if rewrite happened, replace text at old sourcerange
+        //Do a DFS, recursing into children, which record their rewrites in the same edits
         for (Stmt::child_iterator CI = e->child_begin(), CE = e->child_end();
              CI != CE; ++CI) {
             std::string s;
             Expr *child = (Expr *) *CI;
-            if (child && RewriteHostExpr(child, s)) {
-                //Perform "rewrite", which is just a simple replace
-                ReplaceStmtWithText(child, s, exprRewriter);
+            if (child && RewriteHostExpr(child, s, edits, false))
                 ret = true;
-            }
         }
 
-
-        SourceRange newrealRange(SM->getExpansionLoc(e->getLocStart()),
-                              SM->getExpansionLoc(e->getLocEnd()));
-        newExpr = exprRewriter.getRewrittenText(realRange);
+        if (render) newExpr = edits.render(realRange);
         return ret;
     }
 
+    //Resolve the host API and kernel built-in tables against this TU's identifier table
+    // so calls are dispatched on their callee's IdentifierInfo, without building its name
+    void RegisterCallRewriters() {
+        static const struct {
+            const char *Name;
+            CUDACallRewriter Rewriter;
+        } CUDACalls[] = {
+            //Thread Management
+            { "cudaThreadExit", &RewriteCUDA::RewriteCUDAThreadExit },
+            { "cudaThreadSynchronize", &RewriteCUDA::RewriteCUDAThreadSynchronize },
+            //Device Management
+            { "cudaGetDevice", &RewriteCUDA::RewriteCUDAGetDevice },
+            { "cudaGetDeviceCount", &RewriteCUDA::RewriteCUDAGetDeviceCount },
+            { "cudaSetDevice", &RewriteCUDA::RewriteCUDASetDevice },
+            { "cudaSetDeviceFlags", &RewriteCUDA::RewriteCUDASetDeviceFlags },
+            { "cudaGetDeviceProperties", &RewriteCUDA::RewriteCUDAGetDeviceProperties },
+            //Stream Management
+            { "cudaStreamCreate", &RewriteCUDA::RewriteCUDAStreamCreate },
+            { "cudaStreamDestroy", &RewriteCUDA::RewriteCUDAStreamDestroy },
+            { "cudaStreamQuery", &RewriteCUDA::RewriteCUDAStreamQuery },
+            { "cudaStreamSynchronize", &RewriteCUDA::RewriteCUDAStreamSynchronize },
+            { "cudaStreamWaitEvent", &RewriteCUDA::RewriteCUDAStreamWaitEvent },
+            //Event Management
+            //TODO: cudaEventCreate - Replace with clCreateUserEvent
+            //TODO: cudaEventCreateWithFlags - Replace with clSetUserEventStatus
+            { "cudaEventDestroy", &RewriteCUDA::RewriteCUDAEventDestroy },
+            { "cudaEventElapsedTime", &RewriteCUDA::RewriteCUDAEventElapsedTime },
+            { "cudaEventQuery", &RewriteCUDA::RewriteCUDAEventQuery },
+            { "cudaEventRecord", &RewriteCUDA::RewriteCUDAEventRecord },
+            { "cudaEventSynchronize", &RewriteCUDA::RewriteCUDAEventSynchronize },
+            //Memory Management
+            { "cudaHostAlloc", &RewriteCUDA::RewriteCUDAHostAlloc },
+            { "cudaFree", &RewriteCUDA::RewriteCUDAFree },
+            { "cudaFreeHost", &RewriteCUDA::RewriteCUDAFreeHost },
+            { "cudaMalloc", &RewriteCUDA::RewriteCUDAMalloc },
+            { "cudaMallocHost", &RewriteCUDA::RewriteCUDAMallocHost },
+            { "cudaMemcpy", &RewriteCUDA::RewriteCUDAMemcpy },
+            { "cudaMemcpyAsync", &RewriteCUDA::RewriteCUDAMemcpyAsync },
+            //TODO: cudaMemcpyToSymbol - implement
+            { "cudaMemset", &RewriteCUDA::RewriteCUDAMemset },
+        };
+        IdentifierTable &Idents = PP->getIdentifierTable();
+        for (unsigned i = 0; i < sizeof(CUDACalls) / sizeof(CUDACalls[0]); i++)
+            CUDACallRewriters[&Idents.get(CUDACalls[i].Name)] = CUDACalls[i].Rewriter;
+        for (unsigned i = 0; i < sizeof(KernelCallTranslations) / sizeof(KernelCallTranslations[0]); i++)
+            KernelCallTranslators[&Idents.get(KernelCallTranslations[i].Name)] = &KernelCallTranslations[i];
+    }
+
     //Rewriter for host-side Runtime API calls, prefixed with "cuda"
     //
-    //The major if-else just compares on the name of the function, and when
-    // it finds a match, performs the necessary rewrite.
+    //Dispatches on the callee's IdentifierInfo through CUDACallRewriters, and
+    // the matching handler performs the necessary rewrite.
     //In the majority of cases, this requires calling RewriteHostExpr on one
     // or more of the function's arguments
     //In a few cases, we catch something we can't translate yet, and there
-    // is a final catch-all for anything that's not caught by the if-else tree
+    // is a final catch-all for anything that has no handler
     bool RewriteCUDACall(CallExpr *cudaCall, std::string &newExpr) {
         //TODO all CUDA calls return a cudaError_t, so those semantics need to be preserved where possible
-        std::string funcName = cudaCall->getDirectCallee()->getNameAsString();
-
-        //Thread Management
-        if (funcName == "cudaThreadExit") {
-            //Replace with clReleaseContext
-            newExpr = "clReleaseContext(__cu2cl_Context)";
-        }
-        else if (funcName == "cudaThreadSynchronize") {
-            //Replace with clFinish
-            newExpr = "clFinish(__cu2cl_CommandQueue)";
+        FunctionDecl *callee = cudaCall->getDirectCallee();
+        llvm::DenseMap<IdentifierInfo *, CUDACallRewriter>::iterator rewriter = CUDACallRewriters.find(callee->getIdentifier());
+        if (rewriter == CUDACallRewriters.end()) {
+            emitCU2CLDiagnostic(SM, SM->getExpansionLoc(cudaCall->getLocStart()), "CU2CL Unsupported", "Unsupported CUDA call: " + callee->getNameAsString(), &HostReplace);
+            return false;
+	    //TODO: Even if the call is unsupported, we should attempt to translate params, need to fire up the standard rewrite machinery for that and return whether or not any children were changed
         }
+        return (this->*(rewriter->second))(cudaCall, newExpr);
+    }
 
-        //Device Management
-        else if (funcName == "cudaGetDevice") {
-            //Replace by assigning current value of clDevice to arg
-	    //TODO Alternatively, this could be queried from the queue with clGetCommandQueueInfo
-            Expr *device = cudaCall->getArg(0);
-            std::string newDevice;
-            RewriteHostExpr(device, newDevice);
-            DeclRefExpr *dr = FindStmt<DeclRefExpr>(device);
-            VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
+    bool RewriteCUDAThreadExit(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clReleaseContext
+        newExpr = "clReleaseContext(__cu2cl_Context)";
+        //Pooled buffers belong to the context, so they go first
+        if (Session->MemoryPoolMB != 0) newExpr = "(__cu2cl_TrimPool(), " + newExpr + ")";
+        return true;
+    }
 
-            //Rewrite var type to cl_device_id
-            TypeLoc tl = var->getTypeSourceInfo()->getTypeLoc();
-            RewriteType(tl, "cl_device_id", HostReplace);
-            newExpr = "*" + newDevice + " = __cu2cl_Device";
-        }
-        else if (funcName == "cudaGetDeviceCount") {
-            //Replace with clGetDeviceIDs
-	    //TODO: Update to use the device array from __cu2cl_ScanDevices
-            Expr *count = cudaCall->getArg(0);
-            std::string newCount;
-            RewriteHostExpr(count, newCount);
-            newExpr = "clGetDeviceIDs(__cu2cl_Platform, CL_DEVICE_TYPE_GPU, 0, NULL, (cl_uint *) " + newCount + ")";
-        }
-        else if (funcName == "cudaSetDevice") {
-            if (!UsesCUDASetDevice) {
-                UsesCUDASetDevice = true;
-		GlobalCDecls["cu2cl_util.c"].push_back("cl_device_id * __cu2cl_AllDevices;\n");
-		GlobalCDecls["cu2cl_util.c"].push_back("cl_uint __cu2cl_AllDevices_curr_idx;\n");
-		GlobalCDecls["cu2cl_util.c"].push_back("cl_uint __cu2cl_AllDevices_size;\n");
-		GlobalCFuncs.push_back(CU2CL_SCAN_DEVICES);
-		GlobalHDecls.push_back(CU2CL_SCAN_DEVICES_H);
-		GlobalCFuncs.push_back(CU2CL_SET_DEVICE);
-		GlobalHDecls.push_back(CU2CL_SET_DEVICE_H);
-            }
-            Expr *device = cudaCall->getArg(0);
-            //Device will only be an integer ID, so don't look for a reference
-            //DeclRefExpr *dre = FindStmt<DeclRefExpr>(device);
-            //if (dre != NULL) {
-            std::string newDevice;
-            RewriteHostExpr(device, newDevice);
-            //TODO also rewrite type as in cudaGetDevice
-            //VarDecl *var = dyn_cast<VarDecl>(dre->getDecl());
-            newExpr = "__cu2cl_SetDevice(" + newDevice + ")";
-            emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Warning", "CU2CL Identified cudaSetDevice usage", &HostReplace);
-            //}
-        }
-        else if (funcName == "cudaSetDeviceFlags") {
-            //Remove for now, as OpenCL has no device flags to set
-	    //TODO: emit a note with the device flags
-            newExpr = "";
-        }
-        else if (funcName == "cudaGetDeviceProperties") {
-            //Replace with __cu2cl_GetDeviceProperties
-            Expr *prop = cudaCall->getArg(0);
-            Expr *device = cudaCall->getArg(1);
-            std::string newProp, newDevice;
-            RewriteHostExpr(prop, newProp);
-            RewriteHostExpr(device, newDevice);
-            newExpr = "__cu2cl_GetDeviceProperties(" + newProp + ", " + newDevice + ")";
-        }
+    bool RewriteCUDAThreadSynchronize(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clFinish
+        newExpr = "clFinish(__cu2cl_CommandQueue)";
+        return true;
+    }
 
-        //Stream Management
-        else if (funcName == "cudaStreamCreate") {
-            //Replace with clCreateCommandQueue
-            Expr *pStream = cudaCall->getArg(0);
-            std::string newPStream;
-            RewriteHostExpr(pStream, newPStream);
+    bool RewriteCUDAGetDevice(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace by assigning current value of clDevice to arg
+        //TODO Alternatively, this could be queried from the queue with clGetCommandQueueInfo
+        Expr *device = cudaCall->getArg(0);
+        std::string newDevice;
+        RewriteHostExpr(device, newDevice);
+        DeclRefExpr *dr = FindStmt<DeclRefExpr>(device);
+        VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
+
+        //Rewrite var type to cl_device_id
+        TypeLoc tl = var->getTypeSourceInfo()->getTypeLoc();
+        RewriteType(tl, "cl_device_id", HostReplace);
+        newExpr = "*" + newDevice + " = __cu2cl_Device";
+        return true;
+    }
 
-            newExpr = "*" + newPStream + " = clCreateCommandQueue(__cu2cl_Context, __cu2cl_Device, CL_QUEUE_PROFILING_ENABLE, NULL)";
-        }
-        else if (funcName == "cudaStreamDestroy") {
-            //Replace with clReleaseCommandQueue
-            Expr *stream = cudaCall->getArg(0);
-            std::string newStream;
-            RewriteHostExpr(stream, newStream);
-            newExpr = "clReleaseCommandQueue(" + newStream + ")";
-        }
-        else if (funcName == "cudaStreamQuery") {
-            //Replace with __cu2cl_CommandQueueQuery
-            if (!UsesCUDAStreamQuery) {
-		GlobalCFuncs.push_back(CL_COMMAND_QUEUE_QUERY);
-		GlobalHDecls.push_back(CL_COMMAND_QUEUE_QUERY_H);
-                UsesCUDAStreamQuery = true;
-            }
+    bool RewriteCUDAGetDeviceCount(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clGetDeviceIDs
+        //TODO: Update to use the device array from __cu2cl_ScanDevices
+        Expr *count = cudaCall->getArg(0);
+        std::string newCount;
+        RewriteHostExpr(count, newCount);
+        newExpr = "clGetDeviceIDs(__cu2cl_Platform, CL_DEVICE_TYPE_GPU, 0, NULL, (cl_uint *) " + newCount + ")";
+        return true;
+    }
 
-            Expr *stream = cudaCall->getArg(0);
-            std::string newStream;
-            RewriteHostExpr(stream, newStream);
-            newExpr = "__cu2cl_CommandQueueQuery(" + newStream + ")";
-        }
-        else if (funcName == "cudaStreamSynchronize") {
-            //Replace with clFinish
-            Expr *stream = cudaCall->getArg(0);
-            std::string newStream;
-            RewriteHostExpr(stream, newStream);
-            newExpr = "clFinish(" + newStream + ")";
+    bool RewriteCUDASetDevice(CallExpr *cudaCall, std::string &newExpr) {
+        if (!Contrib->UsesCUDASetDevice) {
+            Contrib->UsesCUDASetDevice = true;
+	    Contrib->GlobalCDecls["cu2cl_util.c"].push_back("cl_device_id * __cu2cl_AllDevices;\n");
+	    Contrib->GlobalCDecls["cu2cl_util.c"].push_back("cl_uint __cu2cl_AllDevices_curr_idx;\n");
+	    Contrib->GlobalCDecls["cu2cl_util.c"].push_back("cl_uint __cu2cl_AllDevices_size;\n");
+	    Contrib->GlobalCFuncs.push_back(CU2CL_SCAN_DEVICES);
+	    Contrib->GlobalHDecls.push_back(CU2CL_SCAN_DEVICES_H);
+	    Contrib->GlobalCFuncs.push_back(CU2CL_SET_DEVICE);
+	    Contrib->GlobalHDecls.push_back(CU2CL_SET_DEVICE_H);
         }
-        else if (funcName == "cudaStreamWaitEvent") {
-            //Replace with clEnqueueWaitForEvents
-            Expr *stream = cudaCall->getArg(0);
-            Expr *event = cudaCall->getArg(1);
-            std::string newStream, newEvent;
-            RewriteHostExpr(stream, newStream);
-            RewriteHostExpr(event, newEvent);
-            newExpr = "clEnqueueWaitForEvents(" + newStream + ", 1, &" + newEvent + ")";
-        }
-
-        //Event Management
-        //else if (funcName == "cudaEventCreate") {
-	//TODO: Replace with clCreateUserEvent
-            //Remove the call
-        //    newExpr = "";
+        Expr *device = cudaCall->getArg(0);
+        //Device will only be an integer ID, so don't look for a reference
+        //DeclRefExpr *dre = FindStmt<DeclRefExpr>(device);
+        //if (dre != NULL) {
+        std::string newDevice;
+        RewriteHostExpr(device, newDevice);
+        //TODO also rewrite type as in cudaGetDevice
+        //VarDecl *var = dyn_cast<VarDecl>(dre->getDecl());
+        newExpr = "__cu2cl_SetDevice(" + newDevice + ")";
+        emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Warning", "CU2CL Identified cudaSetDevice usage", &HostReplace);
         //}
-        //else if (funcName == "cudaEventCreateWithFlags") {
-	//TODO: Replace with clSetUserEventStatus
-            //Remove the call
-        //    newExpr = "";
-        //}
-        else if (funcName == "cudaEventDestroy") {
-            //Replace with clReleaseEvent
-            Expr *event = cudaCall->getArg(0);
-            std::string newEvent;
-            RewriteHostExpr(event, newEvent);
-            newExpr = "clReleaseEvent(" + newEvent + ")";
-        }
-        else if (funcName == "cudaEventElapsedTime") {
-            //Replace with __cu2cl_EventElapsedTime
-            if (!UsesCUDAEventElapsedTime) {
-		GlobalCFuncs.push_back(CL_EVENT_ELAPSED_TIME);
-		GlobalHDecls.push_back(CL_EVENT_ELAPSED_TIME_H);
-                UsesCUDAEventElapsedTime = true;
-            }
+        return true;
+    }
 
-            Expr *ms = cudaCall->getArg(0);
-            Expr *start = cudaCall->getArg(1);
-            Expr *end = cudaCall->getArg(2);
-            std::string newMS, newStart, newEnd;
-            RewriteHostExpr(ms, newMS);
-            RewriteHostExpr(start, newStart);
-            RewriteHostExpr(end, newEnd);
-            newExpr = "__cu2cl_EventElapsedTime(" + newMS + ", " + newStart + ", " + newEnd + ")";
-        }
-        else if (funcName == "cudaEventQuery") {
-            //Replace with __cu2cl_EventQuery
-            if (!UsesCUDAEventQuery) {
-		GlobalCFuncs.push_back(CL_EVENT_QUERY);
-		GlobalHDecls.push_back(CL_EVENT_QUERY_H);
-                UsesCUDAEventQuery = true;
-            }
+    bool RewriteCUDASetDeviceFlags(CallExpr *cudaCall, std::string &newExpr) {
+        //Remove for now, as OpenCL has no device flags to set
+        //TODO: emit a note with the device flags
+        newExpr = "";
+        return true;
+    }
+
+    bool RewriteCUDAGetDeviceProperties(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with __cu2cl_GetDeviceProperties
+        Expr *prop = cudaCall->getArg(0);
+        Expr *device = cudaCall->getArg(1);
+        std::string newProp, newDevice;
+        RewriteHostExpr(prop, newProp);
+        RewriteHostExpr(device, newDevice);
+        newExpr = "__cu2cl_GetDeviceProperties(" + newProp + ", " + newDevice + ")";
+        return true;
+    }
+
+    bool RewriteCUDAStreamCreate(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clCreateCommandQueue
+        Expr *pStream = cudaCall->getArg(0);
+        std::string newPStream;
+        RewriteHostExpr(pStream, newPStream);
+
+        newExpr = "clCreateCommandQueue(__cu2cl_Context, __cu2cl_Device, CL_QUEUE_PROFILING_ENABLE, NULL)";
+        //The pool waits for every stream's queue before reusing a buffer
+        if (Session->MemoryPoolMB != 0) newExpr = "__cu2cl_PoolTrackQueue(" + newExpr + ")";
+        newExpr = "*" + newPStream + " = " + newExpr;
+        return true;
+    }
+
+    bool RewriteCUDAStreamDestroy(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clReleaseCommandQueue
+        Expr *stream = cudaCall->getArg(0);
+        std::string newStream;
+        RewriteHostExpr(stream, newStream);
+        if (Session->MemoryPoolMB != 0) newExpr = "__cu2cl_PoolReleaseQueue(" + newStream + ")";
+        else newExpr = "clReleaseCommandQueue(" + newStream + ")";
+        return true;
+    }
 
-            Expr *event = cudaCall->getArg(0);
-            std::string newEvent;
-            RewriteHostExpr(event, newEvent);
-            newExpr = "__cu2cl_EventQuery(" + newEvent + ")";
+    bool RewriteCUDAStreamQuery(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with __cu2cl_CommandQueueQuery
+        if (!Contrib->UsesCUDAStreamQuery) {
+	    Contrib->GlobalCFuncs.push_back(CL_COMMAND_QUEUE_QUERY);
+	    Contrib->GlobalHDecls.push_back(CL_COMMAND_QUEUE_QUERY_H);
+            Contrib->UsesCUDAStreamQuery = true;
         }
-        else if (funcName == "cudaEventRecord") {
-            //Replace with clEnqueueMarker
-            Expr *event = cudaCall->getArg(0);
-            Expr *stream = cudaCall->getArg(1);
-            std::string newStream, newEvent;
-            RewriteHostExpr(stream, newStream);
-            RewriteHostExpr(event, newEvent);
-
-            //If stream == 0, then cl_command_queue == __cu2cl_CommandQueue
-            if (newStream == "0")
-                newStream = "__cu2cl_CommandQueue";
-            newExpr = "clEnqueueMarker(" + newStream + ", &" + newEvent + ")";
+
+        Expr *stream = cudaCall->getArg(0);
+        std::string newStream;
+        RewriteHostExpr(stream, newStream);
+        newExpr = "__cu2cl_CommandQueueQuery(" + newStream + ")";
+        return true;
+    }
+
+    bool RewriteCUDAStreamSynchronize(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clFinish
+        Expr *stream = cudaCall->getArg(0);
+        std::string newStream;
+        RewriteHostExpr(stream, newStream);
+        newExpr = "clFinish(" + newStream + ")";
+        return true;
+    }
+
+    bool RewriteCUDAStreamWaitEvent(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clEnqueueWaitForEvents
+        Expr *stream = cudaCall->getArg(0);
+        Expr *event = cudaCall->getArg(1);
+        std::string newStream, newEvent;
+        RewriteHostExpr(stream, newStream);
+        RewriteHostExpr(event, newEvent);
+        newExpr = "clEnqueueWaitForEvents(" + newStream + ", 1, &" + newEvent + ")";
+        return true;
+    }
+
+    bool RewriteCUDAEventDestroy(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clReleaseEvent
+        Expr *event = cudaCall->getArg(0);
+        std::string newEvent;
+        RewriteHostExpr(event, newEvent);
+        newExpr = "clReleaseEvent(" + newEvent + ")";
+        return true;
+    }
+
+    bool RewriteCUDAEventElapsedTime(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with __cu2cl_EventElapsedTime
+        if (!Contrib->UsesCUDAEventElapsedTime) {
+	    Contrib->GlobalCFuncs.push_back(CL_EVENT_ELAPSED_TIME);
+	    Contrib->GlobalHDecls.push_back(CL_EVENT_ELAPSED_TIME_H);
+            Contrib->UsesCUDAEventElapsedTime = true;
         }
-        else if (funcName == "cudaEventSynchronize") {
-            //Replace with clWaitForEvents
-            Expr *event = cudaCall->getArg(0);
-            std::string newEvent;
-            RewriteHostExpr(event, newEvent);
-            newExpr = "clWaitForEvents(1, &" + newEvent + ")";
+
+        Expr *ms = cudaCall->getArg(0);
+        Expr *start = cudaCall->getArg(1);
+        Expr *end = cudaCall->getArg(2);
+        std::string newMS, newStart, newEnd;
+        RewriteHostExpr(ms, newMS);
+        RewriteHostExpr(start, newStart);
+        RewriteHostExpr(end, newEnd);
+        newExpr = "__cu2cl_EventElapsedTime(" + newMS + ", " + newStart + ", " + newEnd + ")";
+        return true;
+    }
+
+    bool RewriteCUDAEventQuery(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with __cu2cl_EventQuery
+        if (!Contrib->UsesCUDAEventQuery) {
+	    Contrib->GlobalCFuncs.push_back(CL_EVENT_QUERY);
+	    Contrib->GlobalHDecls.push_back(CL_EVENT_QUERY_H);
+            Contrib->UsesCUDAEventQuery = true;
         }
 
-        //Memory Management
-        else if (funcName == "cudaHostAlloc") {
-            //Replace with __cu2cl_MallocHost
-            if (!UsesCUDAMallocHost) {
-		GlobalCFuncs.push_back(CL_MALLOC_HOST);
-		GlobalHDecls.push_back(CL_MALLOC_HOST_H);
-                UsesCUDAMallocHost = true;
-            }
+        Expr *event = cudaCall->getArg(0);
+        std::string newEvent;
+        RewriteHostExpr(event, newEvent);
+        newExpr = "__cu2cl_EventQuery(" + newEvent + ")";
+        return true;
+    }
 
-            Expr *ptr = cudaCall->getArg(0);
-            Expr *size = cudaCall->getArg(1);
-            std::string newPtr, newSize;
-            RewriteHostExpr(ptr, newPtr);
-            RewriteHostExpr(size, newSize);
+    bool RewriteCUDAEventRecord(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clEnqueueMarker
+        Expr *event = cudaCall->getArg(0);
+        Expr *stream = cudaCall->getArg(1);
+        std::string newStream, newEvent;
+        RewriteHostExpr(stream, newStream);
+        RewriteHostExpr(event, newEvent);
+
+        //If stream == 0, then cl_command_queue == __cu2cl_CommandQueue
+        if (newStream == "0")
+            newStream = "__cu2cl_CommandQueue";
+        newExpr = "clEnqueueMarker(" + newStream + ", &" + newEvent + ")";
+        return true;
+    }
 
-            DeclRefExpr *dr = FindStmt<DeclRefExpr>(ptr);
-	    MemberExpr *mr = FindStmt<MemberExpr>(ptr);
-DeclaratorDecl *var = NULL;
-	    //If the device pointer is a struct or class member, it shows up as a MemberExpr rather than a DeclRefExpr
-	    if (mr != NULL) {
-		emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Identified member expression in cudaHostAlloc device pointer", &HostReplace);
-		var = dyn_cast<DeclaratorDecl>(mr->getMemberDecl());
-	    }
-	    //If it's just a global or locally-scoped singleton, then it shows up as a DeclRefExpr
-	    else {
-		var = dyn_cast<VarDecl>(dr->getDecl());
-	    }
-            llvm::StringRef varName = var->getName();
+    bool RewriteCUDAEventSynchronize(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with clWaitForEvents
+        Expr *event = cudaCall->getArg(0);
+        std::string newEvent;
+        RewriteHostExpr(event, newEvent);
+        newExpr = "clWaitForEvents(1, &" + newEvent + ")";
+        return true;
+    }
+
+    bool RewriteCUDAHostAlloc(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with __cu2cl_MallocHost
+        if (!Contrib->UsesCUDAMallocHost) {
+	    Contrib->GlobalCFuncs.push_back(CL_MALLOC_HOST);
+	    Contrib->GlobalHDecls.push_back(CL_MALLOC_HOST_H);
+            Contrib->UsesCUDAMallocHost = true;
+        }
 
-            newExpr = "__cu2cl_MallocHost(" + newPtr + ", " + newSize + ", &__cu2cl_Mem_" + varName.str() + ")";
+        Expr *ptr = cudaCall->getArg(0);
+        Expr *size = cudaCall->getArg(1);
+        std::string newPtr, newSize;
+        RewriteHostExpr(ptr, newPtr);
+        RewriteHostExpr(size, newSize);
 
-            if (HostMemVars.find(var) == HostMemVars.end()) {
-                //Create new cl_mem for ptr
-                HostGlobalVars += "cl_mem __cu2cl_Mem_" + varName.str() + ";\n";
-                //Add var to HostMemVars
-                HostMemVars.insert(var);
-            }
+        DeclRefExpr *dr = FindStmt<DeclRefExpr>(ptr);
+        MemberExpr *mr = FindStmt<MemberExpr>(ptr);
+DeclaratorDecl *var = NULL;
+        //If the device pointer is a struct or class member, it shows up as a MemberExpr rather than a DeclRefExpr
+        if (mr != NULL) {
+	    emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Identified member expression in cudaHostAlloc device pointer", &HostReplace);
+	    var = dyn_cast<DeclaratorDecl>(mr->getMemberDecl());
+        }
+        //If it's just a global or locally-scoped singleton, then it shows up as a DeclRefExpr
+        else {
+	    var = dyn_cast<VarDecl>(dr->getDecl());
         }
-        else if (funcName == "cudaFree") {
-            Expr *devPtr = cudaCall->getArg(0);
-            std::string newDevPtr;
-            RewriteHostExpr(devPtr, newDevPtr);
+        llvm::StringRef varName = var->getName();
 
-            //Replace with clReleaseMemObject
-            newExpr = "clReleaseMemObject(" + newDevPtr + ")";
+        newExpr = "__cu2cl_MallocHost(" + newPtr + ", " + newSize + ", &__cu2cl_Mem_" + varName.str() + ")";
+
+        if (HostMemVars.find(var) == HostMemVars.end()) {
+            //Create new cl_mem for ptr
+            HostGlobalVars += "cl_mem __cu2cl_Mem_" + varName.str() + ";\n";
+            //Add var to HostMemVars
+            HostMemVars.insert(var);
         }
-        else if (funcName == "cudaFreeHost") {
-            //Replace with __cu2cl_FreeHost
-            if (!UsesCUDAFreeHost) {
-		GlobalCFuncs.push_back(CL_FREE_HOST);
-		GlobalHDecls.push_back(CL_FREE_HOST_H);
-                UsesCUDAFreeHost = true;
-            }
+        return true;
+    }
 
-            Expr *ptr = cudaCall->getArg(0);
-            std::string newPtr;
-            RewriteHostExpr(ptr, newPtr);
+    bool RewriteCUDAFree(CallExpr *cudaCall, std::string &newExpr) {
+        Expr *devPtr = cudaCall->getArg(0);
+        std::string newDevPtr;
+        RewriteHostExpr(devPtr, newDevPtr);
 
-            DeclRefExpr *dr = FindStmt<DeclRefExpr>(ptr);
-            VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
-            llvm::StringRef varName = var->getName();
+        //Replace with clReleaseMemObject, or hand the buffer back to the pool
+        if (Session->MemoryPoolMB != 0) newExpr = "__cu2cl_Free(" + newDevPtr + ")";
+        else newExpr = "clReleaseMemObject(" + newDevPtr + ")";
+        return true;
+    }
 
-            newExpr = "__cu2cl_FreeHost(" + newPtr + ", __cu2cl_Mem_" + varName.str() + ")";
+    bool RewriteCUDAFreeHost(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with __cu2cl_FreeHost
+        if (!Contrib->UsesCUDAFreeHost) {
+	    Contrib->GlobalCFuncs.push_back(CL_FREE_HOST);
+	    Contrib->GlobalHDecls.push_back(CL_FREE_HOST_H);
+            Contrib->UsesCUDAFreeHost = true;
         }
-        else if (funcName == "cudaMalloc") {
-            Expr *devPtr = cudaCall->getArg(0);
-            Expr *size = cudaCall->getArg(1);
-            std::string newDevPtr, newSize;
-            RewriteHostExpr(size, newSize);
-            RewriteHostExpr(devPtr, newDevPtr);
-            DeclRefExpr *dr = FindStmt<DeclRefExpr>(devPtr);
-	    MemberExpr *mr = FindStmt<MemberExpr>(devPtr);
+
+        Expr *ptr = cudaCall->getArg(0);
+        std::string newPtr;
+        RewriteHostExpr(ptr, newPtr);
+
+        DeclRefExpr *dr = FindStmt<DeclRefExpr>(ptr);
+        VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
+        llvm::StringRef varName = var->getName();
+
+        newExpr = "__cu2cl_FreeHost(" + newPtr + ", __cu2cl_Mem_" + varName.str() + ")";
+        return true;
+    }
+
+    bool RewriteCUDAMalloc(CallExpr *cudaCall, std::string &newExpr) {
+        Expr *devPtr = cudaCall->getArg(0);
+        Expr *size = cudaCall->getArg(1);
+        std::string newDevPtr, newSize;
+        RewriteHostExpr(size, newSize);
+        RewriteHostExpr(devPtr, newDevPtr);
+        DeclRefExpr *dr = FindStmt<DeclRefExpr>(devPtr);
+        MemberExpr *mr = FindStmt<MemberExpr>(devPtr);
 DeclaratorDecl *var;
-	    //If the device pointer is a struct or class member, it shows up as a MemberExpr rather than a DeclRefExpr
-	    if (mr != NULL) {
-		emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Identified member expression in cudaMalloc device pointer", &HostReplace);
-		var = dyn_cast<DeclaratorDecl>(mr->getMemberDecl());
-	    }
-	    //If it's just a global or locally-scoped singleton, then it shows up as a DeclRefExpr
-	    else {
-		var = dyn_cast<VarDecl>(dr->getDecl());
-	    }
+        //If the device pointer is a struct or class member, it shows up as a MemberExpr rather than a DeclRefExpr
+        if (mr != NULL) {
+	    emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Identified member expression in cudaMalloc device pointer", &HostReplace);
+	    var = dyn_cast<DeclaratorDecl>(mr->getMemberDecl());
+        }
+        //If it's just a global or locally-scoped singleton, then it shows up as a DeclRefExpr
+        else {
+	    var = dyn_cast<VarDecl>(dr->getDecl());
+        }
 
-            //Replace with clCreateBuffer
-            newExpr = "*" + newDevPtr + " = clCreateBuffer(__cu2cl_Context, CL_MEM_READ_WRITE, " + newSize + ", NULL, NULL)";
+        //Replace with clCreateBuffer, or take a buffer from the pool
+        if (Session->MemoryPoolMB != 0) newExpr = "__cu2cl_Malloc(" + newDevPtr + ", " + newSize + ")";
+        else newExpr = "*" + newDevPtr + " = clCreateBuffer(__cu2cl_Context, CL_MEM_READ_WRITE, " + newSize + ", NULL, NULL)";
 
-            DeclGroupRef varDG(var);
-            if (CurVarDeclGroups.find(varDG) != CurVarDeclGroups.end()) {
-                DeviceMemDGs.insert(*CurVarDeclGroups.find(varDG));
-            }
-            else if (GlobalVarDeclGroups.find(varDG) != GlobalVarDeclGroups.end()) {
-                DeviceMemDGs.insert(*GlobalVarDeclGroups.find(varDG));
-            }
-            else {
+        DeclGroupRef varDG(var);
+        if (CurVarDeclGroups.find(varDG) != CurVarDeclGroups.end()) {
+            DeviceMemDGs.insert(*CurVarDeclGroups.find(varDG));
+        }
+        else if (GlobalVarDeclGroups.find(varDG) != GlobalVarDeclGroups.end()) {
+            DeviceMemDGs.insert(*GlobalVarDeclGroups.find(varDG));
+        }
+        else {
 emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single decl", &HostReplace);
-                //Change variable's type to cl_mem
-                TypeLoc tl = var->getTypeSourceInfo()->getTypeLoc();
-		DeclsToTranslate.push_back(std::pair<NamedDecl*, SourceTuple*>((dyn_cast<NamedDecl>(var)), ST));
-            }
+            //Change variable's type to cl_mem
+            TypeLoc tl = var->getTypeSourceInfo()->getTypeLoc();
+	    Contrib->DeclsToTranslate.push_back(RecordPropagationDecl(var));
+        }
+
+        //Add var to DeviceMemVars
+        DeviceMemVars.insert(var);
+        return true;
+    }
 
-            //Add var to DeviceMemVars
-            DeviceMemVars.insert(var);
+    bool RewriteCUDAMallocHost(CallExpr *cudaCall, std::string &newExpr) {
+        //Replace with __cu2cl_MallocHost
+        if (!Contrib->UsesCUDAMallocHost) {
+	    Contrib->GlobalCFuncs.push_back(CL_MALLOC_HOST);
+	    Contrib->GlobalHDecls.push_back(CL_MALLOC_HOST_H);
+            Contrib->UsesCUDAMallocHost = true;
         }
-        else if (funcName == "cudaMallocHost") {
-            //Replace with __cu2cl_MallocHost
-            if (!UsesCUDAMallocHost) {
-		GlobalCFuncs.push_back(CL_MALLOC_HOST);
-		GlobalHDecls.push_back(CL_MALLOC_HOST_H);
-                UsesCUDAMallocHost = true;
-            }
 
-            Expr *ptr = cudaCall->getArg(0);
-            Expr *size = cudaCall->getArg(1);
-            std::string newPtr, newSize;
-            RewriteHostExpr(ptr, newPtr);
-            RewriteHostExpr(size, newSize);
+        Expr *ptr = cudaCall->getArg(0);
+        Expr *size = cudaCall->getArg(1);
+        std::string newPtr, newSize;
+        RewriteHostExpr(ptr, newPtr);
+        RewriteHostExpr(size, newSize);
 
-            DeclRefExpr *dr = FindStmt<DeclRefExpr>(ptr);
-            VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
-            llvm::StringRef varName = var->getName();
+        DeclRefExpr *dr = FindStmt<DeclRefExpr>(ptr);
+        VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
+        llvm::StringRef varName = var->getName();
 
-            newExpr = "__cu2cl_MallocHost(" + newPtr + ", " + newSize + ", &__cu2cl_Mem_" + varName.str() + ")";
+        newExpr = "__cu2cl_MallocHost(" + newPtr + ", " + newSize + ", &__cu2cl_Mem_" + varName.str() + ")";
 
-            if (HostMemVars.find(var) == HostMemVars.end()) {
-                //Create new cl_mem for ptr
-                HostGlobalVars += "cl_mem __cu2cl_Mem_" + varName.str() + ";\n";
-                //Add var to HostMemVars
-                HostMemVars.insert(var);
-            }
+        if (HostMemVars.find(var) == HostMemVars.end()) {
+            //Create new cl_mem for ptr
+            HostGlobalVars += "cl_mem __cu2cl_Mem_" + varName.str() + ";\n";
+            //Add var to HostMemVars
+            HostMemVars.insert(var);
         }
-        //TODO: support cudaMemcpyDefault
-        //TODO support offsets (will need to grab pointer out of cudaMemcpy
-        // call, then separate off the rest of the math as the offset)
-        else if (funcName == "cudaMemcpy") {
-            //Inspect kind of memcpy and rewrite accordingly
-            Expr *dst = cudaCall->getArg(0);
-            Expr *src = cudaCall->getArg(1);
-            Expr *count = cudaCall->getArg(2);
-            Expr *kind = cudaCall->getArg(3);
-            std::string newDst, newSrc, newCount;
-            RewriteHostExpr(dst, newDst);
-            RewriteHostExpr(src, newSrc);
-            RewriteHostExpr(count, newCount);
-
-            DeclRefExpr *dr = FindStmt<DeclRefExpr>(kind);
-            EnumConstantDecl *enumConst = dyn_cast<EnumConstantDecl>(dr->getDecl());
-            std::string enumString = enumConst->getNameAsString();
-
-            if (enumString == "cudaMemcpyHostToHost") {
-                //standard memcpy
-                //Make sure to include <string.h>
-                if (!IncludingStringH) {
-                    HostIncludes += "#include <string.h>\n";
-                    IncludingStringH = true;
-                }
+        return true;
+    }
 
-                newExpr = "memcpy(" + newDst + ", " + newSrc + ", " + newCount + ")";
-            }
-            else if (enumString == "cudaMemcpyHostToDevice") {
-                //clEnqueueWriteBuffer
-                newExpr = "clEnqueueWriteBuffer(__cu2cl_CommandQueue, " + newDst + ", CL_TRUE, 0, " + newCount + ", " + newSrc + ", 0, NULL, NULL)";
-            }
-            else if (enumString == "cudaMemcpyDeviceToHost") {
-                //clEnqueueReadBuffer
-                newExpr = "clEnqueueReadBuffer(__cu2cl_CommandQueue, " + newSrc + ", CL_TRUE, 0, " + newCount + ", " + newDst + ", 0, NULL, NULL)";
-            }
-            else if (enumString == "cudaMemcpyDeviceToDevice") {
-		//clEnqueueCopyBuffer
-		newExpr = "clEnqueueCopyBuffer(__cu2cl_CommandQueue, " + newSrc + ", " + newDst + ", 0, 0, " + newCount + ", 0, NULL, NULL)";
-            }
-            else {
-                emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Unsupported", "Unsupported cudaMemcpyKind: " + enumString, &HostReplace);
-            }
+    //TODO: support cudaMemcpyDefault
+    //TODO support offsets (will need to grab pointer out of cudaMemcpy
+    // call, then separate off the rest of the math as the offset)
+    bool RewriteCUDAMemcpy(CallExpr *cudaCall, std::string &newExpr) {
+        //Inspect kind of memcpy and rewrite accordingly
+        Expr *dst = cudaCall->getArg(0);
+        Expr *src = cudaCall->getArg(1);
+        Expr *count = cudaCall->getArg(2);
+        Expr *kind = cudaCall->getArg(3);
+        std::string newDst, newSrc, newCount;
+        RewriteHostExpr(dst, newDst);
+        RewriteHostExpr(src, newSrc);
+        RewriteHostExpr(count, newCount);
+
+        DeclRefExpr *dr = FindStmt<DeclRefExpr>(kind);
+        EnumConstantDecl *enumConst = dyn_cast<EnumConstantDecl>(dr->getDecl());
+        std::string enumString = enumConst->getNameAsString();
+
+        if (enumString == "cudaMemcpyHostToHost") {
+            //standard memcpy
+            //Make sure to include <string.h>
+            if (!IncludingStringH) {
+                HostIncludes += "#include <string.h>\n";
+                IncludingStringH = true;
+            }
+
+            newExpr = "memcpy(" + newDst + ", " + newSrc + ", " + newCount + ")";
         }
-        //TODO: support cudaMemcpyDefault
-        //TODO support offsets (will need to grab pointer out of cudaMemcpy
-        // call, then separate off the rest of the math as the offset)
-        else if (funcName == "cudaMemcpyAsync") {
-            //Inspect kind of memcpy and rewrite accordingly
-            Expr *dst = cudaCall->getArg(0);
-            Expr *src = cudaCall->getArg(1);
-            Expr *count = cudaCall->getArg(2);
-            Expr *kind = cudaCall->getArg(3);
-            Expr *stream = cudaCall->getArg(4);
-            std::string newDst, newSrc, newCount, newStream;
-            RewriteHostExpr(dst, newDst);
-            RewriteHostExpr(src, newSrc);
-            RewriteHostExpr(count, newCount);
-            RewriteHostExpr(stream, newStream);
-            if (newStream == "0")
-                newStream = "__cu2cl_CommandQueue";
-
-            DeclRefExpr *dr = FindStmt<DeclRefExpr>(kind);
-            EnumConstantDecl *enumConst = dyn_cast<EnumConstantDecl>(dr->getDecl());
-            std::string enumString = enumConst->getNameAsString();
-
-            if (enumString == "cudaMemcpyHostToHost") {
-                //standard memcpy
-                //Make sure to include <string.h>
-                if (!IncludingStringH) {
-                    HostIncludes += "#include <string.h>\n";
-                    IncludingStringH = true;
-                }
+        else if (enumString == "cudaMemcpyHostToDevice") {
+            //clEnqueueWriteBuffer
+            newExpr = "clEnqueueWriteBuffer(__cu2cl_CommandQueue, " + newDst + ", CL_TRUE, 0, " + newCount + ", " + newSrc + ", 0, NULL, NULL)";
+        }
+        else if (enumString == "cudaMemcpyDeviceToHost") {
+            //clEnqueueReadBuffer
+            newExpr = "clEnqueueReadBuffer(__cu2cl_CommandQueue, " + newSrc + ", CL_TRUE, 0, " + newCount + ", " + newDst + ", 0, NULL, NULL)";
+        }
+        else if (enumString == "cudaMemcpyDeviceToDevice") {
+	    //clEnqueueCopyBuffer
+	    newExpr = "clEnqueueCopyBuffer(__cu2cl_CommandQueue, " + newSrc + ", " + newDst + ", 0, 0, " + newCount + ", 0, NULL, NULL)";
+        }
+        else {
+            emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Unsupported", "Unsupported cudaMemcpyKind: " + enumString, &HostReplace);
+        }
+        return true;
+    }
 
-                //dst and src are HostMemVars, so regular memcpy can be used
-                newExpr = "memcpy(" + newDst + ", " + newSrc + ", " + newCount + ")";
-            }
-            else if (enumString == "cudaMemcpyHostToDevice") {
-                //clEnqueueWriteBuffer, src is HostMemVar
-                dr = FindStmt<DeclRefExpr>(src);
-                VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
-                llvm::StringRef varName = var->getName();
-                newExpr = "clEnqueueWriteBuffer(" + newStream + ", " + newDst + ", CL_FALSE, 0, " + newCount + ", " + newSrc + ", 0, NULL, NULL)";
-            }
-            else if (enumString == "cudaMemcpyDeviceToHost") {
-                //clEnqueueReadBuffer, dst is HostMemVar
-                dr = FindStmt<DeclRefExpr>(dst);
-                VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
-                llvm::StringRef varName = var->getName();
-                newExpr = "clEnqueueReadBuffer(" + newStream + ", " + newSrc + ", CL_FALSE, 0, " + newCount + ", " + newDst + ", 0, NULL, NULL)";
-            }
-            else if (enumString == "cudaMemcpyDeviceToDevice") {
-		//clEnqueueCopyBuffer
-		newExpr = "clEnqueueCopyBuffer(__cu2cl_CommandQueue, " + newSrc + ", " + newDst + ", 0, 0, " + newCount + ", 0, NULL, NULL)";
-            }
-            else {
-                emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Unsupported", "Unsupported cudaMemcpyKind: " + enumString, &HostReplace);
-            }
+    //TODO: support cudaMemcpyDefault
+    //TODO support offsets (will need to grab pointer out of cudaMemcpy
+    // call, then separate off the rest of the math as the offset)
+    bool RewriteCUDAMemcpyAsync(CallExpr *cudaCall, std::string &newExpr) {
+        //Inspect kind of memcpy and rewrite accordingly
+        Expr *dst = cudaCall->getArg(0);
+        Expr *src = cudaCall->getArg(1);
+        Expr *count = cudaCall->getArg(2);
+        Expr *kind = cudaCall->getArg(3);
+        Expr *stream = cudaCall->getArg(4);
+        std::string newDst, newSrc, newCount, newStream;
+        RewriteHostExpr(dst, newDst);
+        RewriteHostExpr(src, newSrc);
+        RewriteHostExpr(count, newCount);
+        RewriteHostExpr(stream, newStream);
+        if (newStream == "0")
+            newStream = "__cu2cl_CommandQueue";
+
+        DeclRefExpr *dr = FindStmt<DeclRefExpr>(kind);
+        EnumConstantDecl *enumConst = dyn_cast<EnumConstantDecl>(dr->getDecl());
+        std::string enumString = enumConst->getNameAsString();
+
+        if (enumString == "cudaMemcpyHostToHost") {
+            //standard memcpy
+            //Make sure to include <string.h>
+            if (!IncludingStringH) {
+                HostIncludes += "#include <string.h>\n";
+                IncludingStringH = true;
+            }
+
+            //dst and src are HostMemVars, so regular memcpy can be used
+            newExpr = "memcpy(" + newDst + ", " + newSrc + ", " + newCount + ")";
         }
-        //else if (funcName == "cudaMemcpyToSymbol") {
-            //TODO: implement
-        //}
-	//FIXME: Generate cu2cl_util.cl and the requisite boilerplate
-        else if (funcName == "cudaMemset") {
-            if (!UsesCUDAMemset) {
-		if(!UsesCU2CLUtilCL) UsesCU2CLUtilCL = true;
-		GlobalCFuncs.push_back(CL_MEMSET);
-		GlobalHDecls.push_back(CL_MEMSET_H);
-		GlobalCLFuncs.push_back(CL_MEMSET_KERNEL);
-                UtilKernels.push_back("__cu2cl_Memset");
-		GlobalCDecls["cu2cl_util.c"].push_back("cl_kernel __cu2cl_Kernel___cu2cl_Memset;\n");
-                UsesCUDAMemset = true;
-            }
-            //Follow Swan's example of setting via a kernel
-            Expr *devPtr = cudaCall->getArg(0);
-            Expr *value = cudaCall->getArg(1);
-            Expr *count = cudaCall->getArg(2);
-            std::string newDevPtr, newValue, newCount;
-            RewriteHostExpr(devPtr, newDevPtr);
-            RewriteHostExpr(value, newValue);
-            RewriteHostExpr(count, newCount);
-            newExpr = "__cu2cl_Memset(" + newDevPtr + ", " + newValue + ", " + newCount + ")";
+        else if (enumString == "cudaMemcpyHostToDevice") {
+            //clEnqueueWriteBuffer, src is HostMemVar
+            dr = FindStmt<DeclRefExpr>(src);
+            VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
+            llvm::StringRef varName = var->getName();
+            newExpr = "clEnqueueWriteBuffer(" + newStream + ", " + newDst + ", CL_FALSE, 0, " + newCount + ", " + newSrc + ", 0, NULL, NULL)";
+        }
+        else if (enumString == "cudaMemcpyDeviceToHost") {
+            //clEnqueueReadBuffer, dst is HostMemVar
+            dr = FindStmt<DeclRefExpr>(dst);
+            VarDecl *var = dyn_cast<VarDecl>(dr->getDecl());
+            llvm::StringRef varName = var->getName();
+            newExpr = "clEnqueueReadBuffer(" + newStream + ", " + newSrc + ", CL_FALSE, 0, " + newCount + ", " + newDst + ", 0, NULL, NULL)";
+        }
+        else if (enumString == "cudaMemcpyDeviceToDevice") {
+	    //clEnqueueCopyBuffer
+	    newExpr = "clEnqueueCopyBuffer(__cu2cl_CommandQueue, " + newSrc + ", " + newDst + ", 0, 0, " + newCount + ", 0, NULL, NULL)";
         }
         else {
-            emitCU2CLDiagnostic(SM, SM->getExpansionLoc(cudaCall->getLocStart()), "CU2CL Unsupported", "Unsupported CUDA call: " + funcName, &HostReplace);
-            return false;
-	    //TODO: Even if the call is unsupported, we should attempt to translate params, need to fire up the standard rewrite machinery for that and return whether or not any children were changed
+            emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Unsupported", "Unsupported cudaMemcpyKind: " + enumString, &HostReplace);
+        }
+        return true;
+    }
+
+    //FIXME: Generate cu2cl_util.cl and the requisite boilerplate
+    bool RewriteCUDAMemset(CallExpr *cudaCall, std::string &newExpr) {
+        if (!Contrib->UsesCUDAMemset) {
+	    if(!Contrib->UsesCU2CLUtilCL) Contrib->UsesCU2CLUtilCL = true;
+	    Contrib->GlobalCFuncs.push_back(CL_MEMSET);
+	    Contrib->GlobalHDecls.push_back(CL_MEMSET_H);
+	    Contrib->GlobalCLFuncs.push_back(CL_MEMSET_KERNEL);
+            Contrib->UtilKernels.push_back("__cu2cl_Memset");
+	    Contrib->GlobalCDecls["cu2cl_util.c"].push_back("cl_kernel __cu2cl_Kernel___cu2cl_Memset;\n");
+            Contrib->UsesCUDAMemset = true;
         }
+        //Follow Swan's example of setting via a kernel
+        Expr *devPtr = cudaCall->getArg(0);
+        Expr *value = cudaCall->getArg(1);
+        Expr *count = cudaCall->getArg(2);
+        std::string newDevPtr, newValue, newCount;
+        RewriteHostExpr(devPtr, newDevPtr);
+        RewriteHostExpr(value, newValue);
+        RewriteHostExpr(count, newCount);
+        newExpr = "__cu2cl_Memset(" + newDevPtr + ", " + newValue + ", " + newCount + ")";
         return true;
     }
 
@@ -1580,6 +3934,9 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
         std::ostringstream args;
         unsigned int dims = 1;
 
+	//Lazily created kernels are loaded (building their program if need be) by their first launch
+	if (Session->LazyInit) args << "if (" << kernelName << " == NULL) __cu2cl_Load_" << callee->getNameAsString() << "();\n";
+
         //Set kernel arguments
         for (unsigned i = 0; i < kernelCall->getNumArgs(); i++) {
             Expr *arg = kernelCall->getArg(i);//->IgnoreParenCasts();
@@ -1644,8 +4001,7 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
         if (dre) {
             //Variable passed
             ValueDecl *value = dre->getDecl();
-            std::string type = value->getType().getAsString();
-            if (type == "dim3") {
+            if (TypeKinds->classify(value->getType()) == CUDAType_Dim3) {
                 dims = 3;
                 for (unsigned int i = 0; i < 3; i++)
                     args << "localWorkSize[" << i << "] = " << value->getNameAsString() << "[" << i << "];\n";
@@ -1687,8 +4043,7 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
         if (dre) {
             //Variable passed
             ValueDecl *value = dre->getDecl();
-            std::string type = value->getType().getAsString();
-            if (type == "dim3") {
+            if (TypeKinds->classify(value->getType()) == CUDAType_Dim3) {
                 dims = 3;
                 for (unsigned int i = 0; i < 3; i++)
                     args << "globalWorkSize[" << i << "] = " << value->getNameAsString() << "[" << i << "]*localWorkSize[" << i << "];\n";
@@ -1723,7 +4078,7 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
             TypeLoc origTL = var->getTypeSourceInfo()->getTypeLoc();
             if (LastLoc.isNull() || origTL.getBeginLoc() != LastLoc.getBeginLoc()) {
                 LastLoc = origTL;
-		DeclsToTranslate.push_back(std::pair<NamedDecl*, SourceTuple*>((dyn_cast<NamedDecl>(var)), ST));
+		Contrib->DeclsToTranslate.push_back(RecordPropagationDecl(var));
 //                RewriteType(origTL, "cl_mem", HostReplace);
             }
             return;
@@ -1751,33 +4106,33 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
             tl = tl.getNextTypeLoc();
         }
         QualType qt = tl.getType();
-        std::string type = qt.getAsString();
+        CUDATypeKind kind = TypeKinds->classify(qt);
 
         //Rewrite var type
         if (LastLoc.isNull() || origTL.getBeginLoc() != LastLoc.getBeginLoc()) {
             LastLoc = origTL;
-            if (type == "dim3") {
+            if (kind == CUDAType_Dim3) {
                 //Rewrite to size_t[3] array
                 RewriteType(tl, "size_t", HostReplace);
             }
-            else if (type == "struct cudaDeviceProp") {
-                if (!UsesCUDADeviceProp) {
-		    GlobalHDecls.push_back(CL_DEVICE_PROP);
-		    GlobalCFuncs.push_back(CL_GET_DEVICE_PROPS);
-		    GlobalHDecls.push_back(CL_GET_DEVICE_PROPS_H);
-                    UsesCUDADeviceProp = true;
+            else if (kind == CUDAType_DeviceProp) {
+                if (!Contrib->UsesCUDADeviceProp) {
+		    Contrib->GlobalHDecls.push_back(CL_DEVICE_PROP);
+		    Contrib->GlobalCFuncs.push_back(CL_GET_DEVICE_PROPS);
+		    Contrib->GlobalHDecls.push_back(CL_GET_DEVICE_PROPS_H);
+                    Contrib->UsesCUDADeviceProp = true;
                 }
                 RewriteType(tl, "__cu2cl_DeviceProp", HostReplace);
             }
-            else if (type == "cudaStream_t") {
+            else if (kind == CUDAType_Stream) {
                 RewriteType(tl, "cl_command_queue", HostReplace);
             }
-            else if (type == "cudaEvent_t") {
+            else if (kind == CUDAType_Event) {
                 RewriteType(tl, "cl_event", HostReplace);
             }
-            else {
-                std::string newType = RewriteVectorType(type, true);
-                if (newType != "") {
+            else if (kind == CUDAType_Vector || kind == CUDAType_Uint3) {
+                llvm::StringRef newType = TypeKinds->getVectorType(qt, true);
+                if (!newType.empty()) {
 		    //Stage the replacement in a map to avoid conflicts with later cl_mem conversions of cudaMalloced host variables
 		    Replacement vecType(*SM, tl.getBeginLoc(), getRangeSize(*SM, CharSourceRange::getTokenRange(tl.getLocalSourceRange())), newType);
 		    //Try to insert into the map, but just dump a diagnostic warning if we fail
@@ -1799,7 +4154,7 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
 	    bool deferInsert = false;
             if (RewriteHostExpr(e, s)) {
                 //Special cases for dim3s
-                if (type == "dim3") {
+                if (kind == CUDAType_Dim3) {
                     CXXConstructExpr *cce = dyn_cast<CXXConstructExpr>(e);
                     if (cce && cce->getNumArgs() > 1) {
                         SourceRange parenRange = cce->getParenOrBraceRange();
@@ -1845,6 +4200,7 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
     //TODO: Support translation-time mangling of template specializations
     // into C-compatible forms.
     void RewriteKernelFunction(FunctionDecl *kernelFunc) {
+	PhaseTimer timer(Contrib->Times, Phase_KernelRewrite);
 
 	//Paul: Adjusted this to *not* register forward declarations of kernels
 	// This means that only the CUDA file which includes the *definition* of the kernel will be responsible for clBuildProgram and clCreateKernel
@@ -1855,12 +4211,12 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
             l.push_back(kernelFunc->getName());
 	    //Do a quick and dirty search that is linear w.r.t. the number of globalized (externed) variables in this source file
 	    std::string decl = "cl_kernel __cu2cl_Kernel_" + kernelFunc->getName().str() + ";\n";
-	    std::vector<std::string>::iterator j = GlobalCDecls[r].begin(), f = GlobalCDecls[r].end();
+	    std::vector<std::string>::iterator j = Contrib->GlobalCDecls[r].begin(), f = Contrib->GlobalCDecls[r].end();
 	    //Iterate to the end of the vector or til a matching string is found
 	    for (; j != f && (*j) != decl; j++);
 	
 	    if (j == f) { // Not found, add declaration
-                GlobalCDecls[r].push_back(decl);
+                Contrib->GlobalCDecls[r].push_back(decl);
             }
 	
         }
@@ -1920,12 +4276,9 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
         while (!tl.getNextTypeLoc().isNull()) {
             tl = tl.getNextTypeLoc();
         }
-        QualType qt = tl.getType();
-        std::string type = qt.getAsString();
-
 	//if it's a vector type, it must be checked for a rewrite
-        std::string newType = RewriteVectorType(type, false);
-        if (newType != "") {
+        llvm::StringRef newType = TypeKinds->getVectorType(tl.getType(), false);
+        if (!newType.empty()) {
             RewriteType(tl, newType, KernReplace, rewriteOffset);
 	}
     }
@@ -1963,13 +4316,18 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
     }
 
     bool RewriteKernelExpr(Expr *e, std::string &newExpr) {
+        ExprEdits edits(*SM, *LO);
+        return RewriteKernelExpr(e, newExpr, edits, true);
+    }
+
+    //Works like the host version: whole-expression translations set newExpr and record it as one edit,
+    // the rest record edits to parts of e, and only the outermost call renders newExpr
+    bool RewriteKernelExpr(Expr *e, std::string &newExpr, ExprEdits &edits, bool render) {
         //Return value specifies whether or not a rewrite occurred
 	//if for some reason the expression is in an invalid source range, abort
         if (e->getSourceRange().isInvalid())
             return false;
 
-        //Rewriter used for rewriting subexpressions
-        Rewriter exprRewriter(*SM, *LO);
         SourceRange realRange = SourceRange(SM->getExpansionLoc(e->getLocStart()), SM->getExpansionLoc(e->getLocEnd()));
 
         if (MemberExpr *me = dyn_cast<MemberExpr>(e)) {
@@ -1980,10 +4338,9 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
                 while (!tl.getNextTypeLoc().isNull()) {
                     tl = tl.getNextTypeLoc();
                 }
-                QualType qt = tl.getType();
-                std::string type = qt.getAsString();
+                CUDATypeKind kind = TypeKinds->classify(tl.getType());
 
-                if (type == "dim3") {
+                if (kind == CUDAType_Dim3) {
                     std::string name = dre->getDecl()->getNameAsString();
                     if (name == "blockDim")
                         newExpr = "get_local_size";
@@ -2010,9 +4367,10 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
                             name = "[2]";
                     }
                     newExpr += name;
+                    ReplaceStmtWithText(e, newExpr, edits);
                     return true;
                 }
-                if (type == "uint3") {
+                if (kind == CUDAType_Uint3) {
                     std::string name = dre->getDecl()->getNameAsString();
                     if (name == "threadIdx")
                         newExpr = "get_local_id";
@@ -2030,6 +4388,7 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
                         else if (name == "z")
                             name = "(2)";
                         newExpr += name;
+                        ReplaceStmtWithText(e, newExpr, edits);
                         return true;
                     }
                     return false;
@@ -2044,7 +4403,8 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
             //TODO if references warpSize, print warning
             if (ParmVarDecl *pvd = dyn_cast<ParmVarDecl>(dre->getDecl())) {
                 if (CurRefParmVars.find(pvd) != CurRefParmVars.end()) {
-                    newExpr = "(*" + exprRewriter.getRewrittenText(realRange) + ")";
+                    newExpr = "(*" + getStmtText(LO, SM, dre) + ")";
+                    ReplaceStmtWithText(e, newExpr, edits);
                     return true;
                 }
             }
@@ -2062,1000 +4422,86 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
                 return false;
             }                
 
-	    //This massive if-else tree catches all kernel API calls
-            std::string funcName = ce->getDirectCallee()->getNameAsString();
-            if (funcName == "__syncthreads") {
-                newExpr = "barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE)";
+	    //All kernel API calls are looked up in KernelCallTranslations
+            FunctionDecl *callee = ce->getDirectCallee();
+            llvm::DenseMap<IdentifierInfo *, const KernelCallTranslation *>::iterator trans = KernelCallTranslators.find(callee->getIdentifier());
+            if (trans == KernelCallTranslators.end()) {
+		//TODO: Make sure every possible function call goes through here, or else we may not get rewrites on interior nested calls.
+		// any unsupported call should throw an error, but still convert interior nesting.
+                return false;
             }
+            const KernelCallTranslation *kct = trans->second;
 
-	    //begin single precision math API
-            else if (funcName == "acosf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "acos(" + newX + ")";
-            }
-            else if (funcName == "acoshf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "acosh(" + newX + ")";
-            }
-            else if (funcName == "asinf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "asin(" + newX + ")";
-            }
-            else if (funcName == "asinhf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "asinh(" + newX + ")";
-            }
-            else if (funcName == "atan2f") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "atan2(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "atanf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "atan(" + newX + ")";
-            }
-            else if (funcName == "atanhf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "atanh(" + newX + ")";
-            }
-            else if (funcName == "cbrtf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "cbrt(" + newX + ")";
-            }
-            else if (funcName == "ceilf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "ceil(" + newX + ")";
-            }
-            else if (funcName == "copysign") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "copysign(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "cosf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "cos(" + newX + ")";
-            }
-            else if (funcName == "coshf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "cosh(" + newX + ")";
-            }
-            else if (funcName == "cospif") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "cospi(" + newX + ")";
-            }
-            else if (funcName == "erfcf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "erfc(" + newX + ")";
-            }
-	    //TODO: support erfcinvf, erfcxf
-            else if (funcName == "erff") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "erf(" + newX + ")";
-            }
-	    //TODO: support erfinvf
-            else if (funcName == "exp10f") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "exp10(" + newX + ")";
-            }
-            else if (funcName == "exp2f") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "exp2(" + newX + ")";
-            }
-            else if (funcName == "expf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "exp(" + newX + ")";
-            }
-            else if (funcName == "expm1f") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "expm1(" + newX + ")";
-            }
-            else if (funcName == "fabsf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "fabs(" + newX + ")";
-            }
-            else if (funcName == "fdimf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "fdim(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "fdividef") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "(" + newX + "/" + newY + ")";
-            }
-            else if (funcName == "floorf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "floor(" + newX + ")";
-            }
-            else if (funcName == "fmaf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                Expr *z = ce->getArg(2);
-                std::string newX, newY, newZ;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                RewriteKernelExpr(z, newZ);
-                newExpr = "fma(" + newX + ", " + newY + ", " + newZ + ")";
-            }
-            else if (funcName == "fmaxf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "fmax(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "fminf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "fmin(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "fmodf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "fmod(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "frexpf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "frexp(" + newX + ", " + newY + ")";
-            }
-	        else if (funcName == "hypotf") {
-		        Expr *x = ce->getArg(0);
-		        Expr *y = ce->getArg(1);
-		        std::string newX, newY;
-		        RewriteKernelExpr(x, newX);
-		        RewriteKernelExpr(y, newY);
-		        newExpr = "hypot(" + newX + ", " + newY + ")";
-	        }
-            else if (funcName == "ilogbf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "ilogb(" + newX + ")";
-            }
-            else if (funcName == "isfinite") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "isfinite(" + newX + ")";
-            }
-            else if (funcName == "isinf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "isinf(" + newX + ")";
-            }
-            else if (funcName == "isnan") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "isnan(" + newX + ")";
-            }
-	    //TODO: Support j0f, j1f, jnf - Bessel function of first kind order 0, 1, and n
-            else if (funcName == "ldexpf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "ldexp(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "lgammaf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "lgamma(" + newX + ")";
-            }
-	    //TODO: suppot llrintf, llroundf - rounding with long long return type
-            else if (funcName == "log10f") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "log10(" + newX + ")";
-            }
-            else if (funcName == "log1pf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "log1p(" + newX + ")";
-            }
-            else if (funcName == "log2f") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "log2(" + newX + ")";
-            }
-            else if (funcName == "logbf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "logb(" + newX + ")";
-            }
-            else if (funcName == "logf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "log(" + newX + ")";
-            }
-	    //TODO: support lrintf, lroundf - rounding with long return type
-            else if (funcName == "modff") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "modf(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "nanf") {
-                //WARNING: original cuda type of x is const char *, opencl is uintn
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "nan(" + newX + ")";
-            }
-	    //TODO: Support nearbyintf
-            else if (funcName == "nextafterf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "nextafter(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "powf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "pow(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "rcbrtf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "(1/cbrt(" + newX + "))";
-            }
-            else if (funcName == "remainderf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "remainder(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "remquof") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                Expr *z = ce->getArg(1);
-                std::string newX, newY, newZ;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                RewriteKernelExpr(z, newZ);
-                newExpr = "remquo(" + newX + ", " + newY + ", " + newZ + ")";
-            }
-            else if (funcName == "rintf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "rint(" + newX + ")";
-            }
-            else if (funcName == "roundf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "round(" + newX + ")";
-            }
-            else if (funcName == "rsqrtf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "rsqrt(" + newX + ")";
-            }
-	    //WARNING: Both scalbnf and scalblnf are not guaranteed to use the efficient "native" method of exponent manipulation, but are mathematically correct
-            else if (funcName == "scalbnf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "ldexp(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "scalblnf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "ldexp(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "signbit") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "signbit(" + newX + ")";
-            }
-            else if (funcName == "sincosf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                Expr *z = ce->getArg(2);
-                std::string newX, newY, newZ;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                RewriteKernelExpr(z, newZ);
-                newExpr = "(*" + newY + " = sincos(" + newX + ", " + newZ + "))";
-            }
-            else if (funcName == "sinf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sin(" + newX + ")";
-            }
-            else if (funcName == "sinhf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sinh(" + newX + ")";
-            }
-            else if (funcName == "sinpif") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sinpi(" + newX + ")";
-            }
-            else if (funcName == "sqrtf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sqrt(" + newX + ")";
-            }
-            else if (funcName == "tanf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "tan(" + newX + ")";
-            }
-            else if (funcName == "tanhf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "tanh(" + newX + ")";
-            }
-            else if (funcName == "tgammaf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "tgamma(" + newX + ")";
-            }
-            else if (funcName == "truncf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "trunc(" + newX + ")";
-            }
-	    //TODO: Support y0f, y1f, ynf - Bessel function of first kind order 0, 1, and n
-
-	    //Begin double precision
-	    //These are only "translated" to ensure nested expressions get translated
-            else if (funcName == "acos") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "acos(" + newX + ")";
-            }
-            else if (funcName == "acosh") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "acosh(" + newX + ")";
-            }
-            else if (funcName == "asin") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "asin(" + newX + ")";
-            }
-            else if (funcName == "asinh") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "asinh(" + newX + ")";
-            }
-            else if (funcName == "atan") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "atan(" + newX + ")";
-            }
-            else if (funcName == "atan2") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "atan(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "atanh") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "atanh(" + newX + ")";
-            }
-            else if (funcName == "cbrt") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "cbrt(" + newX + ")";
-            }
-            else if (funcName == "ceil") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "ceil(" + newX + ")";
-            }
-	    //NOTE: Copysign is already handled in floating point section
-            else if (funcName == "cos") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "cos(" + newX + ")";
-            }
-            else if (funcName == "cosh") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "cosh(" + newX + ")";
-            }
-            else if (funcName == "cospi") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "cospi(" + newX + ")";
-            }
-            else if (funcName == "erf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "erf(" + newX + ")";
-            }
-            else if (funcName == "erfc") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "erfc(" + newX + ")";
-            }
-	    //TODO: support erfinv, erfcinv, erfcx
-            else if (funcName == "exp") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "exp(" + newX + ")";
-            }
-            else if (funcName == "exp10") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "exp10(" + newX + ")";
-            }
-            else if (funcName == "exp2") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "exp2(" + newX + ")";
-            }
-            else if (funcName == "expm1") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "expm1(" + newX + ")";
-            }
-            else if (funcName == "fabs") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "fabs(" + newX + ")";
-            }
-            else if (funcName == "fdim") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "fdim(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "floor") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "floor(" + newX + ")";
-            }
-            else if (funcName == "fma") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                Expr *z = ce->getArg(2);
-                std::string newX, newY, newZ;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                RewriteKernelExpr(z, newZ);
-                newExpr = "fma(" + newX + ", " + newY + ", " + newZ + ")";
-            }
-            else if (funcName == "fmax") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "fmax(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "fmin") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "fmin(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "fmod") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "fmod(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "frexp") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "frexp(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "hypot") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "hypot(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "ilogb") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "ilogb(" + newX + ")";
-            }
-	    //NOTE: isfinite, isinf, and isnan are all handled in floating point section
-	    //TODO: support j0, j1, jn - Bessel functions of the first kind of order 0, 1, and n
-            else if (funcName == "ldexp") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "ldexp(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "lgamma") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "lgamma(" + newX + ")";
-            }
-	    //TODO: support llrint, llround
-            else if (funcName == "log") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "log(" + newX + ")";
-            }
-            else if (funcName == "log10") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "log10(" + newX + ")";
-            }
-            else if (funcName == "log1p") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "log1p(" + newX + ")";
-            }
-            else if (funcName == "log2") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "log2(" + newX + ")";
-            }
-            else if (funcName == "logb") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "logb(" + newX + ")";
-            }
-	    //TODO: support lrint, lround
-            else if (funcName == "modf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "modf(" + newX + ", " + newY + ")";
-            }
-	    //NOTE: nan is handled in floating point section
-	    //TODO: Support nearbyint
-            else if (funcName == "nextafter") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "nextafter(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "pow") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "pow(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "rcbrt") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "(1/cbrt(" + newX + "))";
-            }
-            else if (funcName == "remainder") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "remainder(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "remquo") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                Expr *z = ce->getArg(1);
-                std::string newX, newY, newZ;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                RewriteKernelExpr(z, newZ);
-                newExpr = "remquo(" + newX + ", " + newY + ", " + newZ + ")";
-            }
-            else if (funcName == "rint") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "rint(" + newX + ")";
-            }
-            else if (funcName == "round") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "round(" + newX + ")";
-            }
-            else if (funcName == "rsqrt") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sqrt(" + newX + ")";
-            }
-	    //WARNING: Both scalbnf and scalblnf are not guaranteed to use the efficient "native" method of exponent manipulation, but are mathematically correct
-            else if (funcName == "scalbn") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "ldexp(" + newX + ", " + newY + ")";
-            }
-            else if (funcName == "scalbln") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "ldexp(" + newX + ", " + newY + ")";
-            }
-	    //NOTE: signbit is already handled in the float section
-            else if (funcName == "sin") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sin(" + newX + ")";
-            }
-            else if (funcName == "sincos") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                Expr *z = ce->getArg(2);
-                std::string newX, newY, newZ;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                RewriteKernelExpr(z, newZ);
-                newExpr = "(*" + newY + " = sincos(" + newX + ", " + newZ + "))";
-            }
-            else if (funcName == "sinh") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sinh(" + newX + ")";
-            }
-            else if (funcName == "sinpi") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sinpi(" + newX + ")";
-            }
-            else if (funcName == "sqrt") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "sqrt(" + newX + ")";
-            }
-            else if (funcName == "tan") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "tan(" + newX + ")";
-            }
-            else if (funcName == "tanh") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "tanh(" + newX + ")";
-            }
-            else if (funcName == "tgamma") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "tgamma(" + newX + ")";
-            }
-            else if (funcName == "trunc") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "trunc(" + newX + ")";
-            }
-	    //TODO: support y0, y1, yn
-
-	    //Begin native floats
-            else if (funcName == "__cosf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "native_cos(" + newX + ")";
-            }
-            else if (funcName == "__exp10f") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "native_exp10(" + newX + ")";
-            }
-            else if (funcName == "__expf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "native_exp(" + newX + ")";
-            }
-	    //TODO: support fadd and fdiv with rounding modes
-	    else if (funcName == "__fdividef") {
-		Expr *x = ce->getArg(0);
-		Expr *y = ce->getArg(1);
-		std::string newX, newY;
-		RewriteKernelExpr(x, newX);
-		RewriteKernelExpr(y, newY);
-		newExpr = "native_divide(" + newX + ", " + newY + ")";
-	    }
-	    //TODO: support fmaf, fmul, frcp, and fsqrt with rounding modes
-            else if (funcName == "__log10f") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "native_log10(" + newX + ")";
-            }
-            else if (funcName == "__log2f") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "native_log2(" + newX + ")";
-            }
-            else if (funcName == "__logf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "native_log(" + newX + ")";
-            }
-            else if (funcName == "__powf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                std::string newX, newY;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                newExpr = "native_powr(" + newX + ", " + newY + ")";
-            }
-	    //NOTE: does not use intrinsics, but returns an equivalent value
-            else if (funcName == "__saturatef") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "clamp(" + newX + "0.0f, 1.0f)";
-            }
-            else if (funcName == "__sinf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "native_sin(" + newX + ")";
-            }
-	    //NOTE: does not use intrinsics, but returns an equivalent value
-            else if (funcName == "__sincosf") {
-                Expr *x = ce->getArg(0);
-                Expr *y = ce->getArg(1);
-                Expr *z = ce->getArg(2);
-                std::string newX, newY, newZ;
-                RewriteKernelExpr(x, newX);
-                RewriteKernelExpr(y, newY);
-                RewriteKernelExpr(z, newZ);
-                newExpr = "(*" + newY + " = sincos(" + newX + ", " + newZ + "))";
-            }
-            else if (funcName == "__tanf") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "native_tan(" + newX + ")";
-            }
-	    //Begin double intrinsics
-	    //TODO: support double intrinsics
-	    //Begin integer intrinsics
-	    //TODO: support integer intrinsics
-	    //Begin type casting intrinsics
-            else if (funcName == "__double2float_rd") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "convert_float_rtn(" + newX + ")";
-            }
-            else if (funcName == "__double2float_rn") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "convert_float_rte(" + newX + ")";
-            }
-            else if (funcName == "__double2float_ru") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "convert_float_rtp(" + newX + ")";
-            }
-            else if (funcName == "__double2float_rz") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "convert_float_rtz(" + newX + ")";
-            }
-	    //TODO: support __double2hiint
-            else if (funcName == "__double2int_rd") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "convert_int_rtn(" + newX + ")";
-            }
-            else if (funcName == "__double2int_rn") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "convert_int_rte(" + newX + ")";
+            //Renames edit just the callee token, if it is spelled in the file rather than a macro
+            DeclRefExpr *calleeRef = dyn_cast<DeclRefExpr>(ce->getCallee()->IgnoreParenImpCasts());
+            if (kct->Rename && calleeRef && calleeRef->getLocation().isFileID()) {
+                bool ret = false;
+                for (Stmt::child_iterator CI = ce->child_begin(), CE = ce->child_end(); CI != CE; ++CI) {
+                    std::string s;
+                    Expr *child = (Expr *) *CI;
+                    if (child && RewriteKernelExpr(child, s, edits, false))
+                        ret = true;
+                }
+                if (callee->getName() != kct->Rename) {
+                    edits.replace(calleeRef->getLocation(), callee->getName().size(), kct->Rename);
+                    ret = true;
+                }
+                if (render) newExpr = edits.render(realRange);
+                return ret;
             }
-            else if (funcName == "__double2int_ru") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "convert_int_rtp(" + newX + ")";
+
+            //Otherwise rebuild the call from its translated arguments
+            std::vector<std::string> args(ce->getNumArgs());
+            for (unsigned i = 0; i < ce->getNumArgs(); i++) {
+                if (!RewriteKernelExpr(ce->getArg(i), args[i]))
+                    args[i] = getStmtText(LO, SM, ce->getArg(i));
             }
-            else if (funcName == "__double2int_rz") {
-                Expr *x = ce->getArg(0);
-                std::string newX;
-                RewriteKernelExpr(x, newX);
-                newExpr = "convert_int_rtz(" + newX + ")";
+            if (kct->Rename) {
+                newExpr = std::string(kct->Rename) + "(";
+                for (unsigned i = 0; i < args.size(); i++)
+                    newExpr += (i == 0 ? "" : ", ") + args[i];
+                newExpr += ")";
+                ReplaceStmtWithText(e, newExpr, edits);
+                return true;
             }
-            else {
-		//TODO: Make sure every possible function call goes through here, or else we may not get rewrites on interior nested calls.
-		// any unsupported call should throw an error, but still convert interior nesting.
-                return false;
+            newExpr = "";
+            for (const char *c = kct->Template; *c; c++) {
+                if (*c == '%' && c[1] >= '0' && c[1] <= '9') {
+                    unsigned argNum = *(++c) - '0';
+                    if (argNum < args.size()) newExpr += args[argNum];
+                }
+                else
+                    newExpr += *c;
             }
+            ReplaceStmtWithText(e, newExpr, edits);
             return true;
         }
         else if (CXXFunctionalCastExpr *cfce = dyn_cast<CXXFunctionalCastExpr>(e)) {
             //TODO rewrite type before wrapping it
             TypeLoc tl = cfce->getTypeInfoAsWritten()->getTypeLoc();
-            exprRewriter.ReplaceText(
+            edits.replace(
                     tl.getBeginLoc(),
-                    exprRewriter.getRangeSize(tl.getSourceRange()),
+                    getRangeSize(*SM, CharSourceRange::getTokenRange(tl.getSourceRange())),
                     "(" + tl.getType().getAsString() + ")");
 
             //Rewrite subexpression
             std::string s;
-            if (RewriteHostExpr(cfce->getSubExpr(), s))
-                ReplaceStmtWithText(cfce->getSubExpr(), s, exprRewriter);
-            newExpr = exprRewriter.getRewrittenText(realRange);
+            RewriteHostExpr(cfce->getSubExpr(), s, edits, false);
+            if (render) newExpr = edits.render(realRange);
             return true;
         }
 
         bool ret = false;
-        //Do a DFS, recursing into children, then rewriting this expression
-        //if rewrite happened, replace text at old sourcerange
+        //Do a DFS, recursing into children, which record their rewrites in the same edits
         for (Stmt::child_iterator CI = e->child_begin(), CE = e->child_end();
              CI != CE; ++CI) {
             std::string s;
             Expr *child = (Expr *) *CI;
-            if (child && RewriteKernelExpr(child, s)) {
-                //Perform "rewrite", which is just a simple replace
-                ReplaceStmtWithText(child, s, exprRewriter);
+            if (child && RewriteKernelExpr(child, s, edits, false))
                 ret = true;
-            }
         }
 				
-        newExpr = exprRewriter.getRewrittenText(realRange);
+        if (render) newExpr = edits.render(realRange);
         return ret;
     }
 
@@ -3078,18 +4524,18 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
             tl = tl.getNextTypeLoc();
         }
         QualType qt = tl.getType();
-        std::string type = qt.getAsString();
+        CUDATypeKind kind = TypeKinds->classify(qt);
 
         //Rewrite var type
         if (LastLoc.isNull() || origTL.getBeginLoc() != LastLoc.getBeginLoc()) {
             LastLoc = origTL;
-            if (type == "dim3") {
+            if (kind == CUDAType_Dim3) {
                 //Rewrite to size_t[3] array
                 RewriteType(tl, "size_t", KernReplace);
             }
             else {
-                std::string newType = RewriteVectorType(type, false);
-                if (newType != "")
+                llvm::StringRef newType = TypeKinds->getVectorType(qt, false);
+                if (!newType.empty())
                     RewriteType(tl, newType, KernReplace);
             }
             //TODO check other CUDA-only types to rewrite
@@ -3101,7 +4547,7 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
             std::string s;
             if (RewriteKernelExpr(e, s)) {
                 //Special cases for dim3s
-                if (type == "dim3") {
+                if (kind == CUDAType_Dim3) {
                     //TODO fix case of dim3 c = b;
                     CXXConstructExpr *cce = dyn_cast<CXXConstructExpr>(e);
                     if (cce && cce->getNumArgs() > 1) {
@@ -3128,57 +4574,6 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
         }
     }
 
-    //TODO: Add an option for OpenCL >= 1.1 to keep 3-member vectors
-    std::string RewriteVectorType(std::string type, bool addCL) {
-        std::string prepend, append, ret;
-        char size = type[type.length() - 1];
-        switch (size) {
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-                break;
-            default:
-                return "";
-        }
-
-        if (addCL)
-            prepend = "cl_";
-        if (type[0] == 'u')
-            prepend += "u";
-        if (size == '3') //Only necessary when supporting OpenCL 1.0, otherwise 3 member vectors are supported
-            append = '4';
-        else if (size != '1')
-            append = size;
-
-        llvm::Regex *regex = new llvm::Regex("^u?char[1-4]$");
-        if (regex->match(type)) {
-            ret = prepend + "char" + append;
-        }
-        delete regex;
-        regex = new llvm::Regex("^u?short[1-4]$");
-        if (regex->match(type)) {
-            ret = prepend + "short" + append;
-        }
-        delete regex;
-        regex = new llvm::Regex("^u?int[1-4]$");
-        if (regex->match(type)) {
-            ret = prepend + "int" + append;
-        }
-        delete regex;
-        regex = new llvm::Regex("^u?long[1-4]$");
-        if (regex->match(type)) {
-            ret = prepend + "long" + append;
-        }
-        delete regex;
-        regex = new llvm::Regex("^u?float[1-4]$");
-        if (regex->match(type)) {
-            ret = prepend + "float" + append;
-        }
-        delete regex;	
-        return ret;
-    }
-
     //The workhorse that takes the constructed replacement type and inserts it in place of the old one
     //RewriteType requires a rangeOffset parameter to account for a case in which
     // a rewrite to the type has already occured before we get here (i.e. adding "__global " requires an offset of -9)
@@ -3187,13 +4582,9 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
 	generateReplacement(replacements, SM, tl.getBeginLoc(), getRangeSize(*SM, CharSourceRange::getTokenRange(tl.getLocalSourceRange()))+rangeOffset, replace);
     }
 
-    //Rewrite Type also needs a form that still takes a Rewriter
-    // so that local Expr Rewriters can be used
-    void RewriteType(TypeLoc tl, std::string replace, Rewriter &rewrite, int rangeOffset = 0) {
-
-	SourceRange realRange(tl.getBeginLoc(), PP->getLocForEndOfToken(tl.getBeginLoc()));
-
-	bool status = rewrite.ReplaceText(tl.getBeginLoc(), rewrite.getRangeSize(tl.getLocalSourceRange()) + rangeOffset, replace);
+    //Rewrite Type also needs a form that records into an expression's edits
+    void RewriteType(TypeLoc tl, std::string replace, ExprEdits &edits, int rangeOffset = 0) {
+	edits.replace(tl.getBeginLoc(), getRangeSize(*SM, CharSourceRange::getTokenRange(tl.getLocalSourceRange())) + rangeOffset, replace);
     }
 
     //The workhorse that takes the constructed replacement attribute and inserts it in place of the old one
@@ -3392,14 +4783,13 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
 	return false;
     }
 
-    //ReplaceStmtWithText still needs a Rewriter form so that localized Expr Rewriters can work
-    bool ReplaceStmtWithText(Stmt *OldStmt, llvm::StringRef NewStr, Rewriter &rewrite) {
+    //ReplaceStmtWithText also needs a form that records into an expression's edits
+    bool ReplaceStmtWithText(Stmt *OldStmt, llvm::StringRef NewStr, ExprEdits &edits) {
         SourceRange origRange = OldStmt->getSourceRange();
         SourceLocation s = SM->getExpansionLoc(origRange.getBegin());
         SourceLocation e = SM->getExpansionLoc(origRange.getEnd());
-        return rewrite.ReplaceText(s,
-                                   rewrite.getRangeSize(SourceRange(s, e)),
-                                   NewStr);
+        edits.replace(s, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(s, e))), NewStr);
+        return false;
     }
 
     //Replaces non-alphanumeric characters in a string with underscores
@@ -3415,24 +4805,31 @@ emitCU2CLDiagnostic(SM, cudaCall->getLocStart(), "CU2CL Note", "Rewriting single
 
 public:
     RewriteCUDA(CompilerInstance *comp, std::string origFilename, OutputFile * HostOS,
-                OutputFile * KernelOS) : mainFilename(origFilename),
+                OutputFile * KernelOS, TUContributions *contrib) : mainFilename(origFilename),
         ASTConsumer(), CI(comp),
-        MainOutFile(HostOS), MainKernelOutFile(KernelOS) { }
-
-    virtual ~RewriteCUDA() { }
+        MainOutFile(HostOS), MainKernelOutFile(KernelOS), Contrib(contrib), ST(NULL), DeclKeys(NULL), TypeKinds(NULL) { }
+
+    virtual ~RewriteCUDA() {
+	delete TypeKinds;
+	delete ST;
+	delete DeclKeys;
+	//A TU that stopped early never flushed its comments
+	if (PendingComments == &TUComments) PendingComments = NULL;
+    }
 
+    //Nothing in Contrib refers back into this TU's AST (Decls are DeclLocKeys, rewrites are
+    // Replacements), so the AST, Preprocessor and SourceManager are not retained: the
+    // CompilerInstance frees them as soon as the TU is done, and peak memory is bounded
+    // by the largest single TU rather than the whole project
     virtual void Initialize(ASTContext &Context) {
         SM = &Context.getSourceManager();
-	SM->Retain(); //Retain the SourceManager so we can use it at the tool layer
-	AllSMs.push_back(SM);
-	Context.Retain(); //Retain the context so that it remains valid once we return to the tool layer
-	AllASTs.push_back(&Context);
         LO = &CI->getLangOpts();
         PP = &CI->getPreprocessor();
 
-	PP->Retain();
-	LO->Retain();
-	ST = new SourceTuple(SM, PP, LO, &Context);
+	DeclKeys = new DeclKeyIndexer(SM);
+	ST = new SourceTuple(SM, PP, LO, &Context, DeclKeys);
+	RegisterCallRewriters();
+	TypeKinds = new CUDATypeClassifier(PP->getIdentifierTable());
 
         PP->addPPCallbacks(new RewriteIncludesCallback(this));
 
@@ -3440,8 +4837,18 @@ public:
         KernelRewrite.setSourceMgr(*SM, *LO);
         MainFileID = SM->getMainFileID();
 	
-        OutFiles[mainFilename] = MainOutFile;
-        KernelOutFiles[mainFilename] = MainKernelOutFile;
+        Contrib->MainFile = mainFilename;
+        Contrib->OutFiles[mainFilename] = MainOutFile;
+        Contrib->KernelOutFiles[mainFilename] = MainKernelOutFile;
+	//Keep other TUs from opening a second copy if they #include this file
+	claimOutputFile(mainFilename);
+
+	std::string macros;
+	const std::vector<std::pair<std::string, bool> > &ppMacros = CI->getPreprocessorOpts().Macros;
+	for (std::vector<std::pair<std::string, bool> >::const_iterator i = ppMacros.begin(), e = ppMacros.end(); i != e; i++) {
+	    macros += (i->second ? "-U" : "-D") + i->first + "\n";
+	}
+	MacroContext = hashContents(macros);
 
         if (MainFuncName == "")
             MainFuncName = "main";
@@ -3458,22 +4865,20 @@ public:
 	HostIncludes += "#include \"cu2cl_util.h\"\n";
 	//This isn't actually to check if the map has an empty vector for this file
 	// rather it is to force a key to be generated for this file, so that it turns up in the output stage
-	GlobalCDecls[mainFilename].empty();
+	Contrib->GlobalCDecls[mainFilename].empty();
 	//TODO consider making this default
 	// we will almost always need to load a kernel file
-	if(!UsesCU2CLLoadSrc) {
-	    GlobalCFuncs.push_back(LOAD_PROGRAM_SOURCE);
-	    GlobalHDecls.push_back(LOAD_PROGRAM_SOURCE_H);
-	    UsesCU2CLLoadSrc = true;
+	if(!Contrib->UsesCU2CLLoadSrc) {
+	    Contrib->GlobalCFuncs.push_back(LOAD_PROGRAM_SOURCE);
+	    Contrib->GlobalHDecls.push_back(LOAD_PROGRAM_SOURCE_H);
+	    Contrib->UsesCU2CLLoadSrc = true;
 	}
 
 	//Hoisted to Tool level, no longer initialize here
         IncludingStringH = false;
 
-	//Set up the simple linked-list for buffering inserted comments
-	head = (struct commentBufferNode *)malloc(sizeof(struct commentBufferNode));
-	head->n = NULL;
-    	tail = head;
+	//Buffer inserted comments in this TU's arena
+	PendingComments = &TUComments;
     
 	TransTime = 0;
 }
@@ -3485,6 +4890,7 @@ public:
     //After identifying what manner of declaration it is, control is passed to
     // the relevant host and kernel rewriters
     virtual bool HandleTopLevelDecl(DeclGroupRef DG) {
+	PhaseTimer timer(Contrib->Times, Phase_HostRewrite);
         //Check where the declaration(s) comes from (may have been included)
         Decl *firstDecl = DG.isSingleDecl() ? DG.getSingleDecl() : DG.getDeclGroup()[0];
         SourceLocation loc = firstDecl->getLocation();
@@ -3492,7 +4898,7 @@ public:
         std::string FileName = SM->getPresumedLoc(loc).getFilename();
 
 	//TODO check if the file was included by any file matching the below criteria	
-	if (isInBannedInclude(loc, SM, LO)) {
+	if (IsInBannedFile(loc)) {
 		//llvm::errs() << " will not be translated!\n";
 		//it's a forbidden file, just skip the file
 		return true;
@@ -3500,32 +4906,27 @@ public:
 	
         if (!SM->isInMainFile(loc)) {
             llvm::StringRef fileExt = extension(SM->getPresumedLoc(loc).getFilename());
-                if (OutFiles.find(SM->getPresumedLoc(loc).getFilename()) == OutFiles.end()) {
+                if (Contrib->OutFiles.find(SM->getPresumedLoc(loc).getFilename()) == Contrib->OutFiles.end() && claimOutputFile(FileName)) {
                     //Create new files
                     FileID fileid = SM->getFileID(loc);
 		    std::string origFilename = FileName;
                     size_t dotPos = FileName.rfind('.');
 		    FileName = kernelNameFilter(FileName) + "-cl" + FileName.substr(dotPos);
-			//PAUL: These calls had to be replaced so the CompilerInstance wouldn't destroy the raw_ostream after translation finished
-		    std::string error, HostOutputPathName, HostTempPathName, KernOutputPathName, KernTempPathName;
-		    llvm::raw_ostream *hostOS = CI->createOutputFile(StringRef(CI->getFrontendOpts().OutputFile), error, false, true, FileName, "h", true, true, &HostOutputPathName, &HostTempPathName);
-		    llvm::raw_ostream *kernelOS = CI->createOutputFile(StringRef(CI->getFrontendOpts().OutputFile), error, false, true, FileName, "cl", true, true, &KernOutputPathName, &KernTempPathName);
-			OutputFile *HostOF = new OutputFile(HostOutputPathName, HostTempPathName, hostOS);
-			OutputFile *KernOF = new OutputFile(KernOutputPathName, KernTempPathName, kernelOS);
-                    if (hostOS && kernelOS) {
-                        OutFiles[origFilename] = HostOF;
-                        KernelOutFiles[origFilename] = KernOF;
-                    }
-                    else {
-			//We've already registered an output stream for this
-			// input file, so proceed
-                    }
+                    Contrib->OutFiles[origFilename] = createOutputFileFor(FileName, "h");
+                    Contrib->KernelOutFiles[origFilename] = createOutputFileFor(FileName, "cl");
                 }
         }
         //Store VarDecl DeclGroupRefs
         if (firstDecl->getKind() == Decl::Var) {
             GlobalVarDeclGroups.insert(DG);
         }
+        //Leave declarations in headers another TU has already translated alone
+        //Not done when caching, so every cache entry holds everything its TU translates
+        FileID declFile = SM->getFileID(SM->getExpansionLoc(loc));
+        bool sharedHeader = declFile != MainFileID && Session->CacheDir.empty();
+        if (sharedHeader && IsHeaderShared(declFile)) return true;
+        size_t includesLen = HostIncludes.size(), globalVarsLen = HostGlobalVars.size();
+        FunctionDecl *mainDecl = MainDecl;
         //Walk declarations in group and rewrite
         for (DeclGroupRef::iterator i = DG.begin(), e = DG.end(); i != e; ++i) {
             if (DeclContext *dc = dyn_cast<DeclContext>(*i)) {
@@ -3587,6 +4988,8 @@ public:
             else if (VarDecl *vd = dyn_cast<VarDecl>(*i)) {
                 RemoveVar(vd, KernReplace);
                 RewriteHostVarDecl(vd);
+                if (vd->hasInit())
+                    RecordPropagationEdges(vd->getInit(), NULL);
             }
             //Rewrite Structs here
             //Ideally, we should keep the expression inside parentheses ie __align__(<keep this>)
@@ -3643,7 +5046,68 @@ public:
 	    }
             //TODO rewrite type declarations
         }
-return true;
+        if (sharedHeader && (HostIncludes.size() != includesLen || HostGlobalVars.size() != globalVarsLen || MainDecl != mainDecl))
+            UnshareableHeaders.insert(declFile);
+return true;
+    }
+
+    //Whether another TU already translated the header declFile, decided the first time each header is asked about
+    bool IsHeaderShared(FileID declFile) {
+        std::pair<llvm::DenseMap<FileID, bool>::iterator, bool> skip = SkipHeaderDecls.insert(std::make_pair(declFile, false));
+        if (skip.second) {
+            skip.first->second = isHeaderTranslated(GetHeaderKey(declFile));
+            if (!skip.first->second) RewrittenHeaders.insert(declFile);
+        }
+        return skip.first->second;
+    }
+
+    //With SkipFunctionBodies on, Clang asks before parsing each function body whether to build it
+    //HandleTopLevelDecl never looks inside banned headers, or headers another TU already translated
+    virtual bool shouldSkipFunctionBody(Decl *D) {
+        SourceLocation loc = D->getLocation();
+        if (IsInBannedFile(loc)) return true;
+        FileID declFile = SM->getFileID(SM->getExpansionLoc(loc));
+        return declFile != MainFileID && Session->CacheDir.empty() && IsHeaderShared(declFile);
+    }
+
+    //Identifies a header's contents as seen by this TU, for TranslatedHeaders
+    std::string GetHeaderKey(FileID fid) {
+        const FileEntry *FE = SM->getFileEntryForID(fid);
+        if (FE == NULL) return "";
+        SmallString<128> path(FE->getName());
+        llvm::sys::fs::make_absolute(path);
+        return path.str().str() + "\n" + hashContents(SM->getBufferData(fid)) + "\n" + MacroContext + "\n" + GetIncludeContext(fid);
+    }
+
+    //Hash of everything preprocessed ahead of the header fid: the files entered before it, and the
+    // tokens of each file on its include stack up to its #include. A header's translation depends on
+    // the macros and declarations in effect where it's included, so TUs only share it when these agree,
+    // and then it doesn't matter which of them translates it
+    std::string GetIncludeContext(FileID fid) {
+        llvm::MD5 hash;
+        llvm::DenseMap<FileID, unsigned>::iterator entry = EntryHistory.find(fid);
+        unsigned entered = (entry == EntryHistory.end() ? EnteredFiles.size() : entry->second);
+        for (unsigned i = 0; i < entered; i++) {
+            hash.update(EnteredFiles[i]);
+            hash.update(StringRef("\n"));
+        }
+        //Raw tokens, so comments and spacing (like each file's own license header) don't count
+        for (SourceLocation inc = SM->getIncludeLoc(fid); inc.isValid() && inc.isFileID(); inc = SM->getIncludeLoc(SM->getFileID(inc))) {
+            std::pair<FileID, unsigned> at = SM->getDecomposedLoc(inc);
+            StringRef buf = SM->getBufferData(at.first);
+            Lexer raw(SM->getLocForStartOfFile(at.first), *LO, buf.begin(), buf.begin(), buf.end());
+            Token tok;
+            for (raw.LexFromRawLexer(tok); tok.isNot(tok::eof) && SM->getFileOffset(tok.getLocation()) < at.second; raw.LexFromRawLexer(tok)) {
+                hash.update(StringRef(SM->getCharacterData(tok.getLocation()), tok.getLength()));
+                hash.update(StringRef(tok.isAtStartOfLine() ? "\n" : " "));
+            }
+            hash.update(StringRef("\n#\n"));
+        }
+        llvm::MD5::MD5Result result;
+        hash.final(result);
+        SmallString<32> hex;
+        llvm::MD5::stringifyResult(result, hex);
+        return hex.str().str();
     }
 
     //Compltely processes each file included on the invokation command line
@@ -3651,6 +5115,7 @@ return true;
 	#ifdef CU2CL_ENABLE_TIMING
         	init_time();
 	#endif
+	PhaseTimer timer(Contrib->Times, Phase_HostRewrite);
 
         //Declare global clPrograms, one for each kernel-bearing source file
         for (StringRefListMap::iterator i = Kernels.begin(),
@@ -3659,12 +5124,12 @@ return true;
 	    //Insert the cl_program variable for this file IFF it hasn't already been inserted
 	    //Paul: This search is linear w.r.t the number of global "extern"-needed variables in the current source file
 	    std::string decl = "cl_program __cu2cl_Program_" + r + ";\n";
-	    std::vector<std::string>::iterator j = GlobalCDecls[(*i).first].begin(), f = GlobalCDecls[(*i).first].end();
+	    std::vector<std::string>::iterator j = Contrib->GlobalCDecls[(*i).first].begin(), f = Contrib->GlobalCDecls[(*i).first].end();
 	    //Iterate to the end of the vector or til a matching string is found
 	    for (; j != f && (*j) != decl; j++);
 	
 	    if (j == f) { // Not found, add declaration
-                GlobalCDecls[(*i).first].push_back(decl);
+                Contrib->GlobalCDecls[(*i).first].push_back(decl);
             }
         }
         //Insert host preamble at top of main file
@@ -3682,38 +5147,50 @@ return true;
 	    // essentially 2x the number of CUDA files with kernel code + a constant number of utility functions
 	    // it's quick and dirty but has the nice property of not reordering the data strucutre
 	    std::string decl = "void __cu2cl_Init_" + file + "();\n";
-	    std::vector<std::string>::iterator j = GlobalHDecls.begin(), f = GlobalHDecls.end();
+	    std::vector<std::string>::iterator j = Contrib->GlobalHDecls.begin(), f = Contrib->GlobalHDecls.end();
 	    //Iterate to the end of the vector or til a matching string is found
 	    for (; j != f && (*j) != decl; j++);
 	
 	    if (j == f) { // Not found, add declaration and call
-		GlobalHDecls.push_back("void __cu2cl_Init_" + file + "();\n");
-		CU2CLInit += "    __cu2cl_Init_" + file + "();\n";
+		Contrib->GlobalHDecls.push_back("void __cu2cl_Init_" + file + "();\n");
+		//Lazy programs are only built by the first launch of one of their kernels
+		if (!Session->LazyInit) {
+		    if (Session->ConcurrentBuilds) Contrib->InitCalls.push_back("    __cu2cl_StartInit(__cu2cl_Init_" + file + ");\n");
+		    else Contrib->InitCalls.push_back("    __cu2cl_Init_" + file + "();\n");
+		}
 	    }
 	    CLInit = "void __cu2cl_Init_" + file + "() {\n";
+	    //Concurrent inits can't share cu2cl_util.c's progSrc/progLen
+	    if (Session->ConcurrentBuilds) CLInit += "    const char *progSrc;\n    size_t progLen;\n";
             std::list<llvm::StringRef> &l = (*i).second;
 	//Paul: Addition to generate ALTERA .aocx build from binary with an ifdef
-	    CLInit += "    #ifdef WITH_ALTERA\n";
-	    CLInit += "    progLen = __cu2cl_LoadProgramSource(\"" + kernelNameFilter(idCharFilter(filename((*i).first))) + "_cl.aocx\", &progSrc);\n";
-	    CLInit += "    __cu2cl_Program_" + file + " = clCreateProgramWithBinary(__cu2cl_Context, 1, &__cu2cl_Device, &progLen, (const unsigned char **)&progSrc, NULL, NULL);\n";
-	    CLInit += "    #else\n";
-            CLInit += "    progLen = __cu2cl_LoadProgramSource(\"" + kernelNameFilter(filename((*i).first).str()) + "-cl.cl\", &progSrc);\n";
-            CLInit += "    __cu2cl_Program_" + file + " = clCreateProgramWithSource(__cu2cl_Context, 1, &progSrc, &progLen, NULL);\n";
-	    CLInit += "    #endif\n";
-            CLInit += "    free((void *) progSrc);\n";
-            CLInit += "    clBuildProgram(__cu2cl_Program_" + file + ", 1, &__cu2cl_Device, \"-I . ";
-		CLInit += ExtraBuildArgs;
-		CLInit += "\", NULL, NULL);\n";
+	    CLInit += generateProgramBuild("__cu2cl_Program_" + file, kernelNameFilter(idCharFilter(filename((*i).first))) + "_cl.aocx", kernelNameFilter(filename((*i).first).str()) + "-cl.cl", file);
+	    if (Session->EmbedKernels) Contrib->GlobalHDecls.push_back(embeddedSourceDecl(file));
+	    if (Session->EmbedKernels && Session->PrecompileKernels) {
+		Contrib->GlobalHDecls.push_back(embeddedSourceDecl(file + "_spir"));
+		Contrib->GlobalHDecls.push_back(embeddedSourceDecl(file + "_spir64"));
+	    }
 	    // and initialize all its kernels
             for (std::list<llvm::StringRef>::iterator li = l.begin(), le = l.end();
-                 li != le; li++) {
+                 li != le && !Session->LazyInit; li++) {
                 std::string kernelName = (*li).str();
                 CLInit += "    __cu2cl_Kernel_" + kernelName + " = clCreateKernel(__cu2cl_Program_" + file + ", \"" + kernelName + "\", NULL);\n";
             }
 	    CLInit += "}\n\n";
+	    //Lazily, each kernel gets its own loader instead, which its launches call while it's still NULL
+	    for (std::list<llvm::StringRef>::iterator li = l.begin(), le = l.end();
+		 li != le && Session->LazyInit; li++) {
+		std::string kernelName = (*li).str();
+		Contrib->GlobalHDecls.push_back("void __cu2cl_Load_" + kernelName + "();\n");
+		CLInit += "//Not thread-safe: the first launch of " + kernelName + " must not race another thread's\n";
+		CLInit += "void __cu2cl_Load_" + kernelName + "() {\n";
+		CLInit += "    if (__cu2cl_Program_" + file + " == NULL) __cu2cl_Init_" + file + "();\n";
+		CLInit += "    __cu2cl_Kernel_" + kernelName + " = clCreateKernel(__cu2cl_Program_" + file + ", \"" + kernelName + "\", NULL);\n";
+		CLInit += "}\n\n";
+	    }
 	    //Add the initializer to a deferred list of boilerplate
 	    // to be inserted after relevant cl_program/cl_kernel declarations
-            LocalBoilDefs[(*i).first].push_back(CLInit);
+            Contrib->LocalBoilDefs[(*i).first].push_back(CLInit);
 	}
         
 
@@ -3726,27 +5203,30 @@ return true;
 	    //Paul: This search is O(n^2) (where n is 2x the number of CUDA files with kernel code
 	    // it's quick and dirty but has the nice property of not reordering the data strucutre
 	    std::string decl = "void __cu2cl_Cleanup_" + file + "();\n";
-	    std::vector<std::string>::iterator j = GlobalHDecls.begin(), f = GlobalHDecls.end();
+	    std::vector<std::string>::iterator j = Contrib->GlobalHDecls.begin(), f = Contrib->GlobalHDecls.end();
 	    //Iterate to the end of the vector or til a matching string is found
 	    for (; j != f && (*j) != decl; j++);
 	
 	    if (j == f) { // Not found, add declaration and call
-		GlobalHDecls.push_back(decl);
-		CU2CLClean = "    __cu2cl_Cleanup_" + file + "();\n" + CU2CLClean;
+		Contrib->GlobalHDecls.push_back(decl);
+		Contrib->CleanupCalls.push_back("    __cu2cl_Cleanup_" + file + "();\n");
 	    }
 	    CLClean = "void __cu2cl_Cleanup_" + file + "() {\n";
 	    //Release its kernels
             for (std::list<llvm::StringRef>::iterator li = l.begin(), le = l.end();
                  li != le; li++) {
                 std::string kernelName = (*li).str();
-                CLClean += "    clReleaseKernel(__cu2cl_Kernel_" + kernelName + ");\n";
+		//Lazily, only what was actually created, and back to NULL so a later launch loads it again
+		if (Session->LazyInit) CLClean += "    if (__cu2cl_Kernel_" + kernelName + " != NULL) {\n        clReleaseKernel(__cu2cl_Kernel_" + kernelName + ");\n        __cu2cl_Kernel_" + kernelName + " = NULL;\n    }\n";
+		else CLClean += "    clReleaseKernel(__cu2cl_Kernel_" + kernelName + ");\n";
             }
 	    //Then release the program itself
-            CLClean += "    clReleaseProgram(__cu2cl_Program_" + file + ");\n";
+	    if (Session->LazyInit) CLClean += "    if (__cu2cl_Program_" + file + " != NULL) {\n        clReleaseProgram(__cu2cl_Program_" + file + ");\n        __cu2cl_Program_" + file + " = NULL;\n    }\n";
+	    else CLClean += "    clReleaseProgram(__cu2cl_Program_" + file + ");\n";
 	    CLClean += "}\n";
 	    //Add the cleanup to a deferred list of boilerplate
 	    // to be inserted after relevant cl_program/cl_kernel declarations
-            LocalBoilDefs[(*i).first].push_back(CLClean);
+            Contrib->LocalBoilDefs[(*i).first].push_back(CLClean);
         }
 	//TODO: Remove this? Unless there's some reason to iterate to the end?
         for (StringRefListMap::iterator i = Kernels.begin(),
@@ -3778,7 +5258,7 @@ return true;
                     start = (*iDG)->getLocStart();
                 }
                 if (DeviceMemVars.find(vd) != DeviceMemVars.end()) {
-		DeclsToTranslate.push_back(std::pair<NamedDecl*, SourceTuple*>((dyn_cast<NamedDecl>(vd)), ST));
+		Contrib->DeclsToTranslate.push_back(RecordPropagationDecl(vd));
                 }
                 else {
 			//If it's not a device variable print it (with type to de-group it)
@@ -3799,27 +5279,45 @@ return true;
 	    generateReplacement(HostReplace, SM, start, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(SM->getExpansionLoc(start), SM->getExpansionLoc(end)))), replace);
         }
 	//Flush all remaining vector rewrites still in the map to a global map, for pruning after cl_mem propagation
-	GlobalHostVecVars.insert(HostVecVars.begin(), HostVecVars.end());
+	for (std::map<SourceLocation, Replacement>::iterator i = HostVecVars.begin(), e = HostVecVars.end(); i != e; i++) {
+	    Contrib->GlobalHostVecVars.insert(std::make_pair(DeclKeys->getKey(i->first), i->second));
+	}
 	//Write all buffered comments to output streams
-	writeComments(SM);
-	//And clean up the list's sentinel
-	free(head);
-	head = NULL;
-	tail = NULL;
+	{
+	    PhaseTimer commentTimer(Contrib->Times, Phase_CommentFlush);
+	    writeComments(SM);
+	}
+	//The arena is freed with the consumer, make sure nothing else writes to it
+	PendingComments = NULL;
 	
 	//Do final cleanup of the Replacement vectors
-	std::vector<Range> conflicts;
-	//Get rid of duplicate replacements (e.g. multiple "Cannot translate template" comments
-	deduplicate(HostReplace, conflicts);
-	//Collapse Replacements on the same SourceLocation (for things like InsertBefore + Replace)
-	coalesceReplacements(HostReplace);
-	//Share the finished replacements with the global data structure
-	GlobalHostReplace.insert(GlobalHostReplace.end(), HostReplace.begin(), HostReplace.end());
-
-	//Do the same steps on kernel code	
-	deduplicate(KernReplace, conflicts);
-	coalesceReplacements(KernReplace);
-	GlobalKernReplace.insert(GlobalKernReplace.end(), KernReplace.begin(), KernReplace.end());
+	{
+	    PhaseTimer dedupTimer(Contrib->Times, Phase_Dedup);
+	    std::vector<Range> conflicts;
+	    //Get rid of duplicate replacements (e.g. multiple "Cannot translate template" comments
+	    deduplicate(HostReplace, conflicts);
+	    //Collapse Replacements on the same SourceLocation (for things like InsertBefore + Replace)
+	    coalesceReplacements(HostReplace);
+	    //Share the finished replacements with the global data structure
+	    Contrib->GlobalHostReplace.insert(Contrib->GlobalHostReplace.end(), HostReplace.begin(), HostReplace.end());
+
+	    //Do the same steps on kernel code	
+	    deduplicate(KernReplace, conflicts);
+	    coalesceReplacements(KernReplace);
+	    Contrib->GlobalKernReplace.insert(Contrib->GlobalKernReplace.end(), KernReplace.begin(), KernReplace.end());
+	}
+	Contrib->HostReplacements = HostReplace.size();
+	Contrib->KernReplacements = KernReplace.size();
+
+	if (!Session->CacheDir.empty()) RecordDependencies();
+	Contrib->Cacheable = !CI->getDiagnostics().hasErrorOccurred();
+
+	//Let TUs that start after this one skip the headers it translated, unless errors may have hidden some of their declarations
+	for (std::set<FileID>::iterator i = RewrittenHeaders.begin(), e = RewrittenHeaders.end(); i != e && Contrib->Cacheable; i++) {
+	    if (UnshareableHeaders.find(*i) != UnshareableHeaders.end()) continue;
+	    std::string key = GetHeaderKey(*i);
+	    if (!key.empty()) markHeaderTranslated(key);
+	}
 
 	#ifdef CU2CL_ENABLE_TIMING
 	    TransTime += get_time();
@@ -3827,15 +5325,61 @@ return true;
 	#endif
     }
 
+    //Hash the quote-#included files this TU read, so the translation cache can tell when they change
+    //Contents come from the SourceManager, so they're exactly what was translated
+    void RecordDependencies() {
+        for (std::set<const FileEntry *>::iterator i = LocalIncludes.begin(), e = LocalIncludes.end(); i != e; i++) {
+            bool invalid = false;
+            const llvm::MemoryBuffer *buf = SM->getMemoryBufferForFile(*i, &invalid);
+            if (invalid) continue;
+            SmallString<128> path((*i)->getName());
+            llvm::sys::fs::make_absolute(path);
+            Contrib->Dependencies.push_back(std::make_pair(path.str().str(), hashContents(buf->getBuffer())));
+        }
+    }
+
+    //isInBannedInclude, with its verdict kept per FileID. Every declaration in a file (and the file
+    // that #included it) gets the same answer, so it's only worked out once, mostly as the file is entered
+    //Macro locations can mix in their spelling file's verdict, so those aren't cached
+    bool IsInBannedFile(SourceLocation loc) {
+        if (loc.isInvalid() || !loc.isFileID()) return isInBannedInclude(loc, SM, LO);
+        FileID fid = SM->getFileID(loc);
+        llvm::DenseMap<FileID, bool>::iterator known = BannedFiles.find(fid);
+        if (known != BannedFiles.end()) return known->second;
+        SourceLocation parentLoc;
+        IncludeVerdict verdict = classifyInclude(loc, SM, LO, parentLoc);
+        bool banned = verdict == Include_Banned || (verdict == Include_AskParent && IsInBannedFile(parentLoc));
+        BannedFiles[fid] = banned;
+        return banned;
+    }
+
+    //Buffers like <built-in> aren't real files and never hold declarations, so they're skipped
+    void EnterFile(SourceLocation loc) {
+        if (!loc.isValid() || !loc.isFileID()) return;
+        FileID fid = SM->getFileID(loc);
+        const FileEntry *FE = SM->getFileEntryForID(fid);
+        if (FE == NULL) return;
+        //The main file differs between every pair of TUs, its tokens are hashed instead
+        if (fid != SM->getMainFileID()) {
+            EntryHistory[fid] = EnteredFiles.size();
+            std::string id;
+            llvm::raw_string_ostream OS(id);
+            OS << FE->getName() << "\n" << FE->getSize() << "\n" << (uint64_t) FE->getModificationTime();
+            EnteredFiles.push_back(OS.str());
+        }
+        IsInBannedFile(loc);
+    }
+
     void RewriteInclude(SourceLocation HashLoc, const Token &IncludeTok,
                         llvm::StringRef FileName, bool IsAngled,
                         const FileEntry *File, SourceLocation EndLoc) {
+        if (!IsAngled && File != NULL && !SM->isInSystemHeader(HashLoc)) LocalIncludes.insert(File);
         llvm::StringRef fileExt = extension(SM->getPresumedLoc(HashLoc).getFilename());
         llvm::StringRef includedFile = filename(FileName);
         llvm::StringRef includedExt = extension(includedFile);
             //If system-wide include style (#include <foo.h>) is used, don't translate
             if (IsAngled) {
-	        if (!isInBannedInclude(HashLoc, SM, LO)) generateReplacement(KernReplace, SM, HashLoc, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(HashLoc, EndLoc))), "");
+	        if (!IsInBannedFile(HashLoc)) generateReplacement(KernReplace, SM, HashLoc, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(HashLoc, EndLoc))), "");
 		//Remove reference to the CUDA header
                 if (includedFile.equals("cuda.h") || includedFile.equals("cuda_runtime.h"))
 	            generateReplacement(HostReplace, SM, HashLoc, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(HashLoc, EndLoc))), "");
@@ -3845,7 +5389,7 @@ return true;
 	        generateReplacement(HostReplace, SM, HashLoc, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(HashLoc, EndLoc))), "");
 	        generateReplacement(KernReplace, SM, HashLoc, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(HashLoc, EndLoc))), "");
             }
-	    else if (!isInBannedInclude(HashLoc, SM, LO)) {
+	    else if (!IsInBannedFile(HashLoc)) {
 	    //If local include style (#include "foo.h") is used, do translate
                 FileID fileID = SM->getFileID(HashLoc);
                 SourceLocation fileStartLoc = SM->getLocForStartOfFile(fileID);
@@ -3866,7 +5410,45 @@ return true;
 };
 
 class RewriteCUDAAction : public SyntaxOnlyAction {
+public:
+    RewriteCUDAAction(TUContributions *contrib) : Contrib(contrib), StartWall(0), StartCPU(0) { }
+
 protected:
+    //Where the consumer created for this TU deposits its results
+    TUContributions *Contrib;
+
+    //Start of the '--time-report' window for this TU, whatever in it isn't charged
+    // to one of our own phases was spent by Clang lexing, parsing and checking
+    uint64_t StartWall, StartCPU;
+
+    virtual bool BeginInvocation(CompilerInstance &CI) {
+        if (Session->UsePreludePCH) {
+            PhaseTimer timer(Contrib->Times, Phase_Prelude);
+            usePreludePCH(CI);
+        }
+        //Set after the prelude is built, so the PCH keeps its bodies for every TU that loads it
+        CI.getFrontendOpts().SkipFunctionBodies = Session->SkipHeaderBodies;
+        return true;
+    }
+
+    virtual bool BeginSourceFileAction(CompilerInstance &CI, StringRef Filename) {
+        StartWall = wallMicros();
+        StartCPU = cpuMicros();
+        return SyntaxOnlyAction::BeginSourceFileAction(CI, Filename);
+    }
+
+    virtual void EndSourceFileAction() {
+        SyntaxOnlyAction::EndSourceFileAction();
+        if (!Session->ReportTimes) return;
+        uint64_t wall = wallMicros() - StartWall, cpu = cpuMicros() - StartCPU;
+        PhaseTimes &times = Contrib->Times;
+        for (int i = Phase_HostRewrite; i <= Phase_Dedup; i++) {
+            wall -= std::min(wall, times.Wall[i]);
+            cpu -= std::min(cpu, times.CPU[i]);
+        }
+        times.Wall[Phase_Parse] += wall;
+        times.CPU[Phase_Parse] += cpu;
+    }
 
     //The factory method needeed to initialize the plugin as an ASTconsumer
     ASTConsumer *CreateASTConsumer(CompilerInstance &CI, llvm::StringRef InFile) {
@@ -3875,20 +5457,28 @@ protected:
 	std::string origFilename = filename;
         size_t dotPos = filename.rfind('.');
 	filename = kernelNameFilter(filename) + "-cl" + filename.substr(dotPos);
-		    std::string error, HostOutputPathName, HostTempPathName, KernOutputPathName, KernTempPathName;
-		    llvm::raw_ostream *hostOS = CI.createOutputFile(StringRef(CI.getFrontendOpts().OutputFile), error, false, true, filename, "cpp", true, true, &HostOutputPathName, &HostTempPathName);
-		    llvm::raw_ostream *kernelOS = CI.createOutputFile(StringRef(CI.getFrontendOpts().OutputFile), error, false, true, filename, "cl", true, true, &KernOutputPathName, &KernTempPathName);
-			OutputFile *HostOF = new OutputFile(HostOutputPathName, HostTempPathName, hostOS);
-			OutputFile *KernOF = new OutputFile(KernOutputPathName, KernTempPathName, kernelOS);
-                    if (hostOS && kernelOS) 
-            return new RewriteCUDA(&CI, origFilename, HostOF, KernOF);
-        //TODO cleanup files?	
-        return NULL;
+        return new RewriteCUDA(&CI, origFilename, createOutputFileFor(filename, "cpp"), createOutputFileFor(filename, "cl"), Contrib);
     }
 
 
 };
 
+//Hands each new RewriteCUDAAction a fresh TUContributions, recording them in the
+// order the tool creates them (which is the order it walks its source files)
+class RewriteCUDAActionFactory : public FrontendActionFactory {
+public:
+    RewriteCUDAActionFactory(std::vector<TUContributions *> *slots) : Slots(slots) { }
+
+    virtual FrontendAction *create() {
+	TUContributions *contrib = new TUContributions();
+	Slots->push_back(contrib);
+	return new RewriteCUDAAction(contrib);
+    }
+
+private:
+    std::vector<TUContributions *> *Slots;
+};
+
 RewriteIncludesCallback::RewriteIncludesCallback(RewriteCUDA *RC) :
     RCUDA(RC) {
 }
@@ -3902,6 +5492,12 @@ void RewriteIncludesCallback::InclusionDirective(SourceLocation HashLoc, const T
     RCUDA->RewriteInclude(HashLoc, IncludeTok, FileName, IsAngled, File, FileNameRange.getEnd());
 }
 
+//Decide whether each file is banned as soon as it's entered, while its #include is fresh
+void RewriteIncludesCallback::FileChanged(SourceLocation Loc, FileChangeReason Reason,
+                                          SrcMgr::CharacteristicKind FileType, FileID PrevFID) {
+    if (Reason == EnterFile) RCUDA->EnterFile(Loc);
+}
+
 }
 
 
@@ -3936,12 +5532,6 @@ private:
 };
 
 
-//Add custom cu2cl arguments
-llvm::cl::opt<bool, true> Comments("inline-comments", llvm::cl::desc("Add inline descriptive comments to output (boolean, default \"true\")."),  llvm::cl::location(AddInlineComments));
-llvm::cl::opt<std::string, true> ExtraArgs("cl-extra-args", llvm::cl::desc("Additional compiler arguments to append to all generated clBuildProgram calls."), llvm::cl::value_desc("<\"args\">"), llvm::cl::location(ExtraBuildArgs), llvm::cl::init(""));
-llvm::cl::opt<bool, true> KernelRename("rename-kernel-files", llvm::cl::desc("Replace instances of \"kernel\" in filenames with \"knl\""), llvm::cl::location(FilterKernelName));
-llvm::cl::opt<bool, true> ImportGCCPaths("import-gcc-paths", llvm::cl::desc("Use GCC to infer search path(s) for system include directories"), llvm::cl::location(UseGCCPaths));
-
 std::string parseGCCPaths() {
     //create a temporary file
 	llvm::SmallVectorImpl<char> * tmpPath = new llvm::SmallVector<char, 128>();
@@ -3988,110 +5578,412 @@ std::string parseGCCPaths() {
     return directives;
 }
 
-void replaceVarDecl(DeclaratorDecl *decl, SourceTuple * ST) {
-	//IIRC If the dyn_cast of the VarDecl doesn't work it'll show up as NULL
-	//llvm::errs() << "CU2CL DEBUG: Replacing var decl " << (void*)decl << "\n";
-	SourceManager * SM = std::get<0>(*ST);
-	Preprocessor * PP = std::get<1>(*ST);
-	LangOptions * LO = std::get<2>(*ST);
-	if (decl == NULL) return;
-	std::string replace = "";
-        SourceLocation start, end, tempLoc;
-		start = decl->getLocStart();
-        	if ((decl->getAttr<CUDAConstantAttr>()) || (decl->getAttr<CUDADeviceAttr>() )) {
-			start = decl->getTypeSpecStartLoc();
+//ClangTool::run switches the process' working directory to each compile command's
+// directory, which is only safe to do from several threads if they all agree on it
+bool sharesWorkingDirectory(const CompilationDatabase &Compilations, const std::vector<std::string> &Sources) {
+	bool first = true;
+	std::string dir;
+	for (std::vector<std::string>::const_iterator i = Sources.begin(), e = Sources.end(); i != e; i++) {
+		std::vector<CompileCommand> cmds = Compilations.getCompileCommands(getAbsolutePath(*i));
+		for (std::vector<CompileCommand>::iterator c = cmds.begin(), ce = cmds.end(); c != ce; c++) {
+			if (first) {
+				dir = c->Directory;
+				first = false;
+			} else if (c->Directory != dir) return false;
 		}
-		end = decl->getLocEnd();
-			//Make sure we have the correct amount of "pointer to" on the output type
-			std::string pointers = " ";
-			for (Type * type = (Type *)decl->getType().getTypePtrOrNull(); type != NULL && type->isPointerType(); ) {
-				Type * interior =  (Type *) type->getPointeeType().getTypePtrOrNull();
-				if (interior->isPointerType()) {
-					pointers = pointers + "*";
+	}
+	return true;
+}
+
+//The translation cache key of a source file: everything its translation depends on besides
+// the headers it #includes. Returns "" if the file can't be read, which leaves it uncached
+//Sessions with in-memory sources aren't cached at all, since entries are checked against the disk
+std::string getCacheKey(const CompilationDatabase &Compilations, const std::string &source, const std::string &embeddedArgs) {
+	if (!Session->VirtualFiles.empty()) return "";
+	std::string path = getAbsolutePath(source);
+	OwningPtr<llvm::MemoryBuffer> buf;
+	if (llvm::MemoryBuffer::getFile(path, buf)) return "";
+	//Lay the fields out the way cache entries are, so no two different sets of them run together
+	std::string fields;
+	llvm::raw_string_ostream OS(fields);
+	CacheWriter writer(OS);
+	writer.writeStr(CU2CL_VERSION);
+	writer.writeStr(CU2CL_CACHE_FORMAT);
+	writer.writeNum(Session->AddInlineComments);
+	writer.writeStr(Session->ExtraBuildArgs);
+	writer.writeNum(Session->FilterKernelName);
+	writer.writeStr(Session->BinaryCacheDir);
+	writer.writeNum(Session->ConcurrentBuilds);
+	writer.writeNum(Session->LazyInit);
+	writer.writeNum(Session->EmbedKernels);
+	writer.writeNum(Session->PrecompileKernels);
+	writer.writeNum(Session->MemoryPoolMB);
+	writer.writeStr(embeddedArgs);
+	writer.writeStr(path);
+	std::vector<CompileCommand> cmds = Compilations.getCompileCommands(path);
+	writer.writeNum(cmds.size());
+	for (std::vector<CompileCommand>::iterator c = cmds.begin(), ce = cmds.end(); c != ce; c++) {
+		writer.writeStr(c->Directory);
+		writer.writeStrs(c->CommandLine);
+	}
+	writer.writeStr(buf->getBuffer());
+	return hashContents(OS.str());
+}
+
+//The lexer-only pre-scan decides, without building an AST, whether a source file needs translating at all
+//It looks for what the rewriter acts on: CUDA attributes and built-ins, kernel launches, cuda* names,
+// calls to cu* functions, CUDA vector types, #includes of CUDA headers, and a main() to initialize from,
+// in the file, every header it quote-#includes, and every header it angle-#includes from a -I or -isystem
+// directory, since typedefs of CUDA types there are rewritten where they're used. Anything it can't see
+// through counts as CUDA
+class CUDAPreScanner {
+public:
+	//A quote #include of a header the scan found, with where its file name is in File
+	struct QuoteInclude {
+		std::string File, Header, Name;
+		unsigned Offset;
+	};
+
+	CUDAPreScanner(const std::vector<CompileCommand> &cmds) : Failed(cmds.empty()) {
+		LO.CPlusPlus = 1;
+		LO.CUDA = 1;
+		for (std::vector<CompileCommand>::const_iterator c = cmds.begin(), ce = cmds.end(); c != ce; c++) {
+			const std::vector<std::string> &args = c->CommandLine;
+			for (unsigned j = 0; j < args.size(); j++) {
+				StringRef arg = args[j];
+				bool separate = j + 1 < args.size();
+				//#includes are searched for the way the compiler would: -iquote (quote #includes only), then -I, then -isystem
+				if ((arg == "-iquote" || arg == "-I") && separate) addDir(arg == "-I" ? IncludeDirs : QuoteDirs, c->Directory, args[++j]);
+				else if (arg.startswith("-iquote")) addDir(QuoteDirs, c->Directory, arg.substr(7));
+				else if (arg == "-isystem" && separate) addDir(SystemDirs, c->Directory, args[++j]);
+				else if (arg.startswith("-isystem")) addDir(SystemDirs, c->Directory, arg.substr(8));
+				else if (arg.startswith("-I")) addDir(IncludeDirs, c->Directory, arg.substr(2));
+				//Macros and forced #includes from the command line can bring CUDA in just as well
+				else if (arg == "-D" && separate) Macros += args[++j] + "\n";
+				else if (arg.startswith("-D")) Macros += arg.substr(2).str() + "\n";
+				else if (arg == "-include" && separate) {
+					SmallString<128> path;
+					append(path, c->Directory, args[++j]);
+					ForcedIncludes.push_back(is_absolute(args[j]) ? args[j] : path.str().str());
 				}
-				type = interior;
 			}
-			if (pointers == " ") pointers = "";
-			
-                    replace += "cl_mem" + pointers + " " + decl->getNameAsString();
-			if (VarDecl *var = dyn_cast<VarDecl>(decl)) {
-		    if (var->getType()->isArrayType()) {
-			//make sure to grab the array [...] Expr too
-            ArrayTypeLoc arrTL = var->getTypeSourceInfo()->getTypeLoc().getAs<ArrayTypeLoc>();
-		while (!arrTL.isNull()) {
-			replace += "[";
-			if (arrTL.getSizeExpr() != NULL) replace += getStmtText(LO, SM, arrTL.getSizeExpr());
-			arrTL = arrTL.getElementLoc().getAs<ArrayTypeLoc>();
-			replace += "]";
 		}
-		    }
-			//If it's a parameter, we want to keep the comma, not replace it with a semiclon
-			if (dyn_cast<ParmVarDecl>(decl) == NULL) replace += ";";
-	    		if ((tempLoc = Lexer::findLocationAfterToken(end, tok::semi, *SM, *LO, false)).isValid()) {
-				//found a semicolon, replace the endLoc with the semicolon's loc
-			end = tempLoc;
-	    		} else {
-				//we only want to insert a newline for DeclGroups, which will necessarily not have a semicolon on any but the last member
-				if (dyn_cast<ParmVarDecl>(decl) == NULL) replace += "\n";
+	}
+
+	bool needsTranslation(const std::string &path) {
+		if (Failed || scanText(Macros, StringRef())) return true;
+		for (std::vector<std::string>::iterator i = ForcedIncludes.begin(), e = ForcedIncludes.end(); i != e; i++) {
+			if (scanFile(*i)) return true;
+		}
+		return scanFile(path);
+	}
+
+	//Whether path, or anything it quote-#includes, is one of files
+	bool reaches(const std::set<llvm::sys::fs::UniqueID> &files) {
+		for (std::set<llvm::sys::fs::UniqueID>::iterator i = Scanned.begin(), e = Scanned.end(); i != e; i++) {
+			if (files.count(*i)) return true;
+		}
+		return false;
+	}
+
+	//Every quote #include in the files scanned, for copying them with the #includes renamed
+	const std::vector<QuoteInclude> &quoteIncludes() const {
+		return Includes;
+	}
+
+private:
+	void addDir(std::vector<std::string> &dirs, StringRef base, StringRef dir) {
+		if (is_absolute(dir)) {
+			dirs.push_back(dir);
+			return;
+		}
+		SmallString<128> path(base);
+		append(path, dir);
+		dirs.push_back(path.str());
+	}
+
+	bool scanFile(const std::string &path) {
+		//In-memory sources are left to the parser
+		if (Session->VirtualFiles.count(path)) return true;
+		llvm::sys::fs::UniqueID id;
+		if (llvm::sys::fs::getUniqueID(path, id)) return true;
+		//Files already scanned were clean, or the scan would have stopped
+		if (!Scanned.insert(id).second) return false;
+		OwningPtr<llvm::MemoryBuffer> buf;
+		if (llvm::MemoryBuffer::getFile(path, buf)) return true;
+		return scanText(buf->getBuffer(), path);
+	}
+
+	//text must be null-terminated, as the Lexer expects, file is where it came from if it's a file
+	bool scanText(StringRef text, StringRef file) {
+		Lexer L(SourceLocation(), LO, text.begin(), text.begin(), text.end());
+		Token tok;
+		bool cuName = false;
+		for (L.LexFromRawLexer(tok); tok.isNot(tok::eof); L.LexFromRawLexer(tok)) {
+			//A cu* name followed by a paren is a call the rewriter would at least comment on
+			if (cuName && tok.is(tok::l_paren)) return true;
+			cuName = false;
+			if (tok.is(tok::lesslessless)) return true;
+			if (tok.is(tok::hash) && tok.isAtStartOfLine()) {
+				L.LexFromRawLexer(tok);
+				if (!tok.is(tok::raw_identifier)) continue;
+				StringRef directive(tok.getRawIdentifierData(), tok.getLength());
+				if ((directive == "include" || directive == "include_next" || directive == "import") && scanInclude(text, L.getBufferLocation(), file)) return true;
+				continue;
 			}
-			
-	        	generateReplacement(GlobalHostReplace, SM, start, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(SM->getExpansionLoc(start), SM->getExpansionLoc(end)))), replace);
-			} else if (FieldDecl * fdecl = dyn_cast<FieldDecl>(decl)) {
-		    if (fdecl->getType()->isArrayType()) {
-			//make sure to grab the array [...] Expr too
-            ArrayTypeLoc arrTL = fdecl->getTypeSourceInfo()->getTypeLoc().getAs<ArrayTypeLoc>();
-		while (!arrTL.isNull()) {
-			replace += "[";
-			if (arrTL.getSizeExpr() != NULL) replace += getStmtText(LO, SM, arrTL.getSizeExpr());
-			arrTL = arrTL.getElementLoc().getAs<ArrayTypeLoc>();
-			replace += "]";
+			if (!tok.is(tok::raw_identifier)) continue;
+			StringRef name(tok.getRawIdentifierData(), tok.getLength());
+			if (isCUDAName(name)) return true;
+			cuName = name.startswith("cu");
 		}
-		    }
-	        		generateReplacement(GlobalHostReplace, SM, start, getRangeSize(*SM, CharSourceRange::getTokenRange(SourceRange(SM->getExpansionLoc(start), SM->getExpansionLoc(end)))), replace);
-				
+		return false;
+	}
 
-			} else {
-				TypeLoc tl = decl->getTypeSourceInfo()->getTypeLoc();
-				SourceRange realRange(tl.getBeginLoc(), Lexer::getLocForEndOfToken(tl.getBeginLoc(), 0, *SM, *LO));
-	        		generateReplacement(GlobalHostReplace, SM, tl.getBeginLoc(), getRangeSize(*SM, CharSourceRange::getTokenRange(tl.getLocalSourceRange())), "cl_mem");
-    			}
+	//Check the #include whose file name starts at pos in file's text
+	bool scanInclude(StringRef text, const char *pos, StringRef file) {
+		const char *end = text.end();
+		for (; pos != end && (*pos == ' ' || *pos == '\t'); pos++);
+		if (pos == end || (*pos != '"' && *pos != '<')) return true;
+		char close = (*pos == '"' ? '"' : '>');
+		const char *nameEnd = pos + 1;
+		for (; nameEnd != end && *nameEnd != close && *nameEnd != '\n'; nameEnd++);
+		if (nameEnd == end || *nameEnd != close) return true;
+		StringRef name(pos + 1, nameEnd - pos - 1);
+		StringRef ext = extension(name), base = filename(name);
+		if (ext == ".cu" || ext == ".cuh" || base == "cuda.h" || base == "cuda_runtime.h" || base == "cuda_runtime_api.h" || base == "cuda_gl_interop.h" || base == "cutil.h" || base == "cutil_inline.h" || base == "cutil_gl_inline.h" || base == "vector_types.h") return true;
+		std::string path;
+		//Angle #includes are never translated themselves, but the project's own can still declare CUDA types
+		//Ones outside the -I and -isystem directories are system headers, where only CUDA's own would
+		if (close == '>') return findInclude(name, false, StringRef(), path) && scanFile(path);
+		if (!findInclude(name, true, parent_path(file), path)) return true;
+		//Remember where the file name is, RewriteInclude renames just that part
+		if (!file.empty()) {
+			QuoteInclude inc = {file, path, base, (unsigned)(base.begin() - text.begin())};
+			Includes.push_back(inc);
+		}
+		return scanFile(path);
+	}
+
+	//Quote #includes search dir, then the -iquote directories, before the -I and then -isystem ones
+	bool findInclude(StringRef name, bool quoted, StringRef dir, std::string &path) {
+		if (is_absolute(name)) {
+			path = name;
+			return llvm::sys::fs::exists(path);
+		}
+		std::vector<std::string> dirs;
+		if (quoted) {
+			dirs.push_back(dir);
+			dirs.insert(dirs.end(), QuoteDirs.begin(), QuoteDirs.end());
+		}
+		dirs.insert(dirs.end(), IncludeDirs.begin(), IncludeDirs.end());
+		dirs.insert(dirs.end(), SystemDirs.begin(), SystemDirs.end());
+		for (std::vector<std::string>::iterator i = dirs.begin(), e = dirs.end(); i != e; i++) {
+			SmallString<128> candidate(*i);
+			append(candidate, name);
+			if (llvm::sys::fs::exists(candidate.str())) {
+				path = candidate.str();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool isCUDAName(StringRef name) {
+		static const char *Names[] = {"__global__", "__device__", "__host__", "__shared__", "__constant__", "__launch_bounds__",
+			"threadIdx", "blockIdx", "blockDim", "gridDim", "warpSize", "dim3", "uint3", "texture", "main"};
+		for (unsigned i = 0; i < sizeof(Names) / sizeof(Names[0]); i++) {
+			if (name == Names[i]) return true;
+		}
+		return name.startswith("cuda") || !RewriteVectorType(name, false).empty();
+	}
+
+	LangOptions LO;
+	bool Failed;
+	std::string Macros;
+	std::vector<std::string> QuoteDirs, IncludeDirs, SystemDirs, ForcedIncludes;
+	std::set<llvm::sys::fs::UniqueID> Scanned;
+	std::vector<QuoteInclude> Includes;
+};
+
+//A TU for a file the pre-scan found no CUDA in: its host output, named the way the CompilerInstance
+// would name it, is a plain copy, and it has no kernel output
+TUContributions *createCopiedTU(const std::string &source) {
+	std::string path = getAbsolutePath(source);
+	size_t dotPos = path.rfind('.');
+	TUContributions *TUC = new TUContributions();
+	TUC->MainFile = source;
+	TUC->Copied = true;
+	claimOutputFile(path);
+	TUC->OutFiles[path] = createOutputFileFor(kernelNameFilter(path) + "-cl" + (dotPos == std::string::npos ? "" : path.substr(dotPos)), "cpp");
+	return TUC;
+}
+
+//Point a copied file's quote #includes at the *-cl.h copies of their headers, the way RewriteInclude
+// would, and make those copies for the headers no other TU wrote an output for. Done once every
+// translated TU is merged, so a copied file never takes a header (and its *-cl.cl) from one
+void copyQuoteIncludes(TUContributions *TUC, const CUDAPreScanner *scan) {
+	std::set<llvm::sys::fs::UniqueID> written;
+	for (IDOutFileMap::iterator o = Session->OutFiles.begin(), oe = Session->OutFiles.end(); o != oe; o++) {
+		llvm::sys::fs::UniqueID id;
+		if (!llvm::sys::fs::getUniqueID(o->first, id)) written.insert(id);
+	}
+	//Only the files this TU writes out are renamed in, the others' #includes are their writers' business
+	std::set<std::string> ours;
+	for (IDOutFileMap::iterator o = TUC->OutFiles.begin(), oe = TUC->OutFiles.end(); o != oe; o++) ours.insert(o->first);
+	const std::vector<CUDAPreScanner::QuoteInclude> &includes = scan->quoteIncludes();
+	for (std::vector<CUDAPreScanner::QuoteInclude>::const_iterator i = includes.begin(), e = includes.end(); i != e; i++) {
+		llvm::sys::fs::UniqueID id;
+		if (ours.count(i->Header) || llvm::sys::fs::getUniqueID(i->Header, id) || !written.insert(id).second || !claimOutputFile(i->Header)) continue;
+		size_t dotPos = i->Header.rfind('.');
+		TUC->OutFiles[i->Header] = createOutputFileFor(kernelNameFilter(i->Header) + "-cl" + (dotPos == std::string::npos ? "" : i->Header.substr(dotPos)), "h");
+		ours.insert(i->Header);
+	}
+	for (std::vector<CUDAPreScanner::QuoteInclude>::const_iterator i = includes.begin(), e = includes.end(); i != e; i++) {
+		if (ours.count(i->File)) TUC->GlobalHostReplace.push_back(Replacement(i->File, i->Offset, i->Name.size(), kernelNameFilter(i->Name) + "-cl.h"));
+	}
+}
+
+//Serve the session's in-memory sources to a tool in place of the disk
+void mapVirtualFiles(ClangTool &tool) {
+	for (std::map<std::string, std::string>::iterator i = Session->VirtualFiles.begin(), e = Session->VirtualFiles.end(); i != e; i++) {
+		tool.mapVirtualFile(i->first, i->second);
+	}
+}
 
+//Translate the source files with jobs worker threads, each running its own ClangTool
+// over one file at a time. Every file gets its own slot so the results can be merged
+// in command-line order no matter which worker finishes first
+//Slots that are already filled (from the translation cache) are skipped
+int runConcurrentTranslation(const CompilationDatabase &Compilations, const std::vector<std::string> &Sources, const std::string &embeddedArgs, unsigned jobs, std::vector<std::vector<TUContributions *> > &slots) {
+	slots.resize(Sources.size());
+	std::atomic<unsigned> next(0);
+	std::atomic<int> result(0);
+	//Make LLVM's lazily-initialized statics safe to touch from several threads
+	llvm::llvm_start_multithreaded();
+
+	//Workers start without a session of their own, hand them this thread's
+	SessionState *session = Session;
+	std::vector<std::thread> workers;
+	for (unsigned j = 0; j < jobs && j < Sources.size(); j++) {
+		workers.push_back(std::thread([&]() {
+			Session = session;
+			for (unsigned i = next++; i < Sources.size(); i = next++) {
+				if (!slots[i].empty()) continue;
+				ClangTool tool(Compilations, Sources[i]);
+				mapVirtualFiles(tool);
+				tool.appendArgumentsAdjuster(new AppendAdjuster(embeddedArgs.c_str()));
+				RewriteCUDAActionFactory factory(&slots[i]);
+				if (tool.run(&factory) != 0) result = 1;
+			}
+		}));
+	}
+	for (std::vector<std::thread>::iterator w = workers.begin(); w != workers.end(); w++) w->join();
+	return result;
 }
 
-//return true iff child is a descendant of ancestor (or child == ancestor)
-bool isAncestor(Stmt * ancestor, Stmt * child) {
-	if (ancestor == child) return true;
-	//else if (ancestor->child_begin() != ancestor->child_end()) {
-		for (Stmt::child_iterator citr = ancestor->child_begin(); citr != ancestor->child_end(); citr++){
-			if (isAncestor(*citr, child)) return true;
+//Merge the TUs of the files the pre-scan copied through, after all the translated ones are merged
+//A copied file still has to be translated if cl_mem propagation reaches a declaration in it or in
+// a header it #includes, since it may define a function another TU rewrites the parameters of. Each
+// round of such translations can reach further copied files, so this repeats until none are left
+int mergeCopiedTUs(const CompilationDatabase &Compilations, const std::vector<std::string> &Sources, const std::string &embeddedArgs, const std::vector<std::string> &cacheKeys, std::vector<CUDAPreScanner *> &scans, std::vector<std::vector<TUContributions *> > &slots) {
+	int result = 0;
+	std::vector<unsigned> pending;
+	for (unsigned i = 0; i < scans.size(); i++) {
+		if (scans[i]) pending.push_back(i);
+	}
+	while (!pending.empty()) {
+		PhaseTimer propTimer(Session->ToolTimes, Phase_Propagation);
+		for (std::vector<DeclLocKey>::iterator d = Session->DeclsToTranslate.begin(), e = Session->DeclsToTranslate.end(); d != e; d++) Session->PropGraph.flag(*d);
+		Session->PropGraph.solve();
+		std::set<unsigned> fileNums;
+		Session->PropGraph.getFlaggedFiles(fileNums);
+		std::set<llvm::sys::fs::UniqueID> flaggedFiles;
+		for (std::set<unsigned>::iterator n = fileNums.begin(), e = fileNums.end(); n != e; n++) {
+			llvm::sys::fs::UniqueID id;
+			if (*n != 0 && !llvm::sys::fs::getUniqueID(internedFileName(*n), id)) flaggedFiles.insert(id);
 		}
-		return false;
-		
-	//}
+		propTimer.stop();
+		std::vector<unsigned> retry, rest;
+		std::vector<std::string> retrySources;
+		for (std::vector<unsigned>::iterator p = pending.begin(), e = pending.end(); p != e; p++) {
+			if (!scans[*p]->reaches(flaggedFiles)) {
+				rest.push_back(*p);
+				continue;
+			}
+			//Throw the copy away, the translation replaces it
+			for (std::vector<TUContributions *>::iterator j = slots[*p].begin(), f = slots[*p].end(); j != f; j++) {
+				for (IDOutFileMap::iterator o = (*j)->OutFiles.begin(), oe = (*j)->OutFiles.end(); o != oe; o++) discardOutputFile(o->second);
+				delete (*j);
+			}
+			slots[*p].clear();
+			retry.push_back(*p);
+			retrySources.push_back(Sources[*p]);
+		}
+		if (retry.empty()) break;
+		llvm::errs() << "Translating " << retry.size() << " files the pre-scan copied, cl_mem propagation reaches into them\n";
+		std::vector<std::vector<TUContributions *> > retrySlots;
+		if (runConcurrentTranslation(Compilations, retrySources, embeddedArgs, Session->NumJobs, retrySlots) != 0) result = 1;
+		for (unsigned i = 0; i < retry.size(); i++) {
+			if (retry[i] < cacheKeys.size() && !cacheKeys[retry[i]].empty()) storeCacheEntry(cacheKeys[retry[i]], retrySlots[i]);
+			for (std::vector<TUContributions *>::iterator j = retrySlots[i].begin(), f = retrySlots[i].end(); j != f; j++) {
+				mergeTUContributions(*j);
+				delete (*j);
+			}
+		}
+		pending.swap(rest);
+	}
+	//The rest really are plain copies
+	for (std::vector<unsigned>::iterator p = pending.begin(), e = pending.end(); p != e; p++) {
+		for (std::vector<TUContributions *>::iterator j = slots[*p].begin(), f = slots[*p].end(); j != f; j++) {
+			copyQuoteIncludes(*j, scans[*p]);
+			mergeTUContributions(*j);
+			delete (*j);
+		}
+	}
+	for (std::vector<CUDAPreScanner *>::iterator s = scans.begin(), e = scans.end(); s != e; s++) delete (*s);
+	return result;
 }
 
-int main(int argc, const char ** argv) {
-	
-	//Before we do anything, parse off common arguments, a la MPI
-	CommonOptionsParser options(argc, argv);
+//Everything cu2cl-tool's main used to do, short of parsing the command line and writing the outputs out
+int runTranslation(const CompilationDatabase &Compilations, const std::vector<std::string> &Sources) {
+	uint64_t RunStart = wallMicros();
+	if (Session->ReportTimes && Session->TimeReportFormat != "" && Session->TimeReportFormat != "json") {
+	    llvm::errs() << "Unknown --time-report format [" << Session->TimeReportFormat << "], printing it as text\n";
+	    Session->TimeReportFormat = "";
+	}
 
 	//create a ClangTool instance
-	RefactoringTool cu2cl(options.getCompilations(), options.getSourcePathList());
+	RefactoringTool cu2cl(Compilations, Sources);
+	mapVirtualFiles(cu2cl);
 
 	//Inject extra default arguments
 	//These are needed to override parsing of some CUDA headers Clang doesn't like
 	// and putting them here removes the need to put them on every call or in a static compilation database
-	//std::string embeddedArgs = "-disable-free -D CUDA_SAFE_CALL(X)=X -D __CUDACC__ -D __SM_32_INTRINSICS_H__ -D __SM_35_INTRINSICS_H__ -D __SURFACE_INDIRECT_FUNCTIONS_H__";
-	std::string embeddedArgs = "-disable-free -D CUDA_SAFE_CALL(X)=X -D __CUDACC__ -D __SM_32_INTRINSICS_H__ -D __SM_35_INTRINSICS_H__ -D __SURFACE_INDIRECT_FUNCTIONS_H__ -include cuda_runtime.h";
+	//No "-disable-free": each TU's AST and SourceManager are released as soon as it finishes
+	//std::string embeddedArgs = "-D CUDA_SAFE_CALL(X)=X -D __CUDACC__ -D __SM_32_INTRINSICS_H__ -D __SM_35_INTRINSICS_H__ -D __SURFACE_INDIRECT_FUNCTIONS_H__";
+	std::string embeddedArgs = "-D CUDA_SAFE_CALL(X)=X -D __CUDACC__ -D __SM_32_INTRINSICS_H__ -D __SM_35_INTRINSICS_H__ -D __SURFACE_INDIRECT_FUNCTIONS_H__ -include cuda_runtime.h";
       
 	//TODO: Add a verbose diagnostic function specifying the status of all options 
-	if (AddInlineComments) llvm::errs() << "Commenting is enabled\n";
+	if (Session->AddInlineComments) llvm::errs() << "Commenting is enabled\n";
 	else llvm::errs() << "Commenting is disabled\n";
-	llvm::errs() << "clBuild arguments appended: " << ExtraBuildArgs << "\n";
-	if (FilterKernelName) llvm::errs() << "Name filtering is enabled\n";
+	llvm::errs() << "clBuild arguments appended: " << Session->ExtraBuildArgs << "\n";
+	if (Session->FilterKernelName) llvm::errs() << "Name filtering is enabled\n";
 	else llvm::errs() << "Name filtering is disabled\n";
-
-	if (UseGCCPaths) {
+	if (!Session->BinaryCacheDir.empty()) llvm::errs() << "OpenCL program binaries will be cached in " << Session->BinaryCacheDir << "\n";
+	if (Session->EmbedKernels) llvm::errs() << "Kernel sources will be embedded in cu2cl_kernels.c\n";
+	//Clang 3.4 has no OpenCL builtins header of its own, without one no kernel that calls a built-in compiles
+	if (Session->PrecompileKernels && !hasIncludeArg(Session->PrecompileArgs)) {
+	    llvm::errs() << "Kernels will not be precompiled: '--precompile-kernels' needs an OpenCL builtins header, e.g. --precompile-kernels=\"-include <libclc>/include/clc/clc.h -I <libclc>/include\"\n";
+	    Session->PrecompileKernels = false;
+	}
+	if (Session->PrecompileKernels) llvm::errs() << "Kernels will be precompiled to SPIR\n";
+	if (Session->MemoryPoolMB != 0) llvm::errs() << "Device allocations will be pooled, caching up to " << Session->MemoryPoolMB << " MiB\n";
+	if (Session->LazyInit) llvm::errs() << "OpenCL programs and kernels will be created on first launch\n";
+	else if (Session->ConcurrentBuilds) llvm::errs() << "OpenCL programs will be built concurrently\n";
+	if (Session->UsePreludePCH) llvm::errs() << "Prelude precompilation is enabled\n";
+	else llvm::errs() << "Prelude precompilation is disabled\n";
+
+	if (Session->UseGCCPaths) {
 	    llvm::errs() << "GCC include directory import is enabled\n";
 	    //logic to spawn a "gcc -v foo.c" proc and parse search path(s)
 	    embeddedArgs += parseGCCPaths();
@@ -4101,69 +5993,189 @@ int main(int argc, const char ** argv) {
 	//Boilerplate generation has to start before the tool runs, so the tool
 	// instances can contribute their local init calls to it
 	//Construct OpenCL initialization boilerplate
-        CU2CLInit += "void __cu2cl_Init() {\n";
-	GlobalCDecls["cu2cl_util.c"].push_back("const char *progSrc;\n");
-	GlobalCDecls["cu2cl_util.c"].push_back("size_t progLen;\n\n");
+        Session->CU2CLInit += "void __cu2cl_Init() {\n";
+	Session->GlobalCDecls["cu2cl_util.c"].push_back("const char *progSrc;\n");
+	Session->GlobalCDecls["cu2cl_util.c"].push_back("size_t progLen;\n\n");
         //Rather than obviating these lines to support cudaSetDevice, we'll assume these lines
         // are *always* included, and IFF cudaSetDevice is used, include code to instead scan
         // *all* devices, and allow for reinitialization
-        CU2CLInit += "    clGetPlatformIDs(1, &__cu2cl_Platform, NULL);\n";
-        CU2CLInit += "    clGetDeviceIDs(__cu2cl_Platform, CL_DEVICE_TYPE_ALL, 1, &__cu2cl_Device, NULL);\n";
-        CU2CLInit += "    __cu2cl_Context = clCreateContext(NULL, 1, &__cu2cl_Device, NULL, NULL, NULL);\n";
-        CU2CLInit += "    __cu2cl_CommandQueue = clCreateCommandQueue(__cu2cl_Context, __cu2cl_Device, CL_QUEUE_PROFILING_ENABLE, NULL);\n";
+        Session->CU2CLInit += "    clGetPlatformIDs(1, &__cu2cl_Platform, NULL);\n";
+        Session->CU2CLInit += "    clGetDeviceIDs(__cu2cl_Platform, CL_DEVICE_TYPE_ALL, 1, &__cu2cl_Device, NULL);\n";
+        Session->CU2CLInit += "    __cu2cl_Context = clCreateContext(NULL, 1, &__cu2cl_Device, NULL, NULL, NULL);\n";
+        Session->CU2CLInit += "    __cu2cl_CommandQueue = clCreateCommandQueue(__cu2cl_Context, __cu2cl_Device, CL_QUEUE_PROFILING_ENABLE, NULL);\n";
 
 	//Construct OpenCL cleanup boilerplate (bottom first, decl after tool contributes prog/kernl cleanup calls)
 	//BOIL: global cleanup
-        CU2CLClean += "    clReleaseCommandQueue(__cu2cl_CommandQueue);\n";
-        CU2CLClean += "    clReleaseContext(__cu2cl_Context);\n";
-	CU2CLClean += "}\n";
+        if (Session->MemoryPoolMB != 0) Session->CU2CLClean += "    __cu2cl_TrimPool();\n";
+        Session->CU2CLClean += "    clReleaseCommandQueue(__cu2cl_CommandQueue);\n";
+        Session->CU2CLClean += "    clReleaseContext(__cu2cl_Context);\n";
+	Session->CU2CLClean += "}\n";
 
 	//run the tool (for now, just use the PluginASTAction from original CU2CL
-	int result = cu2cl.run(newFrontendActionFactory<RewriteCUDAAction>());
+	//Each TU's contributions are kept apart until all of them are done, then merged in command-line order
+	std::vector<std::vector<TUContributions *> > TUSlots;
+	int result = 0;
+	std::vector<std::string> CacheKeys;
+	//Non-NULL for the files the pre-scan copied through, holding what it scanned of them
+	std::vector<CUDAPreScanner *> PreScans;
+	if (Session->MergeSummaries) {
+	    //Nothing gets parsed, each input is a summary written by an '--emit-summary' run
+	    TUSlots.resize(Sources.size());
+	    for (unsigned i = 0; i < Sources.size() && result == 0; i++) {
+		if (!readSummary(Sources[i], TUSlots[i], i == 0)) result = 1;
+	    }
+	    if (result != 0) {
+		discardContributions(TUSlots);
+		return result;
+	    }
+	    llvm::errs() << "Merging " << Sources.size() << " summaries, using the options they were written with\n";
+	} else {
+	    if (Session->NumJobs == 0) Session->NumJobs = std::max(1u, std::thread::hardware_concurrency());
+	    if (Session->NumJobs > 1 && !sharesWorkingDirectory(Compilations, Sources)) {
+		llvm::errs() << "Compile commands use different working directories, ignoring -j " << Session->NumJobs << " and translating serially\n";
+		Session->NumJobs = 1;
+	    }
+	    //Replay every source file with a valid cache entry, so only the rest get parsed
+	    std::vector<bool> CacheHits;
+	    if (!Session->CacheDir.empty()) {
+		//The tool changes directory as it runs, so pin the cache down first
+		SmallString<128> dir(Session->CacheDir);
+		llvm::sys::fs::make_absolute(dir);
+		Session->CacheDir = dir.str();
+		bool existed;
+		if (llvm::sys::fs::create_directories(Session->CacheDir, existed)) llvm::errs() << "Unable to create translation cache directory [" << Session->CacheDir << "]\n";
+		TUSlots.resize(Sources.size());
+		CacheKeys.resize(Sources.size());
+		CacheHits.resize(Sources.size(), false);
+		unsigned hits = 0;
+		for (unsigned i = 0; i < Sources.size(); i++) {
+		    CacheKeys[i] = getCacheKey(Compilations, Sources[i], embeddedArgs);
+		    if (!CacheKeys[i].empty() && loadCacheEntry(CacheKeys[i], TUSlots[i])) {
+			CacheHits[i] = true;
+			hits++;
+			for (std::vector<TUContributions *>::iterator j = TUSlots[i].begin(), e = TUSlots[i].end(); j != e; j++) {
+			    (*j)->MainFile = Sources[i];
+			    (*j)->FromCache = true;
+			}
+		    }
+		}
+		llvm::errs() << "Reusing " << hits << " of " << Sources.size() << " translated files from " << Session->CacheDir << "\n";
+	    }
+	    //Copy through every other file the lexer finds no CUDA in, without parsing it
+	    //Summaries are merged without knowing what propagation will reach, so they translate everything
+	    unsigned copies = 0;
+	    if (Session->UsePreScan && Session->SummaryFile.empty()) {
+		PhaseTimer preScanTimer(Session->ToolTimes, Phase_PreScan);
+		TUSlots.resize(Sources.size());
+		PreScans.resize(Sources.size(), NULL);
+		for (unsigned i = 0; i < Sources.size(); i++) {
+		    if (!TUSlots[i].empty()) continue;
+		    std::string path = getAbsolutePath(Sources[i]);
+		    CUDAPreScanner *scan = new CUDAPreScanner(Compilations.getCompileCommands(path));
+		    if (scan->needsTranslation(path)) {
+			delete scan;
+			continue;
+		    }
+		    PreScans[i] = scan;
+		    TUSlots[i].push_back(createCopiedTU(Sources[i]));
+		    copies++;
+		}
+		preScanTimer.stop();
+		llvm::errs() << "Pre-scan found no CUDA in " << copies << " of " << Sources.size() << " files, copying them without parsing\n";
+	    }
+	    //Cached and copied runs need a slot per source file, which only the per-file path provides
+	    if ((Session->NumJobs > 1 && Sources.size() > 1) || !Session->CacheDir.empty() || copies > 0) {
+		llvm::errs() << "Translating " << Sources.size() << " files with " << Session->NumJobs << " jobs\n";
+		result = runConcurrentTranslation(Compilations, Sources, embeddedArgs, Session->NumJobs, TUSlots);
+	    } else {
+		TUSlots.resize(1);
+		RewriteCUDAActionFactory factory(&TUSlots[0]);
+		result = cu2cl.run(&factory);
+	    }
+	    for (unsigned i = 0; i < CacheKeys.size(); i++) {
+		if (!CacheHits[i] && !CacheKeys[i].empty()) storeCacheEntry(CacheKeys[i], TUSlots[i]);
+	    }
+	}
+	if (!Session->SummaryFile.empty()) {
+	    //Everything the merge needs is in the summary, so this run's own output is thrown away
+	    if (!writeSummary(Session->SummaryFile, TUSlots)) {
+		llvm::errs() << "Unable to write summary [" << Session->SummaryFile << "]\n";
+		result = 1;
+	    } else llvm::errs() << "Wrote summary of " << Sources.size() << " files to " << Session->SummaryFile << "\n";
+	    discardContributions(TUSlots);
+	    removePreludeDir();
+	    if (Session->ReportTimes) printTimeReport(wallMicros() - RunStart);
+	    return result;
+	}
+	for (unsigned i = 0; i < TUSlots.size(); i++) {
+	    //Copied files wait until it's known whether cl_mem propagation reaches into them
+	    if (i < PreScans.size() && PreScans[i]) continue;
+	    for (std::vector<TUContributions *>::iterator j = TUSlots[i].begin(), f = TUSlots[i].end(); j != f; j++) {
+		mergeTUContributions(*j);
+		delete (*j);
+	    }
+	}
+	if (mergeCopiedTUs(Compilations, Sources, embeddedArgs, CacheKeys, PreScans, TUSlots) != 0) result = 1;
 
 	//After the toos runs, don't forget to re-initialize the comment buffer, in case we need to emit any diagnostics
-	head = (struct commentBufferNode *)malloc(sizeof(struct commentBufferNode));
-	head->n = NULL;
-    	tail = head;
+	CommentBuffer ToolComments;
+	PendingComments = &ToolComments;
 	
 
 	//After the tools run, we can finalize the global boilerplate
 	//If __cu2cl_setDevice is used, we need to initialize the scan variables
-	if(UsesCUDASetDevice) {    
-		CU2CLInit += "    __cu2cl_AllDevices_size = 0;\n";
-		CU2CLInit += "    __cu2cl_AllDevices_curr_idx = 0;\n";
-		CU2CLInit += "    __cu2cl_AllDevices = NULL;\n";
+	if(Session->UsesCUDASetDevice) {    
+		Session->CU2CLInit += "    __cu2cl_AllDevices_size = 0;\n";
+		Session->CU2CLInit += "    __cu2cl_AllDevices_curr_idx = 0;\n";
+		Session->CU2CLInit += "    __cu2cl_AllDevices = NULL;\n";
+	}
+	//Programs are built through the binary cache, which defaults to the directory it was translated with
+	if (!Session->BinaryCacheDir.empty()) {
+	    Session->GlobalHDecls.push_back(CL_BUILD_PROGRAM_CACHED_H);
+	    Session->GlobalCFuncs.push_back("#define __cu2cl_BinaryCacheDir " + quoteCString(Session->BinaryCacheDir) + "\n" CL_BUILD_PROGRAM_CACHED);
+	}
+	//cudaMalloc/cudaFree go through the pool, whose limit can also be set when cu2cl_util.c is compiled
+	if (Session->MemoryPoolMB != 0) {
+	    std::stringstream limit;
+	    limit << "#ifndef __cu2cl_PoolLimit\n#define __cu2cl_PoolLimit ((size_t) " << Session->MemoryPoolMB << " << 20)\n#endif\n";
+	    Session->GlobalHDecls.push_back(CL_MEMORY_POOL_H);
+	    Session->GlobalCFuncs.push_back(limit.str() + CL_MEMORY_POOL);
+	}
+	if (Session->PrecompileKernels) {
+	    Session->GlobalHDecls.push_back(CL_BUILD_PROGRAM_SPIR_H);
+	    Session->GlobalCFuncs.push_back(CL_BUILD_PROGRAM_SPIR);
 	}
 	//If we need to make use of any custom kernels generated in cu2cl_util.cl
-	if (UsesCU2CLUtilCL) {
+	if (Session->UsesCU2CLUtilCL) {
 	    //Declare and build the __cu2cl_Util_Program 
-            GlobalCDecls["cu2cl_util.c"].push_back("cl_program __cu2cl_Util_Program;\n");
-	    CU2CLInit += "    #ifdef WITH_ALTERA\n";
-	    CU2CLInit += "    progLen = __cu2cl_LoadProgramSource(\"cu2cl_util.aocx\", &progSrc);\n";
-	    CU2CLInit += "    __cu2cl_Util_Program = clCreateProgramWithBinary(__cu2cl_Context, 1, &__cu2cl_Device, &progLen, (const unsigned char **)&progSrc, NULL, NULL);\n";
-	    CU2CLInit += "    #else\n";
-            CU2CLInit += "    progLen = __cu2cl_LoadProgramSource(\"cu2cl_util.cl\", &progSrc);\n";
-            CU2CLInit += "    __cu2cl_Util_Program = clCreateProgramWithSource(__cu2cl_Context, 1, &progSrc, &progLen, NULL);\n";
-	    CU2CLInit += "    #endif\n";
-            CU2CLInit += "    free((void *) progSrc);\n";
-            CU2CLInit += "    clBuildProgram(__cu2cl_Util_Program, 1, &__cu2cl_Device, \"-I . ";
-		CU2CLInit += ExtraBuildArgs;
-		CU2CLInit += "\", NULL, NULL);\n";
+            Session->GlobalCDecls["cu2cl_util.c"].push_back("cl_program __cu2cl_Util_Program;\n");
+	    Session->CU2CLInit += generateProgramBuild("__cu2cl_Util_Program", "cu2cl_util.aocx", "cu2cl_util.cl", "cu2cl_util");
+	    if (Session->EmbedKernels) Session->GlobalHDecls.push_back(embeddedSourceDecl("cu2cl_util"));
+	    if (Session->EmbedKernels && Session->PrecompileKernels) {
+		Session->GlobalHDecls.push_back(embeddedSourceDecl("cu2cl_util_spir"));
+		Session->GlobalHDecls.push_back(embeddedSourceDecl("cu2cl_util_spir64"));
+	    }
 	    // and initialize all its kernels
-            for (std::vector<std::string>::iterator i = UtilKernels.begin(), e = UtilKernels.end();
+            for (std::vector<std::string>::iterator i = Session->UtilKernels.begin(), e = Session->UtilKernels.end();
                  i != e; i++) {
-                CU2CLInit += "    __cu2cl_Kernel_" + (*i) + " = clCreateKernel(__cu2cl_Util_Program, \"" + (*i) + "\", NULL);\n";
+                Session->CU2CLInit += "    __cu2cl_Kernel_" + (*i) + " = clCreateKernel(__cu2cl_Util_Program, \"" + (*i) + "\", NULL);\n";
             }
 
 	    //Cleanup the kernels and associated program
-            CU2CLClean = "    clReleaseProgram(__cu2cl_Util_Program);\n" + CU2CLClean;
-            for (std::vector<std::string>::iterator i = UtilKernels.begin(), e = UtilKernels.end();
+            Session->CU2CLClean = "    clReleaseProgram(__cu2cl_Util_Program);\n" + Session->CU2CLClean;
+            for (std::vector<std::string>::iterator i = Session->UtilKernels.begin(), e = Session->UtilKernels.end();
                  i != e; i++) {
-                CU2CLClean = "    clReleaseKernel(__cu2cl_Kernel_" + (*i) + ");\n" + CU2CLClean;
+                Session->CU2CLClean = "    clReleaseKernel(__cu2cl_Kernel_" + (*i) + ");\n" + Session->CU2CLClean;
             }
 	} 
-	CU2CLInit += "}\n";
-	CU2CLClean = "void __cu2cl_Cleanup() {\n" + CU2CLClean;
+	//The util program above built while the per-file inits ran, now wait for them
+	if (Session->ConcurrentBuilds && !Session->MergedInitCalls.empty()) {
+	    Session->GlobalHDecls.push_back(CU2CL_CONCURRENT_INIT_H);
+	    Session->GlobalCFuncs.push_back(CU2CL_CONCURRENT_INIT);
+	    Session->CU2CLInit += "    __cu2cl_JoinInits();\n";
+	}
+	Session->CU2CLInit += "}\n";
+	Session->CU2CLClean = "void __cu2cl_Cleanup() {\n" + Session->CU2CLClean;
 
 	//Construct a SourceManager for the rewriters the replacements will be applied to
 	// We use a stripped-down version of the way clang-apply-replacements sets up their SourceManager
@@ -4171,22 +6183,34 @@ int main(int argc, const char ** argv) {
 	DiagnosticsEngine Diagnostics(IntrusiveRefCntPtr<DiagnosticIDs>(new DiagnosticIDs()), DiagOpts.getPtr());
 	FileManager Files((FileSystemOptions()));
 	SourceManager RewriteSM(Diagnostics, Files);
+	for (std::map<std::string, std::string>::iterator i = Session->VirtualFiles.begin(), e = Session->VirtualFiles.end(); i != e; i++) {
+	    const FileEntry *FE = Files.getVirtualFile(i->first, i->second.size(), 0);
+	    RewriteSM.overrideFileContents(FE, llvm::MemoryBuffer::getMemBuffer(i->second, i->first));
+	}
 	//Set up our two rewriters
 	LangOptions LOpts = LangOptions();
 	Rewriter GlobalHostRewrite(RewriteSM, LOpts);
 	Rewriter GlobalKernRewrite(RewriteSM, LOpts);
 	//Generate cu2cl_util.c/h
-	std::string error;
-	raw_ostream * cu2cl_util = new llvm::raw_fd_ostream("cu2cl_util.c", error);
-	raw_ostream * cu2cl_header = new llvm::raw_fd_ostream("cu2cl_util.h", error);
-	raw_ostream * cu2cl_kernel = new llvm::raw_fd_ostream("cu2cl_util.cl", error);
+	OutputFile *UtilOF = new OutputFile("cu2cl_util.c");
+	OutputFile *HeaderOF = new OutputFile("cu2cl_util.h");
+	OutputFile *KernelOF = new OutputFile("cu2cl_util.cl");
+	OutputFile *GlobalsOF = new OutputFile("cu2cl_globals.h");
+	raw_ostream * cu2cl_util = UtilOF->OS;
+	raw_ostream * cu2cl_header = HeaderOF->OS;
+	raw_ostream * cu2cl_kernel = KernelOF->OS;
+	raw_ostream * cu2cl_globals = GlobalsOF->OS;
 	
 	//Add licensing info to all generated files
 	*cu2cl_header << CU2CL_LICENSE;
 	*cu2cl_util << CU2CL_LICENSE;
 	*cu2cl_kernel << CU2CL_LICENSE;
+	*cu2cl_globals << CU2CL_LICENSE;
 
 	//Force cu2cl_util.c to include cu2cl_util.h and it, the other key headers
+	//cu2cl_util.h is guarded, as cu2cl_globals.h pulls it in alongside each file's own include
+	*cu2cl_header << "#ifndef __CU2CL_UTIL_H\n";
+	*cu2cl_header << "#define __CU2CL_UTIL_H\n";
 	*cu2cl_header << "#ifdef __APPLE__\n";
 	*cu2cl_header << "#include <OpenCL/opencl.h>\n";
 	*cu2cl_header << "#else\n";
@@ -4204,283 +6228,78 @@ int main(int argc, const char ** argv) {
 	//After all Source files have been processed, they will have generated all global
 	// information necessary to finalize declarations
 	//Assemble the last remaining declarations
-	GlobalCDecls["cu2cl_util.c"].push_back("cl_platform_id __cu2cl_Platform;\n");
-        GlobalCDecls["cu2cl_util.c"].push_back("cl_device_id __cu2cl_Device;\n");
-        GlobalCDecls["cu2cl_util.c"].push_back("cl_context __cu2cl_Context;\n");
-        GlobalCDecls["cu2cl_util.c"].push_back("cl_command_queue __cu2cl_CommandQueue;\n\n");
-        GlobalCDecls["cu2cl_util.c"].push_back("size_t globalWorkSize[3];\n");
-        GlobalCDecls["cu2cl_util.c"].push_back("size_t localWorkSize[3];\n");
+	Session->GlobalCDecls["cu2cl_util.c"].push_back("cl_platform_id __cu2cl_Platform;\n");
+        Session->GlobalCDecls["cu2cl_util.c"].push_back("cl_device_id __cu2cl_Device;\n");
+        Session->GlobalCDecls["cu2cl_util.c"].push_back("cl_context __cu2cl_Context;\n");
+        Session->GlobalCDecls["cu2cl_util.c"].push_back("cl_command_queue __cu2cl_CommandQueue;\n\n");
+        Session->GlobalCDecls["cu2cl_util.c"].push_back("size_t globalWorkSize[3];\n");
+        Session->GlobalCDecls["cu2cl_util.c"].push_back("size_t localWorkSize[3];\n");
 	
-	//Then iterate over all the pieces and generate the necessary replacements (necessarily O(m*n^2)
-	// where (m is the number of decls in each vector of strings, and n is the number of source files)
-	// the i loop makes sure we generate output for each primary file
-	//  the j loop makes sure we check decls for every file
-	//   the k loop concatenates the vector of strings with the decls in it for each file and applies
-	//   "extern " if they are not for the file the i loop is currently generating output for
-	for (FileStrCacheMap::iterator i = GlobalCDecls.begin(), e = GlobalCDecls.end(); i != e; i++) {
-	    for (FileStrCacheMap:: iterator j = GlobalCDecls.begin(), f = GlobalCDecls.end(); j != f; j++) {
-		std::string rep_str = "";
-		if (i == j) {
-		    //generate non-extern decls
-		    for (std::vector<std::string>::iterator k = (*j).second.begin(), g = (*j).second.end(); k != g; k++) {
-			//glue decl strings together, assuming they're already \n terminated
-			rep_str += (*k);
-		    }
-		} else {
-		    //generate extern decls
-		    for (std::vector<std::string>::iterator k = (*j).second.begin(), g = (*j).second.end(); k != g; k++) {
-			//glue decl strings together, assuming they're already \n terminated
-			rep_str += "extern " + (*k);
-		    }
-		}
-		if ((*i).first == "cu2cl_util.c") {
-		    //just add it to the string that will be pushed to the ostream later;
-		    *cu2cl_util << rep_str;
-		} else {
-		    //Get a fid for the file, if it doesn't exist in the SM, force it
-		    const FileEntry * FE = Files.getFile((*i).first);
-            	    FileID fid = RewriteSM.translateFile(FE);
-		    if (fid.isInvalid()) fid = RewriteSM.createFileID(FE, SourceLocation(), SrcMgr::C_User);
-		    //Get a SourceLocation for the start of the file
-		    SourceLocation Loc = RewriteSM.getLocForStartOfFile(fid);
-		    //generate one big Replacement for all the decls
-		    //and add it to the GlobalHostReplace
-	            generateReplacement(GlobalHostReplace, &RewriteSM, Loc, 0, rep_str);
-		}
+	//Then build the extern declarations of every file's globals once, in cu2cl_globals.h
+	// each file (and cu2cl_util.c) then only needs its own definitions, plus an include of it
+	*cu2cl_globals << "#ifndef __CU2CL_GLOBALS_H\n";
+	*cu2cl_globals << "#define __CU2CL_GLOBALS_H\n";
+	*cu2cl_globals << "#include \"cu2cl_util.h\"\n\n";
+	for (FileStrCacheMap::iterator i = Session->GlobalCDecls.begin(), e = Session->GlobalCDecls.end(); i != e; i++) {
+	    for (std::vector<std::string>::iterator k = (*i).second.begin(), g = (*i).second.end(); k != g; k++) {
+		//decl strings are assumed to already be \n terminated
+		*cu2cl_globals << "extern " + (*k);
+	    }
+	}
+	*cu2cl_globals << "#endif\n";
+	commitOutputFile(GlobalsOF);
+
+	for (FileStrCacheMap::iterator i = Session->GlobalCDecls.begin(), e = Session->GlobalCDecls.end(); i != e; i++) {
+	    std::string rep_str = "#include \"cu2cl_globals.h\"\n";
+	    //generate non-extern decls
+	    for (std::vector<std::string>::iterator k = (*i).second.begin(), g = (*i).second.end(); k != g; k++) {
+		rep_str += (*k);
+	    }
+	    if ((*i).first == "cu2cl_util.c") {
+		//just add it to the string that will be pushed to the ostream later;
+		*cu2cl_util << rep_str;
+	    } else {
+		//Get a fid for the file, if it doesn't exist in the SM, force it
+		const FileEntry * FE = Files.getFile((*i).first);
+		FileID fid = RewriteSM.translateFile(FE);
+		if (fid.isInvalid()) fid = RewriteSM.createFileID(FE, SourceLocation(), SrcMgr::C_User);
+		//Get a SourceLocation for the start of the file
+		SourceLocation Loc = RewriteSM.getLocForStartOfFile(fid);
+		//generate one Replacement for this file's own decls
+		//and add it to the GlobalHostReplace
+		generateReplacement(Session->GlobalHostReplace, &RewriteSM, Loc, 0, rep_str);
 	    }
 	}
 
-	//Process all deferred cl_mem translations iteratively
-	//size_t refcount = 0;
-	//llvm::errs() << "Indexed " << AllDeclRefsByDecl.size() << " Decls,\n";
-	//for (DeclToRefMap::iterator drmt = AllDeclRefsByDecl.begin(); drmt != AllDeclRefsByDecl.end(); drmt++) {
-	//	llvm::errs() << "CU2CL DEBUG: " << (*drmt).second.size() << " references to Decl at " << (*drmt).first << "\n";
-	//	refcount+=(*drmt).second.size();
-	//}
-	//llvm::errs() << "\t bearing " << refcount << " total DeclRefExprs\n";
-
-	//for (CanonicalFuncDeclMap::iterator fdit = AllFuncsByCanon.begin(); fdit != AllFuncsByCanon.end(); fdit++) {
-	//    llvm::errs() << "CU2CL DEBUG: FuncDecl at : " << (*fdit).first << " has " << (*fdit).second.size() << " redeclarations!\n";
-	//    for (std::vector<std::pair<FunctionDecl *, SourceTuple *> >::iterator fitr = (*fdit).second.begin(); fitr != (*fdit).second.end(); fitr++) {
-	//	llvm::errs() << "CU2CL DEBUG: At: " << (*fitr).first->getLocStart().printToString(*(std::get<0>(*(*fitr).second))) << "\n";
-	//    }
-		
-	//}
-	//for (FlaggedDeclVec::iterator ditr = DeclsToTranslate.begin(); ditr != DeclsToTranslate.end(); ditr++) {
-	//Since we are potentially adding things to the back, it is not safe to use an iterator pattern as they are likely invalidated, use count and element access instead
-	int ditr = 0, dend = DeclsToTranslate.size();
-	for (; ditr != dend; ditr++) {
-		//Call the translation function
-		NamedDecl *decl = (DeclsToTranslate[ditr]).first;
-		SourceTuple * ST = (DeclsToTranslate[ditr]).second;
-		replaceVarDecl(dyn_cast<DeclaratorDecl>(decl), ST);
-	    	GlobalHostVecVars.erase(decl->getLocStart());
-
-		//DOWNWARD PROPAGATION
-		//First, create an iterator for all the DeclRefExprs involving this Decl
-		ASTContext * AST = std::get<3>(*ST);
-		std::string declLoc = decl->getLocStart().printToString(*(std::get<0>(*ST)));
-		std::vector<DeclRefExpr *> refs = AllDeclRefsByDecl[declLoc];
-		for (std::vector<DeclRefExpr *>::iterator ref = refs.begin(); ref != refs.end(); ref++) {
-			//Add an early abort if the DeclRefExpr doesn't belong to the exact variable requiring translation
-			//(this happens in DeclGroups, since AllDeclRefsByDecl contains all references to any member of the group.
-			//If multiple members of the group need propagation, they will each get an iteration of this for loop and thus process their respective declrefExprs.)
-			if (decl != (*ref)->getFoundDecl() && decl != (*ref)->getDecl()) {
-				llvm::errs() << "CU2CL DEBUG: Rejected propagation of DeclRefExpr " << (*ref)->getDecl()->getName() << " not matching Decl " << decl->getName() << "\n";
-				continue;
-
-			}
-
-			//For each, iterate upwards to the nearest Stmt ancestor
-			//TODO This type changes to DynTypedNodeList in a future version of Clang
-			ASTContext::ParentVector parents = AST->getParents(*(dyn_cast<Stmt>(*ref)));
-			//The above should give us *all* the ancestors, look backwards until the next parent is a Stmt but not an Expr
-			ASTContext::ParentVector::iterator pitr;
-			Expr * ancestor;
-			for (pitr = parents.begin(); pitr != parents.end(); parents = AST->getParents(*pitr), pitr = parents.begin()) {
-				const Stmt * stmt = ((pitr)->get<Stmt>());
-				if (stmt != NULL) {
-					const Expr * expr = dyn_cast<Expr>(stmt) ;
-					if (expr  == NULL) {
-						//That means this ancestor is a statement, we should go no further
-						break;
-					} else if ( dyn_cast<CallExpr>(stmt)) {
-						//If it's a CallExpr, we only want the innermost, so update the ancestor and abort
-						ancestor = (Expr *) expr;
-						break;
-					} else {
-						//We haven't hit a maximal ancestor, update and keep iterating
-						ancestor = (Expr *) expr;
-					}
-				}	
-			}
-			
-			if (CallExpr * call = dyn_cast<CallExpr>(ancestor)) {
-				//If it's a parameter to a CUDAKernelCallExpr, we obviously don't want to translate it, as it'll already be removed from the host
-				if (dyn_cast<CUDAKernelCallExpr>(call)) {
-					continue;
-				}
-			//TODO: Abort if for some reason it's a function we shouldn't translate - i.e. if it's a CUDA runtime function, we need to detect which one, and perform the appropriate translation as if it were in the per-AST portion...
-				//Ensure the parameter of the function we are translating is added to the list IFF it isn't already in there
-				//Figure out which parameter of the function we are supplying the reference to
-				//Iterate over all arguments
-				unsigned int argNum = 0;
-				for (CallExpr::arg_iterator aitr = call->arg_begin(); aitr != call->arg_end(); aitr = aitr+1) {
-					//when we find the one that has the DeclRefExpr we're working on, record its position and abort the loop
-					if (isAncestor(*aitr, *ref)) break;
-					argNum++;
-				}
-				
-				//Check if that parameter is already marked for translation
-				//get the FuncDecl (and definition, if it exists)
-				FunctionDecl * func = call->getDirectCallee();
-				if (func) {
-					
-					if (func->getNameAsString().find("cu") == 0) {
-						llvm::errs() << "CU2CL DEBUG: Skipping propagated CallExpr translation on CUDA function: " << func->getNameAsString() << "!\n";
-					} else {
-						ParmVarDecl * parm = func->getParamDecl(argNum);
-						if (parm) {
-							//If it's not already marked for translation
-							
-							if (!hasFlaggedDecl(&DeclsToTranslate, parm)) {
-								//Add it to the list
-								DeclsToTranslate.push_back(std::pair<NamedDecl*, SourceTuple*>((dyn_cast<NamedDecl>(parm)), ST));
-							} else {
-								//TODO Any logic for already-flagged variables?
-							}
-						}
-
-					}
-				//If for some reason we can't get the FuncDecl directly, just dump some debug notes
-				} else {
-					llvm::errs() << "CU2CL DEBUG: No direct callee to CallExpr marked for propagation: " << getStmtText(std::get<2>(*ST), std::get<0>(*ST), call) << "\n";
-//					(call->getCallee())->dump(llvm::errs(), *(std::get<0>(*ST)));
-	//				llvm::errs() << "\n";
-				}
-			} else {
-				llvm::errs() << "CU2CL DEBUG: Unpropagated cl_mem AST ancestor for reference: "<< getStmtText(std::get<2>(*ST), std::get<0>(*ST), *ref) << "\n";
-	//			ancestor->dump(llvm::errs(), *(std::get<0>(*ST)));
-	//			llvm::errs() << "\n";
-			}
-		}
-		
-
-		//HORIZONTAL AND UPWARDS PROPAGATION
-		//IFF the Decl is a ParmVarDecl, we need to check all calls of the function it is a parameter to
-		if (ParmVarDecl * parm =dyn_cast<ParmVarDecl>(decl)) {
-			ASTContext::ParentVector parents = AST->getParents(*(parm));
-			//The above should give us *all* the ancestors, look backwards until the next parent is a Stmt but not an Expr
-			ASTContext::ParentVector::iterator pitr;
-			FunctionDecl * func;
-			for (pitr = parents.begin(); pitr != parents.end(); parents = AST->getParents(*pitr), pitr = parents.begin()) {
-				const Decl * decl = ((pitr)->get<Decl>());
-				if (decl != NULL) {
-					const FunctionDecl * ancestor = dyn_cast<FunctionDecl>(decl) ;
-					if (func  == NULL) {
-						//That means this ancestor is a statement, we should go no further
-						break;
-					} else if ( dyn_cast<FunctionDecl>(decl)) {
-						//If it's a CallExpr, we only want the innermost, so update the ancestor and abort
-						func = (FunctionDecl *) ancestor;
-						break;
-					} else {
-						//We haven't hit a maximal ancestor, update and keep iterating
-						func = (FunctionDecl *) ancestor;
-					}
-				}	
-			}
-				//Figure out which parameter of the function we are supplying the reference to
-				//Iterate over all arguments
-				unsigned int argNum = 0;
-				for (FunctionDecl::param_iterator paitr = func->param_begin(); paitr != func->param_end(); paitr = paitr+1) {
-					//when we find the one that has the ParamVarDecl
-					if (parm  == (*paitr)) break;
-					argNum++;
-				}
-			//HORIZONTAL PROPAGATION
-			//Make sure functions declared in other ASTs with the same prototype inherit the change	
-					    std::vector<std::pair<FunctionDecl *, SourceTuple *> > funcVec = AllFuncsByCanon[func->getFirstDecl()->getLocStart().printToString(*(std::get<0>(*ST)))];
-	    				    for (std::vector<std::pair<FunctionDecl *, SourceTuple *> >::iterator fitr = funcVec.begin(); fitr != funcVec.end(); fitr++) {
-						func = (*fitr).first;
-						// Replace the old parameter from the triggering function with this variant's parameter (when declared in multiple ASTs)
-						parm = func->getParamDecl(argNum);
-										if (!hasFlaggedDecl(&DeclsToTranslate, parm)) {
-											//Add it to the list
-											DeclsToTranslate.push_back(std::pair<NamedDecl*, SourceTuple*>((dyn_cast<NamedDecl>(parm)), (*fitr).second));
-										} else {
-	//TODO Any other logic for already-flagged variables
-	}
-						//Get the target parameter
-						//Upwards propagate it
-						std::string funcDeclLoc = func->getLocStart().printToString(*(std::get<0>(*((*fitr).second))));
-//						llvm::errs() << "CU2CL DEBUG: inspection loc: \"" << funcDeclLoc << "\"\n";
-						std::vector<DeclRefExpr *> funcRefs = AllDeclRefsByDecl[funcDeclLoc];
-						for (std::vector<DeclRefExpr *>::iterator funcRef = funcRefs.begin(); funcRef != funcRefs.end(); funcRef++) {
-						 //Loop over all references to that function declaration
-							//ASTContext::ParentVector fParents = AST->getParents(*(dyn_cast<Stmt>(*funcRef)));
-							ASTContext::ParentVector fParents = (std::get<3>(*((*fitr).second)))->getParents(*(dyn_cast<Stmt>(*funcRef)));
-							//The above should give us *all* the ancestors, look backwards until the next parent is a Stmt but not an Expr
-							ASTContext::ParentVector::iterator fPitr;
-							Stmt * fStmt;
-							Expr *  ancestor;
-							for (fPitr = fParents.begin(); fPitr != fParents.end(); fParents = (std::get<3>(*((*fitr).second)))->getParents(*fPitr), fPitr = fParents.begin()) {
-								fStmt = (Stmt*) ((fPitr)->get<Stmt>());
-								if (fStmt != NULL) {
-									const Expr * fExpr = dyn_cast<Expr>(fStmt) ;
-									if (fExpr  == NULL) {
-									//That means this ancestor is a statement, we should go no further
-										break;
-									} else if ( dyn_cast<CallExpr>(fStmt)) {
-									//If it's a CallExpr, we only want the innermost, so update the ancestor and abort
-										ancestor = (Expr *) fExpr;
-										break;
-									} else {
-									//We haven't hit a maximal ancestor, update and keep iterating
-										ancestor = (Expr *) fExpr;
-									}
-								}
-							}
-							CallExpr * funcCall = dyn_cast<CallExpr>(fStmt);
-							if (funcCall) {
-								Expr* argExpr = funcCall->getArg(argNum)->IgnoreImplicit();
-								if (argExpr) {
-									DeclRefExpr* argRef = dyn_cast<DeclRefExpr>(argExpr);
-									if (argRef) { // It's a single variable reference as the argument
-										//Simply grab the Decl referred to and submit it
-										NamedDecl * argDecl = argRef->getDecl();
-										if (!hasFlaggedDecl(&DeclsToTranslate, argDecl)) {
-											//Add it to the list
-											DeclsToTranslate.push_back(std::pair<NamedDecl*, SourceTuple*>((dyn_cast<NamedDecl>(argDecl)), (*fitr).second));
-										} else {
-	//TODO Any other logic for already-flagged variables	
-}
-									} else {
-									llvm::errs() << "Tried to upwards propagate a non-simple argument!\n";
-									}
-								} else {
-									llvm::errs() << "CU2CL Debug: Invalid argExpr in upwards propagation!\n" ;
-								}
-							} else {
-								llvm::errs() << "Error: Couldn't get CallExpr for upwards propagation of called DeclRefExpr!\n";
-							}
-						    }
-						}
-
+	//Process all deferred cl_mem translations
+	//Seed the propagation graph with every Decl flagged during the per-AST pass, then
+	// flag everything reachable from them, visiting each Decl and edge once
+	PhaseTimer propagationTimer(Session->ToolTimes, Phase_Propagation);
+	for (std::vector<DeclLocKey>::iterator ditr = Session->DeclsToTranslate.begin(); ditr != Session->DeclsToTranslate.end(); ditr++) {
+		Session->PropGraph.flag(*ditr);
+	}
+	const std::vector<unsigned> &flaggedNodes = Session->PropGraph.solve();
+	for (std::vector<unsigned>::const_iterator nitr = flaggedNodes.begin(); nitr != flaggedNodes.end(); nitr++) {
+		const std::vector<PropagationInstance> &insts = Session->PropGraph.getInstances(*nitr);
+		if (insts.empty()) continue;
+		//Instances of the same Decl from several TUs generate the same rewrite, which dedup collapses
+		for (std::vector<PropagationInstance>::const_iterator iitr = insts.begin(); iitr != insts.end(); iitr++) {
+		    Session->GlobalHostReplace.insert(Session->GlobalHostReplace.end(), iitr->Rewrite.begin(), iitr->Rewrite.end());
+		    //And any vector rewrite of the same declaration is superseded
+		    Session->GlobalHostVecVars.erase(iitr->VecKey);
 		}
-		dend = DeclsToTranslate.size();
-
 	}
 	//After propagating all cl_mems, clear off any vector rewrites that overlap with them
-	for (std::map<SourceLocation, Replacement>::const_iterator I = GlobalHostVecVars.begin(), E = GlobalHostVecVars.end(); I != E; I++) {
-		GlobalHostReplace.push_back(I->second);
+	for (std::map<DeclLocKey, Replacement>::const_iterator I = Session->GlobalHostVecVars.begin(), E = Session->GlobalHostVecVars.end(); I != E; I++) {
+		Session->GlobalHostReplace.push_back(I->second);
 	}
+	propagationTimer.stop();
 
 	//Inject local boilerplate functions that have been staged from each TU
 	// (this is done here rather than where they are generated to ensure the program/kernel variables are declared before the functions, but after the include statements)
 	//Since we don't need to rewrite utility files, there is no reason to assemble a rep_str
 	// instead we create Replacements directly (which has the benefit of deduplication)
-	for (FileStrCacheMap::iterator i = LocalBoilDefs.begin(), e = LocalBoilDefs.end(); i != e; i++) {
+	for (FileStrCacheMap::iterator i = Session->LocalBoilDefs.begin(), e = Session->LocalBoilDefs.end(); i != e; i++) {
 	    //Get a fid for the file, if it doesn't exist in the SM, force it
 	    const FileEntry * FE = Files.getFile((*i).first);
 	    FileID fid = RewriteSM.translateFile(FE);
@@ -4488,54 +6307,59 @@ int main(int argc, const char ** argv) {
 	    //Get a SourceLocation for the start of the file
 	    SourceLocation Loc = RewriteSM.getLocForStartOfFile(fid);
 	    for (std::vector<std::string>::iterator j = (*i).second.begin(), f = (*i).second.end(); j != f; j++) {
-	        generateReplacement(GlobalHostReplace, &RewriteSM, Loc, 0, (*j));
+	        generateReplacement(Session->GlobalHostReplace, &RewriteSM, Loc, 0, (*j));
 	    }
 	}
 	
 	//After all Decls are appropriately generated, add the utility functions
 	//cu2cl_util.h
-	for (std::vector<std::string>::iterator i = GlobalHDecls.begin(), e = GlobalHDecls.end(); i != e; i++) {
+	for (std::vector<std::string>::iterator i = Session->GlobalHDecls.begin(), e = Session->GlobalHDecls.end(); i != e; i++) {
 	    *cu2cl_header << (*i) + "\n";
 	}
 	//cu2cl_util.c
-	for (std::vector<std::string>::iterator i = GlobalCFuncs.begin(), e = GlobalCFuncs.end(); i != e; i++) {
+	for (std::vector<std::string>::iterator i = Session->GlobalCFuncs.begin(), e = Session->GlobalCFuncs.end(); i != e; i++) {
 	    *cu2cl_util << (*i) + "\n";
 	}
 	//cu2cl_util.cl
-	for (std::vector<std::string>::iterator i = GlobalCLFuncs.begin(), e = GlobalCLFuncs.end(); i != e; i++) {
+	for (std::vector<std::string>::iterator i = Session->GlobalCLFuncs.begin(), e = Session->GlobalCLFuncs.end(); i != e; i++) {
 	    *cu2cl_kernel << (*i) + "\n";
 	}
 
 
 	//After pushing all the utility functions out, add the global init/cleanup calls to cu2cl_util.c
-	*cu2cl_util << CU2CLInit + "\n";
-	*cu2cl_util << CU2CLClean;	
+	*cu2cl_util << Session->CU2CLInit + "\n";
+	*cu2cl_util << Session->CU2CLClean;	
 
 	//After all Source files have been processed, they will have accumulated their Replacments
 	// into the global data structures, now deduplicate and fuse across them
 
 	//Before dumping replacements, don't forget to flush the comment buffer
+	PhaseTimer commentTimer(Session->ToolTimes, Phase_CommentFlush);
 	writeComments(&RewriteSM);
-	free(head);
-	head = NULL;
-	tail = NULL;
+	commentTimer.stop();
+	PendingComments = NULL;
+	PhaseTimer dedupTimer(Session->ToolTimes, Phase_Dedup);
 	std::vector<Range> conflicts;
 	std::vector<Replacement> GlobalHostConflicts, GlobalKernConflicts;
-	deduplicate(GlobalHostReplace, conflicts);
-	coalesceReplacements(GlobalHostReplace);
-	deduplicate(GlobalKernReplace, conflicts);
-	coalesceReplacements(GlobalKernReplace);
+	deduplicate(Session->GlobalHostReplace, conflicts);
+	coalesceReplacements(Session->GlobalHostReplace);
+	deduplicate(Session->GlobalKernReplace, conflicts);
+	coalesceReplacements(Session->GlobalKernReplace);
+	dedupTimer.stop();
 	
 
 	//Apply the global set of replacements to each of them
+	PhaseTimer applyTimer(Session->ToolTimes, Phase_Apply);
 	//debugPrintReplacements(GlobalHostReplace);
-	applyAllReplacements(GlobalHostReplace, GlobalHostRewrite);
+	applyAllReplacements(Session->GlobalHostReplace, GlobalHostRewrite);
 	//debugPrintReplacements(GlobalKernReplace);
-	applyAllReplacements(GlobalKernReplace, GlobalKernRewrite);
+	applyAllReplacements(Session->GlobalKernReplace, GlobalKernRewrite);
+	applyTimer.stop();
 
 
 	//Flush all rewritten #included host files
-        for (IDOutFileMap::iterator i = OutFiles.begin(), e = OutFiles.end();
+	PhaseTimer flushTimer(Session->ToolTimes, Phase_FileFlush);
+        for (IDOutFileMap::iterator i = Session->OutFiles.begin(), e = Session->OutFiles.end();
              i != e; i++) {
 		
 		const FileEntry * FE = Files.getFile((*i).first);
@@ -4545,7 +6369,8 @@ int main(int argc, const char ** argv) {
 		    llvm::errs() << "File [" << (*i).first << "] has invalid (zero) FID, attempting forced creation!\n\t(Likely cause is lack of rewrites in both host and kernel outputs.)\n";
 		    fid = RewriteSM.createFileID(FE, SourceLocation(), SrcMgr::C_User);
 		    if (fid.isInvalid()) {
-			llvm::errs() << "\tError file [" << (*i).first << "] still has invalid (zero) FID, dropping output! (Temp files may persist.)\n";
+			llvm::errs() << "\tError file [" << (*i).first << "] still has invalid (zero) FID, dropping output!\n";
+			discardOutputFile(outFile);
 			continue;
 		    } else {
 			llvm::errs() << "\tForced FID creation for file [" << (*i).first << "] succeeded, proceeding with output.\n";
@@ -4562,18 +6387,20 @@ int main(int argc, const char ** argv) {
                 *(outFile->OS) << std::string(fileBuf.begin(), fileBuf.end());
 		llvm::errs() << "No changes made to " << RewriteSM.getFileEntryForID(fid)->getName() << "\n";
             }
-            outFile->OS->flush();
-	    clearOutputFile(outFile, &Files);
+	    commitOutputFile(outFile);
         }
 
 	//Flush rewritten #included kernel files
-        for (IDOutFileMap::iterator i = KernelOutFiles.begin(), e = KernelOutFiles.end();
+	//Remember the ones some __cu2cl_Init_<file> builds a program from, for '--embed-kernels' and '--precompile-kernels'
+	std::vector<std::pair<std::string, std::string> > ProgramKernels;
+        for (IDOutFileMap::iterator i = Session->KernelOutFiles.begin(), e = Session->KernelOutFiles.end();
              i != e; i++) {
             FileID fid = RewriteSM.translateFile(Files.getFile((*i).first));
             OutputFile * outFile = (*i).second;
 		if (fid.isInvalid()) {
 		    llvm::errs() << "Error file [" << (*i).first << "] has invalid (zero) fid!\n";
 		    //Push the file to the redo list, it might show up in the SM once it's relevant main file is processed
+		    discardOutputFile(outFile);
 		    continue;
 		}
             if (const RewriteBuffer *RewriteBuff =
@@ -4583,26 +6410,100 @@ int main(int argc, const char ** argv) {
             else {
                 llvm::errs() << "No (kernel) changes made to " << RewriteSM.getFileEntryForID(fid)->getName() << "\n";
             }
-            outFile->OS->flush();
-	    clearOutputFile(outFile, &Files);
+	    std::string id = idCharFilter(filename((*i).first));
+	    if (std::find(Session->GlobalHDecls.begin(), Session->GlobalHDecls.end(), "void __cu2cl_Init_" + id + "();\n") != Session->GlobalHDecls.end())
+		ProgramKernels.push_back(std::make_pair(id, outFile->Filename));
+	    commitOutputFile(outFile);
         }
+	flushTimer.stop();
 
 
-	llvm::errs() << "Retained " << AllASTs.size() << " ASTContexts!\n";
-	//Release the retained ASTContexts now that we're done with their contents
-	for (ASTContVec::iterator ast = AllASTs.begin(); ast != AllASTs.end(); ast++) (*ast)->Release();
+	removePreludeDir();
 
 
 	//Before flushing the header, we must wrap the function definitions with the closing #ifdef __cplusplus brace
 	*cu2cl_header << "\n#ifdef __cplusplus\n";
 	*cu2cl_header << "}\n";
 	*cu2cl_header << "#endif\n";
+	*cu2cl_header << "#endif\n";
 
 	//Add standard boilerplate to the header
-	cu2cl_util->flush();
-	cu2cl_header->flush();
-	cu2cl_kernel->flush();
+	PhaseTimer utilFlushTimer(Session->ToolTimes, Phase_FileFlush);
+	commitOutputFile(UtilOF);
+	commitOutputFile(HeaderOF);
+	commitOutputFile(KernelOF);
+	if (Session->UsesCU2CLUtilCL) ProgramKernels.push_back(std::make_pair("cu2cl_util", "cu2cl_util.cl"));
+	utilFlushTimer.stop();
+
+	//Compile each of them to SPIR next to it, which also checks that the kernel output compiles
+	if (Session->PrecompileKernels) {
+	    PhaseTimer precompileTimer(Session->ToolTimes, Phase_KernelPrecompile);
+	    std::set<std::string> precompiled;
+	    for (std::vector<std::pair<std::string, std::string> >::iterator i = ProgramKernels.begin(), e = ProgramKernels.end(); i != e; i++) {
+		if (!precompiled.insert(i->second).second) continue;
+		const char *targets[] = { "spir", "spir64" };
+		for (unsigned t = 0; t < 2; t++) {
+		    SmallString<128> spirName(i->second);
+		    replace_extension(spirName, targets[t]);
+		    std::string bitcode;
+		    if (compileKernelToSPIR(i->second, std::string(targets[t]) + "-unknown-unknown", bitcode)) Session->Outputs[spirName.str()] = bitcode;
+		    else llvm::errs() << "Unable to precompile [" << i->second << "] for " << targets[t] << ", it will be built from source at runtime\n";
+		}
+	    }
+	}
+
+	//Generate cu2cl_kernels.c, which holds every kernel file a program is built from, so the
+	// translated program reads none of them at startup
+	if (Session->EmbedKernels) {
+	    OutputFile *KernelsOF = new OutputFile("cu2cl_kernels.c");
+	    *KernelsOF->OS << CU2CL_LICENSE;
+	    *KernelsOF->OS << "#include \"cu2cl_util.h\"\n\n";
+	    std::set<std::string> embedded;
+	    for (std::vector<std::pair<std::string, std::string> >::iterator i = ProgramKernels.begin(), e = ProgramKernels.end(); i != e; i++) {
+		//Files with the same name share their program variables too, the first one wins
+		if (!embedded.insert(i->first).second) continue;
+		std::set<std::string> active;
+		writeEmbeddedSource(*KernelsOF->OS, i->first, inlineKernelIncludes(i->second, active));
+		//Precompiled binaries are embedded alongside, empty if they didn't compile
+		const char *targets[] = { "spir", "spir64" };
+		for (unsigned t = 0; t < 2 && Session->PrecompileKernels; t++) {
+		    SmallString<128> spirName(i->second);
+		    replace_extension(spirName, targets[t]);
+		    std::map<std::string, std::string>::iterator spir = Session->Outputs.find(spirName.str());
+		    writeEmbeddedSource(*KernelsOF->OS, i->first + "_" + targets[t], spir == Session->Outputs.end() ? "" : spir->second);
+		}
+	    }
+	    commitOutputFile(KernelsOF);
+	}
+
+	if (Session->ReportTimes) printTimeReport(wallMicros() - RunStart);
+	return result;
+}
+
+namespace cu2cl {
+
+TranslationSession::TranslationSession(const TranslationOptions &options) : State(new SessionState(options)) { }
+
+TranslationSession::~TranslationSession() {
+	delete State;
+}
+
+void TranslationSession::addFile(const std::string &path, const std::string &contents) {
+	State->VirtualFiles[path] = contents;
+}
+
+int TranslationSession::translate(const CompilationDatabase &compilations, const std::vector<std::string> &sources) {
+	//Everything underneath reaches the session through Session, so point it at this one for the duration
+	SessionState *outer = Session;
+	Session = State;
+	int result = runTranslation(compilations, sources);
+	Session = outer;
+	return result;
+}
+
+const std::map<std::string, std::string> &TranslationSession::getOutputs() const {
+	return State->Outputs;
+}
 
-	
 }
 
@@ -0,0 +1,76 @@
+/*
+* CU2CL - A prototype CUDA-to-OpenCL translator built on the Clang compiler infrastructure
+* Version 0.8.0b (beta)
+*
+* (C) 2010-2017 Virginia Polytechnic Institute & State University (also known as "Virginia Tech"). All Rights Reserved.
+* This software is provided as-is.  Neither the authors, Virginia Tech nor Virginia Tech Intellectual Properties, Inc. assert, warrant, or guarantee that the software is fit for any purpose whatsoever, nor do they collectively or individually accept any responsibility or liability for any action or activity that results from the use of this software.  The entire risk as to the quality and performance of the software rests with the user, and no remedies shall be provided by the authors, Virginia Tech or Virginia Tech Intellectual Properties, Inc.
+*
+*    This library is free software; you can redistribute it and/or modify it under the terms of the attached GNU Lesser General Public License v2.1 as published by the Free Software Foundation.
+*
+*    This library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more details.
+*
+*   You should have received a copy of the GNU Lesser General Public License along with this library; if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*
+* Authors: Paul Sathre, Gabriel Martinez
+*
+*/
+
+//cu2cl-tool: reads the translation options off the command line, runs a cu2cl::TranslationSession
+// over the source files and writes everything it produced out to disk
+
+#include "cu2cl.h"
+
+#include "clang/Tooling/CommonOptionsParser.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace clang::tooling;
+
+//Every option lands directly in the session's options
+static cu2cl::TranslationOptions Options;
+
+//Add custom cu2cl arguments
+llvm::cl::opt<bool, true> Comments("inline-comments", llvm::cl::desc("Add inline descriptive comments to output (boolean, default \"true\")."),  llvm::cl::location(Options.AddInlineComments));
+llvm::cl::opt<std::string, true> ExtraArgs("cl-extra-args", llvm::cl::desc("Additional compiler arguments to append to all generated clBuildProgram calls."), llvm::cl::value_desc("<\"args\">"), llvm::cl::location(Options.ExtraBuildArgs), llvm::cl::init(""));
+llvm::cl::opt<bool, true> KernelRename("rename-kernel-files", llvm::cl::desc("Replace instances of \"kernel\" in filenames with \"knl\""), llvm::cl::location(Options.FilterKernelName));
+llvm::cl::opt<std::string, true> BinaryCache("cl-binary-cache", llvm::cl::desc("Have the generated initialization cache built OpenCL program binaries in <dir> ($CU2CL_BINARY_CACHE overrides it at runtime), and reuse them instead of rebuilding from source"), llvm::cl::value_desc("<dir>"), llvm::cl::location(Options.BinaryCacheDir), llvm::cl::init(""));
+llvm::cl::opt<bool, true> ConcurrentBuilds("concurrent-builds", llvm::cl::desc("Have the generated initialization build every OpenCL program at once, on its own thread (needs pthreads on POSIX hosts)"), llvm::cl::location(Options.ConcurrentBuilds));
+llvm::cl::opt<bool, true> LazyInit("lazy-init", llvm::cl::desc("Have kernel launches build their OpenCL program and create their kernel on first use, instead of __cu2cl_Init creating all of them up front"), llvm::cl::location(Options.LazyInit));
+llvm::cl::opt<bool, true> EmbedKernels("embed-kernels", llvm::cl::desc("Also write every *-cl.cl (and cu2cl_util.cl) into cu2cl_kernels.c as a byte array, and build programs from those instead of reading the files at runtime"), llvm::cl::location(Options.EmbedKernels));
+llvm::cl::opt<std::string, true> PrecompileKernels("precompile-kernels", llvm::cl::desc("Also compile every *-cl.cl to SPIR (*-cl.spir and *-cl.spir64) with Clang, which the generated initialization loads on cl_khr_spir devices (\"=<args>\" passes extra Clang arguments, such as the include of an OpenCL builtins header)"), llvm::cl::value_desc("<args>"), llvm::cl::ValueOptional, llvm::cl::location(Options.PrecompileArgs), llvm::cl::init(""));
+llvm::cl::opt<unsigned, true> MemoryPool("memory-pool", llvm::cl::desc("Translate cudaMalloc/cudaFree to a caching allocator that keeps up to this many MiB of freed device buffers for reuse (default 0, no pool)"), llvm::cl::value_desc("<MiB>"), llvm::cl::location(Options.MemoryPoolMB), llvm::cl::init(0));
+llvm::cl::opt<bool, true> ImportGCCPaths("import-gcc-paths", llvm::cl::desc("Use GCC to infer search path(s) for system include directories"), llvm::cl::location(Options.UseGCCPaths));
+llvm::cl::opt<bool, true> PreludePCH("pch-prelude", llvm::cl::desc("Precompile the CUDA runtime headers included ahead of every file once, rather than parsing them for each file (boolean, default \"true\")."), llvm::cl::location(Options.UsePreludePCH));
+llvm::cl::opt<std::string, true> Cache("cache-dir", llvm::cl::desc("Directory to keep translated files in, so that re-runs only re-parse sources that (or whose #included headers) changed"), llvm::cl::value_desc("<dir>"), llvm::cl::location(Options.CacheDir), llvm::cl::init(""));
+llvm::cl::opt<std::string, true> TimeReport("time-report", llvm::cl::desc("Print wall-clock and CPU time per translation phase, peak memory and per-file Replacement counts when done (\"=json\" prints it as JSON on stdout)"), llvm::cl::value_desc("json"), llvm::cl::ValueOptional, llvm::cl::location(Options.TimeReportFormat), llvm::cl::init(""));
+llvm::cl::opt<std::string, true> EmitSummary("emit-summary", llvm::cl::desc("Translate the source files but, instead of writing any output, save everything they contribute to <file> for a later '--merge' run"), llvm::cl::value_desc("<file>"), llvm::cl::location(Options.SummaryFile), llvm::cl::init(""));
+llvm::cl::opt<bool, true> PreScan("prescan", llvm::cl::desc("Lex each file first, and copy files with no CUDA in them (or their #included headers) through without parsing (boolean, default \"true\")."), llvm::cl::location(Options.UsePreScan));
+llvm::cl::opt<bool, true> HeaderBodies("skip-header-bodies", llvm::cl::desc("Don't build function bodies in CUDA, system and angle-#included headers, or in headers another file already translated (boolean, default \"true\")."), llvm::cl::location(Options.SkipHeaderBodies));
+llvm::cl::opt<bool, true> Merge("merge", llvm::cl::desc("Treat the input files as '--emit-summary' files, and write the output of all of them without parsing anything"), llvm::cl::location(Options.MergeSummaries));
+llvm::cl::opt<unsigned, true> Jobs("j", llvm::cl::desc("Number of translation units to parse and rewrite concurrently (0 uses one per hardware thread)"), llvm::cl::value_desc("N"), llvm::cl::location(Options.NumJobs), llvm::cl::init(1));
+
+int main(int argc, const char ** argv) {
+	
+	//Before we do anything, parse off common arguments, a la MPI
+	CommonOptionsParser options(argc, argv);
+	Options.ReportTimes = TimeReport.getNumOccurrences() > 0;
+	Options.PrecompileKernels = PrecompileKernels.getNumOccurrences() > 0;
+
+	cu2cl::TranslationSession session(Options);
+	int result = session.translate(options.getCompilations(), options.getSourcePathList());
+
+	//Outputs are named relative to wherever the translation left the working directory, as they always were
+	const std::map<std::string, std::string> &outputs = session.getOutputs();
+	for (std::map<std::string, std::string>::const_iterator i = outputs.begin(), e = outputs.end(); i != e; i++) {
+	    std::string error;
+	    llvm::raw_fd_ostream OS(i->first.c_str(), error);
+	    if (!error.empty()) {
+		llvm::errs() << "Unable to write CU2CL output [" << i->first << "]!\n\t Diag Msg: " << error << "\n";
+		result = 1;
+		continue;
+	    }
+	    OS << i->second;
+	}
+	return result;
+}